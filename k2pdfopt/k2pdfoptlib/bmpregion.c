@@ -22,7 +22,10 @@
 
 #include "k2pdfopt.h"
 
-static void trim_to(int *count,int *i1,int i2,double gaplen,int dpi,double defect_size_pts);
+static void trim_to(int *count,int *i1,int i2,double gaplen,int dpi,double defect_size_pts,
+                    INKBLOBS *blobs,int j1,int j2,int is_col);
+static int defect_level(int dpi,double defect_size_pts);
+static int inkblobs_line_is_real(INKBLOBS *blobs,int i,int j1,int j2,int is_col,int dlevel);
 static int height2_calc(int *rc,int n);
 static void bmpregion_count_text_row_pixels(BMPREGION *region,int *gw,int *copt,int *ngaps,
                                             K2PDFOPT_SETTINGS *k2settings);
@@ -35,27 +38,973 @@ static int word_longer_than(int gap_thresh,int *gw,int *copt,int ngaps,int displ
 */
 
 
-int bmpregion_row_black_count(BMPREGION *region,int r0)
+void blacksat_init(BLACKSAT *sat)
 
     {
-    unsigned char *p;
-    int i,nc,c;
+    sat->bmp8=NULL;
+    sat->bgcolor=-1;
+    sat->width=sat->height=0;
+    sat->sum=NULL;
+    sat->size_allocated=0;
+    }
 
-    p=bmp_rowptr_from_top(region->bmp8,r0)+region->c1;
-    nc=region->c2-region->c1+1;
-    for (c=i=0;i<nc;i++,p++)
-        if (p[0]<region->bgcolor)
-            c++;
+
+void blacksat_free(BLACKSAT *sat)
+
+    {
+    static char *funcname="blacksat_free";
+
+    willus_mem_free((double **)&sat->sum,funcname);
+    blacksat_init(sat);
+    }
+
+
+/*
+** The table takes four bytes per pixel, so it isn't built for pages larger
+** than this (e.g. at high -idpi).  The page's ink runs (INKRUNS) are used
+** for those instead.
+*/
+#define BLACKSAT_MAX_PIXELS 1.6e7
+
+/*
+** (Re)build the summed-area table of the pixels in bmp8 darker than bgcolor.
+** If the page is too large or there isn't enough memory, sat->sum is left
+** NULL and the callers count the pixels another way.
+*/
+void blacksat_build(BLACKSAT *sat,WILLUSBITMAP *bmp8,int bgcolor)
+
+    {
+    int r,c,w1;
+    long size;
+    static char *funcname="blacksat_build";
+
+    sat->bmp8=bmp8;
+    sat->bgcolor=bgcolor;
+    sat->width=bmp8->width;
+    sat->height=bmp8->height;
+    if ((double)sat->width*sat->height > BLACKSAT_MAX_PIXELS)
+        {
+        willus_mem_free((double **)&sat->sum,funcname);
+        sat->size_allocated=0;
+        return;
+        }
+    w1=sat->width+1;
+    size=(long)sizeof(int)*w1*(sat->height+1);
+    if (sat->sum!=NULL && sat->size_allocated<size)
+        willus_mem_free((double **)&sat->sum,funcname);
+    if (sat->sum==NULL)
+        {
+        if (!willus_mem_alloc((double **)&sat->sum,size,funcname))
+            {
+            sat->sum=NULL;
+            sat->size_allocated=0;
+            return;
+            }
+        sat->size_allocated=size;
+        }
+    memset(sat->sum,0,sizeof(int)*w1);
+    for (r=0;r<sat->height;r++)
+        {
+        unsigned char *p;
+        int *s,*s0,rowsum;
+
+        p=bmp_rowptr_from_top(bmp8,r);
+        s0=&sat->sum[r*w1];
+        s=&s0[w1];
+        s[0]=0;
+        for (rowsum=c=0;c<sat->width;c++)
+            {
+            if (p[c]<bgcolor)
+                rowsum++;
+            s[c+1]=s0[c+1]+rowsum;
+            }
+        }
+    }
+
+
+/*
+** Returns the region's summed-area table if it is valid for the region's
+** bitmap and background threshold, NULL otherwise.
+*/
+BLACKSAT *bmpregion_blacksat(BMPREGION *region)
+
+    {
+    BLACKSAT *sat;
+
+    sat=region->blacksat;
+    if (sat==NULL || sat->sum==NULL || sat->bmp8!=region->bmp8 || sat->bgcolor!=region->bgcolor)
+        return(NULL);
+    return(sat);
+    }
+
+
+void inkmask_init(INKMASK *mask)
+
+    {
+    mask->bmp8=NULL;
+    mask->bgcolor=-1;
+    mask->width=mask->height=0;
+    mask->wpr=0;
+    mask->bits=NULL;
+    mask->size_allocated=0;
+    mask->stale=0;
+    }
+
+
+void inkmask_free(INKMASK *mask)
+
+    {
+    static char *funcname="inkmask_free";
+
+    willus_mem_free((double **)&mask->bits,funcname);
+    inkmask_init(mask);
+    }
+
+
+/*
+** (Re)build the 1-bit mask of the pixels in bmp8 darker than bgcolor.
+** Unused bits at the end of each row are zero.  If there isn't enough
+** memory, mask->bits is left NULL.
+*/
+void inkmask_build(INKMASK *mask,WILLUSBITMAP *bmp8,int bgcolor)
+
+    {
+    int r;
+    long size;
+    static char *funcname="inkmask_build";
+
+    mask->stale=0;
+    mask->bmp8=bmp8;
+    mask->bgcolor=bgcolor;
+    mask->width=bmp8->width;
+    mask->height=bmp8->height;
+    mask->wpr=(mask->width+31)>>5;
+    size=(long)sizeof(unsigned int)*mask->wpr*mask->height;
+    if (mask->bits!=NULL && mask->size_allocated<size)
+        willus_mem_free((double **)&mask->bits,funcname);
+    if (mask->bits==NULL)
+        {
+        if (!willus_mem_alloc((double **)&mask->bits,size,funcname))
+            {
+            mask->bits=NULL;
+            mask->size_allocated=0;
+            return;
+            }
+        mask->size_allocated=size;
+        }
+    for (r=0;r<mask->height;r++)
+        {
+        unsigned char *p;
+        unsigned int *w;
+        int c;
+
+        p=bmp_rowptr_from_top(bmp8,r);
+        w=&mask->bits[r*mask->wpr];
+        memset(w,0,sizeof(unsigned int)*mask->wpr);
+        for (c=0;c<mask->width;c++)
+            if (p[c]<bgcolor)
+                w[c>>5] |= (1u<<(c&31));
+        }
+    }
+
+
+/*
+** Make the mask valid for bmp8 and bgcolor without building it yet--that
+** is done by the first bmpregion_inkmask() call that needs it.
+*/
+void inkmask_clear(INKMASK *mask,WILLUSBITMAP *bmp8,int bgcolor)
+
+    {
+    mask->bmp8=bmp8;
+    mask->bgcolor=bgcolor;
+    mask->stale=1;
+    }
+
+
+/*
+** Returns the region's ink mask if it is valid for the region's bitmap
+** and background threshold (building it if it hasn't been yet), NULL
+** otherwise.
+*/
+INKMASK *bmpregion_inkmask(BMPREGION *region)
+
+    {
+    INKMASK *mask;
+
+    mask=region->inkmask;
+    if (mask==NULL || mask->bmp8!=region->bmp8 || mask->bgcolor!=region->bgcolor)
+        return(NULL);
+    if (mask->stale)
+        inkmask_build(mask,mask->bmp8,mask->bgcolor);
+    return(mask->bits==NULL ? NULL : mask);
+    }
+
+
+#define inkmask_pixel(mask,r,c) (((mask)->bits[(r)*(mask)->wpr+((c)>>5)]>>((c)&31))&1)
+
+static int inkmask_popcount(unsigned int x)
+
+    {
+#if (defined(__GNUC__))
+    return(__builtin_popcount(x));
+#else
+    x = x - ((x>>1) & 0x55555555u);
+    x = (x & 0x33333333u) + ((x>>2) & 0x33333333u);
+    x = (x + (x>>4)) & 0x0f0f0f0fu;
+    return((int)((x*0x01010101u)>>24));
+#endif
+    }
+
+
+/* Index of the lowest set bit (x!=0) */
+static int inkmask_ctz(unsigned int x)
+
+    {
+#if (defined(__GNUC__))
+    return(__builtin_ctz(x));
+#else
+    int b;
+
+    for (b=0;!((x>>b)&1);b++);
+    return(b);
+#endif
+    }
+
+
+/*
+** # of dark pixels in row r, columns c1..c2 (inclusive, inside the bitmap)
+*/
+static int inkmask_count_row(INKMASK *mask,int r,int c1,int c2)
+
+    {
+    unsigned int *w;
+    unsigned int m1,m2;
+    int i,i1,i2,c;
+
+    if (c2<c1)
+        return(0);
+    w=&mask->bits[r*mask->wpr];
+    i1=c1>>5;
+    i2=c2>>5;
+    m1=0xffffffffu<<(c1&31);
+    m2=0xffffffffu>>(31-(c2&31));
+    if (i1==i2)
+        return(inkmask_popcount(w[i1]&m1&m2));
+    c=inkmask_popcount(w[i1]&m1)+inkmask_popcount(w[i2]&m2);
+    for (i=i1+1;i<i2;i++)
+        c+=inkmask_popcount(w[i]);
+    return(c);
+    }
+
+
+/*
+** count[c-c1]++ for each dark pixel c in row r, columns c1..c2
+*/
+static void inkmask_accumulate_row(int *count,INKMASK *mask,int r,int c1,int c2)
+
+    {
+    unsigned int *w;
+    int i,i1,i2;
+
+    if (c2<c1)
+        return;
+    w=&mask->bits[r*mask->wpr];
+    i1=c1>>5;
+    i2=c2>>5;
+    for (i=i1;i<=i2;i++)
+        {
+        unsigned int x;
+
+        x=w[i];
+        if (i==i1)
+            x &= 0xffffffffu<<(c1&31);
+        if (i==i2)
+            x &= 0xffffffffu>>(31-(c2&31));
+        /* Visit the set bits only */
+        for (;x;x&=x-1)
+            count[(i<<5)+inkmask_ctz(x)-c1]++;
+        }
+    }
+
+
+void inkruns_init(INKRUNS *runs)
+
+    {
+    runs->mask=NULL;
+    runs->bmp8=NULL;
+    runs->bgcolor=-1;
+    runs->width=runs->height=0;
+    runs->rowstart=NULL;
+    runs->run=NULL;
+    runs->nruns=0;
+    runs->rowstart_allocated=0;
+    runs->run_allocated=0;
+    runs->stale=0;
+    }
+
+
+void inkruns_free(INKRUNS *runs)
+
+    {
+    static char *funcname="inkruns_free";
+
+    willus_mem_free((double **)&runs->run,funcname);
+    willus_mem_free((double **)&runs->rowstart,funcname);
+    inkruns_init(runs);
+    }
+
+
+/*
+** (Re)build the dark pixel runs from the ink mask (building the mask first
+** if it is stale).  Whole white words of the mask are skipped, so this is
+** O(area/32 + ink).  If the mask couldn't be built or there isn't enough
+** memory, runs->rowstart is left NULL.
+*/
+void inkruns_build(INKRUNS *runs,INKMASK *mask)
+
+    {
+    int r;
+    static char *funcname="inkruns_build";
+
+    if (mask->stale)
+        inkmask_build(mask,mask->bmp8,mask->bgcolor);
+    runs->nruns=0;
+    runs->stale=0;
+    if (mask->bits==NULL)
+        {
+        inkruns_free(runs);
+        return;
+        }
+    runs->mask=mask;
+    runs->bmp8=mask->bmp8;
+    runs->bgcolor=mask->bgcolor;
+    runs->width=mask->width;
+    runs->height=mask->height;
+    if (runs->rowstart_allocated < runs->height+1)
+        {
+        willus_mem_free((double **)&runs->rowstart,funcname);
+        runs->rowstart_allocated=0;
+        if (!willus_mem_alloc((double **)&runs->rowstart,(long)sizeof(int)*(runs->height+1),
+                              funcname))
+            {
+            inkruns_free(runs);
+            return;
+            }
+        runs->rowstart_allocated=runs->height+1;
+        }
+    for (r=0;r<runs->height;r++)
+        {
+        unsigned int *w;
+        int c;
+
+        runs->rowstart[r]=runs->nruns;
+        w=&mask->bits[r*mask->wpr];
+        for (c=0;c<runs->width;)
+            {
+            unsigned int x;
+            int i,c1;
+
+            /* Next dark pixel at or after c */
+            i=c>>5;
+            x=w[i]&(0xffffffffu<<(c&31));
+            while (x==0 && ++i<mask->wpr)
+                x=w[i];
+            if (x==0)
+                break;
+            c1=(i<<5)+inkmask_ctz(x);
+            /* Next white pixel after c1 (unused bits past the row end are 0) */
+            x=(~w[i])&(0xffffffffu<<(c1&31));
+            while (x==0 && ++i<mask->wpr)
+                x=~w[i];
+            c = (x==0) ? runs->width : (i<<5)+inkmask_ctz(x);
+            if (runs->nruns >= runs->run_allocated)
+                {
+                int newsize;
+
+                newsize = runs->run_allocated<1024 ? 1024 : runs->run_allocated*2;
+                if (!willus_mem_realloc_robust((double **)&runs->run,(long)sizeof(int)*2*newsize,
+                                         (long)sizeof(int)*2*runs->run_allocated,funcname))
+                    {
+                    inkruns_free(runs);
+                    return;
+                    }
+                runs->run_allocated=newsize;
+                }
+            runs->run[2*runs->nruns]=c1;
+            runs->run[2*runs->nruns+1]=c-1;
+            runs->nruns++;
+            }
+        }
+    runs->rowstart[runs->height]=runs->nruns;
+    }
+
+
+/*
+** Make the runs valid for mask (which may not be built yet either) without
+** building them--that is done by the first bmpregion_inkruns() call.
+*/
+void inkruns_clear(INKRUNS *runs,INKMASK *mask)
+
+    {
+    runs->mask=mask;
+    runs->bmp8=mask->bmp8;
+    runs->bgcolor=mask->bgcolor;
+    runs->stale=1;
+    }
+
+
+/*
+** Returns the region's ink runs if they are valid for the region's bitmap
+** and background threshold (building them and the mask if they haven't
+** been yet), NULL otherwise.  Not thread safe while the runs are stale.
+*/
+INKRUNS *bmpregion_inkruns(BMPREGION *region)
+
+    {
+    INKRUNS *runs;
+
+    runs=region->inkruns;
+    if (runs==NULL || runs->bmp8!=region->bmp8 || runs->bgcolor!=region->bgcolor)
+        return(NULL);
+    if (runs->stale)
+        inkruns_build(runs,runs->mask);
+    return(runs->rowstart==NULL ? NULL : runs);
+    }
+
+
+/*
+** Index (in run[] pairs) of the first run of row r ending at or after c1.
+*/
+static int inkruns_first(INKRUNS *runs,int r,int c1)
+
+    {
+    int i1,i2;
+
+    i1=runs->rowstart[r];
+    i2=runs->rowstart[r+1];
+    while (i1<i2)
+        {
+        int im;
+
+        im=(i1+i2)/2;
+        if (runs->run[2*im+1]<c1)
+            i1=im+1;
+        else
+            i2=im;
+        }
+    return(i1);
+    }
+
+
+/*
+** # of dark pixels in row r, columns c1..c2 (inclusive)
+*/
+static int inkruns_count_row(INKRUNS *runs,int r,int c1,int c2)
+
+    {
+    int i,n,c;
+
+    n=runs->rowstart[r+1];
+    for (c=0,i=inkruns_first(runs,r,c1);i<n && runs->run[2*i]<=c2;i++)
+        {
+        int a,b;
+
+        a = runs->run[2*i]<c1 ? c1 : runs->run[2*i];
+        b = runs->run[2*i+1]>c2 ? c2 : runs->run[2*i+1];
+        c += b-a+1;
+        }
     return(c);
     }
 
 
+/*
+** count[c-c1]++ for each dark pixel c in row r, columns c1..c2
+*/
+static void inkruns_accumulate_row(int *count,INKRUNS *runs,int r,int c1,int c2)
+
+    {
+    int i,n;
+
+    n=runs->rowstart[r+1];
+    for (i=inkruns_first(runs,r,c1);i<n && runs->run[2*i]<=c2;i++)
+        {
+        int a,b;
+
+        a = runs->run[2*i]<c1 ? c1 : runs->run[2*i];
+        b = runs->run[2*i+1]>c2 ? c2 : runs->run[2*i+1];
+        for (;a<=b;a++)
+            count[a-c1]++;
+        }
+    }
+
+
+void inkblobs_init(INKBLOBS *blobs)
+
+    {
+    blobs->runs=NULL;
+    blobs->bmp8=NULL;
+    blobs->bgcolor=-1;
+    blobs->label=NULL;
+    blobs->blob=NULL;
+    blobs->n=0;
+    blobs->label_allocated=0;
+    blobs->blob_allocated=0;
+    blobs->stale=0;
+    }
+
+
+void inkblobs_free(INKBLOBS *blobs)
+
+    {
+    static char *funcname="inkblobs_free";
+
+    willus_mem_free((double **)&blobs->blob,funcname);
+    willus_mem_free((double **)&blobs->label,funcname);
+    inkblobs_init(blobs);
+    }
+
+
+/*
+** Root of run i's set (parent[] is the union-find forest, parent[i] <= i)
+*/
+static int inkblobs_root(int *parent,int i)
+
+    {
+    while (parent[i]!=i)
+        {
+        parent[i]=parent[parent[i]];
+        i=parent[i];
+        }
+    return(i);
+    }
+
+
+/*
+** (Re)build the components with one union-find pass over the runs:  each run
+** is joined with the runs it touches (including diagonally) in the row above.
+** Every set is rooted at its first run, so the components can then be numbered
+** in order in place.  The runs are built first if they are stale.  If they
+** couldn't be built or there isn't enough memory, blobs->label is left NULL.
+*/
+void inkblobs_build(INKBLOBS *blobs,INKRUNS *runs)
+
+    {
+    int *label;
+    int i,r;
+    static char *funcname="inkblobs_build";
+
+    if (runs->stale)
+        inkruns_build(runs,runs->mask);
+    blobs->n=0;
+    blobs->stale=0;
+    if (runs->rowstart==NULL)
+        {
+        inkblobs_free(blobs);
+        return;
+        }
+    blobs->runs=runs;
+    blobs->bmp8=runs->bmp8;
+    blobs->bgcolor=runs->bgcolor;
+    if (blobs->label==NULL || blobs->label_allocated < runs->nruns)
+        {
+        int na;
+
+        willus_mem_free((double **)&blobs->label,funcname);
+        blobs->label_allocated=0;
+        na = runs->nruns<1 ? 1 : runs->nruns;
+        if (!willus_mem_alloc((double **)&blobs->label,(long)sizeof(int)*na,funcname))
+            {
+            inkblobs_free(blobs);
+            return;
+            }
+        blobs->label_allocated=na;
+        }
+    label=blobs->label;
+    for (i=0;i<runs->nruns;i++)
+        label[i]=i;
+    for (r=1;r<runs->height;r++)
+        {
+        int j,j2;
+
+        j=runs->rowstart[r-1];
+        j2=runs->rowstart[r];
+        for (i=j2;i<runs->rowstart[r+1];i++)
+            {
+            int k;
+
+            while (j<j2 && runs->run[2*j+1] < runs->run[2*i]-1)
+                j++;
+            for (k=j;k<j2 && runs->run[2*k] <= runs->run[2*i+1]+1;k++)
+                {
+                int a,b;
+
+                a=inkblobs_root(label,i);
+                b=inkblobs_root(label,k);
+                if (a<b)
+                    label[b]=a;
+                else if (b<a)
+                    label[a]=b;
+                }
+            }
+        }
+    /* label[i] <= i, and label[label[i]] is already numbered */
+    for (i=0;i<runs->nruns;i++)
+        label[i] = (label[i]==i) ? blobs->n++ : label[label[i]];
+    if (blobs->blob_allocated < blobs->n)
+        {
+        willus_mem_free((double **)&blobs->blob,funcname);
+        blobs->blob_allocated=0;
+        if (!willus_mem_alloc((double **)&blobs->blob,(long)sizeof(INKBLOB)*blobs->n,funcname))
+            {
+            inkblobs_free(blobs);
+            return;
+            }
+        blobs->blob_allocated=blobs->n;
+        }
+    for (i=0;i<blobs->n;i++)
+        blobs->blob[i].npixels=0;
+    for (r=0;r<runs->height;r++)
+        for (i=runs->rowstart[r];i<runs->rowstart[r+1];i++)
+            {
+            INKBLOB *blob;
+            int c1,c2;
+
+            blob=&blobs->blob[label[i]];
+            c1=runs->run[2*i];
+            c2=runs->run[2*i+1];
+            if (blob->npixels==0)
+                {
+                blob->r1=blob->r2=r;
+                blob->c1=c1;
+                blob->c2=c2;
+                }
+            else
+                {
+                blob->r2=r;
+                if (c1<blob->c1)
+                    blob->c1=c1;
+                if (c2>blob->c2)
+                    blob->c2=c2;
+                }
+            blob->npixels += c2-c1+1;
+            }
+    }
+
+
+/*
+** Make the components valid for runs without finding them--that is done
+** by the first bmpregion_inkblobs() call.
+*/
+void inkblobs_clear(INKBLOBS *blobs,INKRUNS *runs)
+
+    {
+    blobs->runs=runs;
+    blobs->bmp8=runs->bmp8;
+    blobs->bgcolor=runs->bgcolor;
+    blobs->stale=1;
+    }
+
+
+/*
+** Returns the region's components if they are valid for the region's bitmap
+** and background threshold (finding them, and building the runs, if that
+** hasn't been done yet), NULL otherwise.
+*/
+INKBLOBS *bmpregion_inkblobs(BMPREGION *region)
+
+    {
+    INKBLOBS *blobs;
+
+    blobs=region->inkblobs;
+    if (blobs==NULL || blobs->bmp8!=region->bmp8 || blobs->bgcolor!=region->bgcolor
+                    || blobs->runs==NULL || blobs->runs!=bmpregion_inkruns(region))
+        return(NULL);
+    if (blobs->stale)
+        inkblobs_build(blobs,blobs->runs);
+    return(blobs->label==NULL ? NULL : blobs);
+    }
+
+
+/*
+** Index of the component that pixel (r,c) is part of, -1 if it isn't dark.
+*/
+int inkblobs_label_at(INKBLOBS *blobs,int r,int c)
+
+    {
+    INKRUNS *runs;
+    int i;
+
+    runs=blobs->runs;
+    if (r<0 || r>=runs->height || c<0 || c>=runs->width)
+        return(-1);
+    i=inkruns_first(runs,r,c);
+    if (i<runs->rowstart[r+1] && runs->run[2*i]<=c)
+        return(blobs->label[i]);
+    return(-1);
+    }
+
+
+#define BBOXCACHE_SIZE 4096
+
+void bboxcache_init(BBOXCACHE *cache)
+
+    {
+    cache->bmp8=NULL;
+    cache->entry=NULL;
+    cache->n=0;
+    }
+
+
+void bboxcache_free(BBOXCACHE *cache)
+
+    {
+    static char *funcname="bboxcache_free";
+
+    willus_mem_free((double **)&cache->entry,funcname);
+    bboxcache_init(cache);
+    }
+
+
+/*
+** Empty the cache and make it valid for bmp8.  If there isn't enough
+** memory, cache->n stays 0 and nothing is cached.
+*/
+void bboxcache_clear(BBOXCACHE *cache,WILLUSBITMAP *bmp8)
+
+    {
+    int i;
+    static char *funcname="bboxcache_clear";
+
+    cache->bmp8=bmp8;
+    if (cache->entry==NULL)
+        {
+        if (!willus_mem_alloc((double **)&cache->entry,(long)sizeof(BBOXCACHEENTRY)*BBOXCACHE_SIZE,
+                              funcname))
+            return;
+        cache->n=BBOXCACHE_SIZE;
+        }
+    for (i=0;i<cache->n;i++)
+        cache->entry[i].flags=0;
+    }
+
+
+/*
+** The cache slot for the region's rectangle, NULL if the region has no valid cache.
+*/
+static BBOXCACHEENTRY *bboxcache_slot(BMPREGION *region)
+
+    {
+    BBOXCACHE *cache;
+    unsigned int h;
+
+    cache=region->bboxcache;
+    if (cache==NULL || cache->n==0 || cache->bmp8!=region->bmp8)
+        return(NULL);
+    h = (unsigned int)region->c1*73856093u ^ (unsigned int)region->r1*19349663u
+          ^ (unsigned int)region->c2*83492791u ^ (unsigned int)region->r2*50331653u
+          ^ (unsigned int)region->bgcolor;
+    return(&cache->entry[(h^(h>>13))&(cache->n-1)]);
+    }
+
+
+static int bboxcache_entry_matches(BBOXCACHEENTRY *e,BMPREGION *region,int flags)
+
+    {
+    return(e->flags>=flags && e->c1==region->c1 && e->r1==region->r1 && e->c2==region->c2
+             && e->r2==region->r2 && e->bgcolor==region->bgcolor);
+    }
+
+
+/*
+** # of dark pixels in rows r1..r2, columns c1..c2 (inclusive, clipped to the bitmap)
+*/
+static int blacksat_count(BLACKSAT *sat,int r1,int r2,int c1,int c2)
+
+    {
+    int w1;
+    int *s;
+
+    if (r1<0)
+        r1=0;
+    if (c1<0)
+        c1=0;
+    if (r2>sat->height-1)
+        r2=sat->height-1;
+    if (c2>sat->width-1)
+        c2=sat->width-1;
+    if (r2<r1 || c2<c1)
+        return(0);
+    w1=sat->width+1;
+    s=sat->sum;
+    return(s[(r2+1)*w1+c2+1]-s[r1*w1+c2+1]-s[(r2+1)*w1+c1]+s[r1*w1+c1]);
+    }
+
+
+/*
+** # of dark pixels in row r0, columns c1..c2 (inclusive, inside the bitmap)
+*/
+static int bmpregion_dark_count_row(BMPREGION *region,int r0,int c1,int c2)
+
+    {
+    unsigned char *p;
+    BLACKSAT *sat;
+    INKRUNS *runs;
+    INKMASK *mask;
+
+    if (c2<c1)
+        return(0);
+    if ((sat=bmpregion_blacksat(region))!=NULL)
+        return(blacksat_count(sat,r0,r0,c1,c2));
+    if ((runs=bmpregion_inkruns(region))!=NULL)
+        return(inkruns_count_row(runs,r0,c1,c2));
+    if ((mask=bmpregion_inkmask(region))!=NULL)
+        return(inkmask_count_row(mask,r0,c1,c2));
+    p=bmp_rowptr_from_top(region->bmp8,r0)+c1;
+    return(bmpscan_count_below(p,c2-c1+1,region->bgcolor));
+    }
+
+
+void rowprofile_init(ROWPROFILE *prof)
+
+    {
+    prof->bmp8=NULL;
+    prof->bgcolor=-1;
+    prof->c1=prof->r1=0;
+    prof->c2=prof->r2=-1;
+    prof->count=NULL;
+    prof->na=0;
+    }
+
+
+void rowprofile_free(ROWPROFILE *prof)
+
+    {
+    static char *funcname="rowprofile_free";
+
+    willus_mem_free((double **)&prof->count,funcname);
+    rowprofile_init(prof);
+    }
+
+
+/*
+** Empty the profile and make it valid for bmp8.
+*/
+void rowprofile_clear(ROWPROFILE *prof,WILLUSBITMAP *bmp8)
+
+    {
+    prof->bmp8=bmp8;
+    prof->r1=0;
+    prof->r2=-1;
+    }
+
+
+/*
+** The region's row profile, NULL if it has none that is valid for its bitmap.
+*/
+static ROWPROFILE *bmpregion_rowprofile(BMPREGION *region)
+
+    {
+    ROWPROFILE *prof;
+
+    prof=region->rowprofile;
+    if (prof==NULL || prof->bmp8!=region->bmp8)
+        return(NULL);
+    return(prof);
+    }
+
+
+/*
+** Store region->rowcount[region->r1..region->r2] (counts of columns c1..c2)
+** as the page's row profile.
+*/
+static void rowprofile_store(BMPREGION *region,int c1,int c2)
+
+    {
+    ROWPROFILE *prof;
+    int n;
+    static char *funcname="rowprofile_store";
+
+    if ((prof=bmpregion_rowprofile(region))==NULL)
+        return;
+    n=region->r2-region->r1+1;
+    if (prof->na < n)
+        {
+        willus_mem_free((double **)&prof->count,funcname);
+        prof->na=0;
+        if (!willus_mem_alloc((double **)&prof->count,(long)sizeof(int)*region->bmp8->height,
+                              funcname))
+            {
+            prof->count=NULL;
+            rowprofile_clear(prof,prof->bmp8);
+            return;
+            }
+        prof->na=region->bmp8->height;
+        }
+    memcpy(prof->count,&region->rowcount[region->r1],sizeof(int)*n);
+    prof->bgcolor=region->bgcolor;
+    prof->c1=c1;
+    prof->c2=c2;
+    prof->r1=region->r1;
+    prof->r2=region->r2;
+    }
+
+
+/*
+** Fill in region->rowcount[region->r1..region->r2] with the dark pixel
+** counts of columns c1..c2 (allocating region->rowcount if needed).
+**
+** Without a summed-area table, a parent region's row profile is reused if
+** it covers these rows and columns:  only the columns it has on either
+** side are counted and subtracted.  If it doesn't cover them, the rows are
+** counted in full and become the profile that sub-regions can use.
+*/
+void bmpregion_fill_rowcount(BMPREGION *region,int c1,int c2)
+
+    {
+    ROWPROFILE *prof;
+    int *rowcount;
+    int j;
+    static char *funcname="bmpregion_fill_rowcount";
+
+    if (region->rowcount==NULL)
+        willus_pmem_alloc_warn(11,(void **)&region->rowcount,sizeof(int)*region->bmp8->height,
+                               funcname,10);
+    rowcount=region->rowcount;
+    if (bmpregion_blacksat(region)==NULL && (prof=bmpregion_rowprofile(region))!=NULL
+          && prof->bgcolor==region->bgcolor
+          && prof->r1<=region->r1 && prof->r2>=region->r2
+          && prof->c1<=c1 && prof->c2>=c2
+          && (c1-prof->c1)+(prof->c2-c2) <= c2-c1+1)
+        {
+        for (j=region->r1;j<=region->r2;j++)
+            rowcount[j]=prof->count[j-prof->r1]
+                          - bmpregion_dark_count_row(region,j,prof->c1,c1-1)
+                          - bmpregion_dark_count_row(region,j,c2+1,prof->c2);
+        return;
+        }
+    for (j=region->r1;j<=region->r2;j++)
+        rowcount[j]=bmpregion_dark_count_row(region,j,c1,c2);
+    if (bmpregion_blacksat(region)==NULL)
+        rowprofile_store(region,c1,c2);
+    }
+
+
+int bmpregion_row_black_count(BMPREGION *region,int r0)
+
+    {
+    return(bmpregion_dark_count_row(region,r0,region->c1,region->c2));
+    }
+
+
 int bmpregion_col_black_count(BMPREGION *region,int c0)
 
     {
     unsigned char *p;
     int i,nr,c,bw;
+    BLACKSAT *sat;
 
+    if ((sat=bmpregion_blacksat(region))!=NULL)
+        return(blacksat_count(sat,region->r1,region->r2,c0,c0));
     bw=bmp_bytewidth(region->bmp8);
     p=bmp_rowptr_from_top(region->bmp8,region->r1)+c0;
     nr=region->r2-region->r1+1;
@@ -107,8 +1056,8 @@ void bmpregion_row_histogram(BMPREGION *region)
     src=region->bmp8;
     if (src==NULL)
         return;
-    willus_dmem_alloc_warn(6,(void **)&rowcount,(region->r2-region->r1+1)*sizeof(int),funcname,10);
-    willus_dmem_alloc_warn(7,(void **)&hist,(region->c2-region->c1+2)*sizeof(int),funcname,10);
+    willus_pmem_alloc_warn(6,(void **)&rowcount,(region->r2-region->r1+1)*sizeof(int),funcname,10);
+    willus_pmem_alloc_warn(7,(void **)&hist,(region->c2-region->c1+2)*sizeof(int),funcname,10);
     for (j=region->r1;j<=region->r2;j++)
         {
         unsigned char *p;
@@ -140,8 +1089,8 @@ void bmpregion_row_histogram(BMPREGION *region)
             fprintf(out,"%5d %5d\n",i,rowcount[i]);
         fclose(out);
         }
-    willus_dmem_free(7,(double **)&hist,funcname);
-    willus_dmem_free(6,(double **)&rowcount,funcname);
+    willus_pmem_free(7,(double **)&hist,funcname);
+    willus_pmem_free(6,(double **)&rowcount,funcname);
     }
 
 
@@ -153,6 +1102,8 @@ int bmpregion_is_clear(BMPREGION *region,int *row_black_count,int *col_black_cou
 
     {
     int nr,nc,r,c,pt,mindim;
+    BLACKSAT *sat;
+    INKRUNS *runs;
 
 #if (WILLUSDEBUGX & 128)
 printf("@bmpregion_is_clear(rpc=%d, gt_in=%g), region->dpi=%d\n",rpc,gt_in,region->dpi);
@@ -161,6 +1112,35 @@ printf("@bmpregion_is_clear(rpc=%d, gt_in=%g), region->dpi=%d\n",rpc,gt_in,regio
     if (pt<0)
         pt=0;
     /*
+    ** Fastest:  page summed-area table
+    */
+    if ((sat=bmpregion_blacksat(region))!=NULL)
+        {
+        c=blacksat_count(sat,region->r1,region->r2,region->c1,region->c2);
+        if (c>pt)
+            return(0);
+        return(pt<=0 ? 1 : 1+(int)10*c/pt);
+        }
+    /*
+    ** Next fastest:  page ink runs
+    */
+    if ((runs=bmpregion_inkruns(region))!=NULL)
+        {
+        int r1,r2;
+
+        r1 = region->r1<0 ? 0 : region->r1;
+        r2 = region->r2>runs->height-1 ? runs->height-1 : region->r2;
+        for (c=0,r=r1;r<=r2;r++)
+            {
+            if (row_black_count[r]==0)
+                continue;
+            c+=inkruns_count_row(runs,r,region->c1,region->c2);
+            if (c>pt)
+                return(0);
+            }
+        return(pt<=0 ? 1 : 1+(int)10*c/pt);
+        }
+    /*
     ** Fast way to count dark pixels, but requires big array
     */
     if (col_pix_count!=NULL && rpc>0)
@@ -358,6 +1338,13 @@ void bmpregion_init(BMPREGION *region)
     region->wrectmaps=NULL;
     region->k2pagebreakmarks=NULL;
     region->k2pagebreakmarks_allocated=0;
+    region->blacksat=NULL;
+    region->inkmask=NULL;
+    region->inkruns=NULL;
+    region->inkblobs=NULL;
+    region->bboxcache=NULL;
+    region->rowprofile=NULL;
+    region->pool=NULL;
     }
 
 
@@ -367,7 +1354,7 @@ void bmpregion_k2pagebreakmarks_allocate(BMPREGION *region)
     static char *funcname="bmpregion_k2pagebreakmarks_allocate";
 
     bmpregion_k2pagebreakmarks_free(region);
-    willus_dmem_alloc_warn(44,(void **)&region->k2pagebreakmarks,sizeof(K2PAGEBREAKMARKS),
+    willus_pmem_alloc_warn(44,(void **)&region->k2pagebreakmarks,sizeof(K2PAGEBREAKMARKS),
                                funcname,10);
     region->k2pagebreakmarks_allocated=1;
     region->k2pagebreakmarks->n=0;
@@ -381,7 +1368,7 @@ void bmpregion_k2pagebreakmarks_free(BMPREGION *region)
 
     if (region->k2pagebreakmarks!=NULL && region->k2pagebreakmarks_allocated)
         {
-        willus_dmem_free(44,(double **)&region->k2pagebreakmarks,funcname);
+        willus_pmem_free(44,(double **)&region->k2pagebreakmarks,funcname);
         region->k2pagebreakmarks_allocated=0;
         }
     else
@@ -395,8 +1382,8 @@ void bmpregion_free(BMPREGION *region)
     static char *funcname="bmpregion_free";
 
     bmpregion_k2pagebreakmarks_free(region);
-    willus_dmem_free(11,(double **)&region->rowcount,funcname);
-    willus_dmem_free(10,(double **)&region->colcount,funcname);
+    willus_pmem_free(11,(double **)&region->rowcount,funcname);
+    willus_pmem_free(10,(double **)&region->colcount,funcname);
     textrows_free(&region->textrows);
     }
 
@@ -439,10 +1426,21 @@ void bmpregion_copy(BMPREGION *dst,BMPREGION *src,int copy_text_rows)
 ** Mean line spacing = 1.15 - 1.22 (~1.16)
 ** Mean cap height = 0.68
 ** Mean small letter height = 0.49
-** 
+**
+** The result is cached per source page, so region->colcount and region->rowcount
+** may not be filled in--use bmpregion_calc_bbox_ex() with need_counts=1 if they
+** will be used.
 */
 void bmpregion_calc_bbox(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,int calc_text_params)
 
+    {
+    bmpregion_calc_bbox_ex(region,k2settings,calc_text_params,0);
+    }
+
+
+void bmpregion_calc_bbox_ex(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,int calc_text_params,
+                            int need_counts)
+
     {
     int i,j,n; /* ,r1,r2,dr1,dr2,dr,vtrim,vspace; */
     int maxcount,mc2,h2;
@@ -450,6 +1448,11 @@ void bmpregion_calc_bbox(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,int cal
     int *colcount,*rowcount;
     static char *funcname="bmpregion_calc_bbox";
     TEXTROW *bbox;
+    BLACKSAT *sat;
+    INKRUNS *runs;
+    INKMASK *mask;
+    INKBLOBS *blobs;
+    BBOXCACHEENTRY *cached;
 /*
 printf("@bmpregion_calc_bbox(%d,%d)-(%d,%d)\n",region->c1,region->r1,region->c2,region->r2);
 printf("    bmp8 = %d x %d\n",region->bmp8->width,region->bmp8->height);
@@ -476,12 +1479,29 @@ printf("    region->rowcount=%p\n",region->rowcount);
     if ((bbox->type & BBOX_CALCED) && (!calc_text_params || (bbox->type & BBOX_TEXT_PARAMS)))
         return;
     */
+    cached=bboxcache_slot(region);
+    if (cached!=NULL && !need_counts
+           && bboxcache_entry_matches(cached,region,calc_text_params ? 2 : 1))
+        {
+        bbox->c1=cached->bc1;
+        bbox->r1=cached->br1;
+        bbox->c2=cached->bc2;
+        bbox->r2=cached->br2;
+        if (calc_text_params)
+            {
+            bbox->rowbase=cached->rowbase;
+            bbox->h5050=cached->h5050;
+            bbox->lcheight=cached->lcheight;
+            bbox->capheight=cached->capheight;
+            }
+        return;
+        }
     if (region->colcount==NULL)
-        willus_dmem_alloc_warn(10,(void **)&region->colcount,sizeof(int)*region->bmp8->width,
+        willus_pmem_alloc_warn(10,(void **)&region->colcount,sizeof(int)*region->bmp8->width,
                                funcname,10);
     colcount=region->colcount;
     if (region->rowcount==NULL)
-        willus_dmem_alloc_warn(11,(void **)&region->rowcount,sizeof(int)*region->bmp8->height,
+        willus_pmem_alloc_warn(11,(void **)&region->rowcount,sizeof(int)*region->bmp8->height,
                                funcname,10);
     rowcount=region->rowcount;
     n=bbox->c2-bbox->c1+1;
@@ -495,30 +1515,57 @@ exit(10);
 */
     memset(colcount,0,(bbox->c2+1)*sizeof(int));
     memset(rowcount,0,(bbox->r2+1)*sizeof(int));
-    for (j=bbox->r1;j<=bbox->r2;j++)
+    if ((sat=bmpregion_blacksat(region))!=NULL)
         {
-        unsigned char *p;
-        p=bmp_rowptr_from_top(region->bmp8,j)+bbox->c1;
-        for (i=0;i<n;i++,p++)
-            if (p[0]<region->bgcolor)
-                {
-                rowcount[j]++;
-                colcount[i+bbox->c1]++;
-                }
+        for (j=bbox->r1;j<=bbox->r2;j++)
+            rowcount[j]=blacksat_count(sat,j,j,bbox->c1,bbox->c2);
+        for (i=bbox->c1;i<=bbox->c2;i++)
+            colcount[i]=blacksat_count(sat,bbox->r1,bbox->r2,i,i);
         }
+    else if ((runs=bmpregion_inkruns(region))!=NULL)
+        for (j=bbox->r1;j<=bbox->r2;j++)
+            {
+            rowcount[j]=inkruns_count_row(runs,j,bbox->c1,bbox->c2);
+            if (rowcount[j]>0)
+                inkruns_accumulate_row(&colcount[bbox->c1],runs,j,bbox->c1,bbox->c2);
+            }
+    else if ((mask=bmpregion_inkmask(region))!=NULL)
+        for (j=bbox->r1;j<=bbox->r2;j++)
+            {
+            rowcount[j]=inkmask_count_row(mask,j,bbox->c1,bbox->c2);
+            if (rowcount[j]>0)
+                inkmask_accumulate_row(&colcount[bbox->c1],mask,j,bbox->c1,bbox->c2);
+            }
+    else
+        for (j=bbox->r1;j<=bbox->r2;j++)
+            {
+            unsigned char *p;
+            p=bmp_rowptr_from_top(region->bmp8,j)+bbox->c1;
+            rowcount[j]=bmpscan_count_below(p,n,region->bgcolor);
+            if (rowcount[j]>0)
+                bmpscan_accumulate_below(&colcount[bbox->c1],p,n,region->bgcolor);
+            }
+    /* Counted the slow way--keep the row counts for sub-regions */
+    if (sat==NULL)
+        rowprofile_store(region,bbox->c1,bbox->c2);
     /*
     ** Trim excess margins
     */
+    /* Components are only needed (and found) if a defect can be more than a pixel */
+    blobs = defect_level(region->dpi,k2settings->defect_size_pts)>1 ? bmpregion_inkblobs(region)
+                                                                   : NULL;
     trim_to(colcount,&bbox->c1,bbox->c2,k2settings->src_left_to_right ? 2.0 : 4.0,
-            region->dpi,k2settings->defect_size_pts);
+            region->dpi,k2settings->defect_size_pts,blobs,region->r1,region->r2,1);
     trim_to(colcount,&bbox->c2,bbox->c1,k2settings->src_left_to_right ? 4.0 : 2.0,
-            region->dpi,k2settings->defect_size_pts);
+            region->dpi,k2settings->defect_size_pts,blobs,region->r1,region->r2,1);
     /*
     if (colcount0==NULL)
-        willus_dmem_free(10,(double **)&colcount,funcname);
+        willus_pmem_free(10,(double **)&colcount,funcname);
     */
-    trim_to(rowcount,&bbox->r1,bbox->r2,4.0,region->dpi,k2settings->defect_size_pts);
-    trim_to(rowcount,&bbox->r2,bbox->r1,4.0,region->dpi,k2settings->defect_size_pts);
+    trim_to(rowcount,&bbox->r1,bbox->r2,4.0,region->dpi,k2settings->defect_size_pts,
+            blobs,region->c1,region->c2,0);
+    trim_to(rowcount,&bbox->r2,bbox->r1,4.0,region->dpi,k2settings->defect_size_pts,
+            blobs,region->c1,region->c2,0);
     if (calc_text_params)
         {
         /* Text row statistics */
@@ -591,13 +1638,30 @@ fclose(f);
         bbox->rowbase = bbox->r2;
         }
 */
+    if (cached!=NULL && (calc_text_params || !bboxcache_entry_matches(cached,region,2)))
+        {
+        cached->c1=region->c1;
+        cached->r1=region->r1;
+        cached->c2=region->c2;
+        cached->r2=region->r2;
+        cached->bgcolor=region->bgcolor;
+        cached->flags=calc_text_params ? 2 : 1;
+        cached->bc1=bbox->c1;
+        cached->br1=bbox->r1;
+        cached->bc2=bbox->c2;
+        cached->br2=bbox->r2;
+        cached->rowbase=bbox->rowbase;
+        cached->h5050=bbox->h5050;
+        cached->lcheight=bbox->lcheight;
+        cached->capheight=bbox->capheight;
+        }
 #if (WILLUSDEBUGX & 2)
 k2printf("trim:\n    reg->c1=%d, reg->c2=%d\n",bbox->c1,bbox->c2);
 k2printf("    reg->r1=%d, reg->r2=%d, reg->rowbase=%d\n\n",bbox->r1,bbox->r2,bbox->rowbase);
 #endif
     /*
     if (rowcount0==NULL)
-        willus_dmem_free(11,(double **)&rowcount,funcname);
+        willus_pmem_free(11,(double **)&rowcount,funcname);
     */
     }
 
@@ -608,6 +1672,7 @@ k2printf("    reg->r1=%d, reg->r2=%d, reg->rowbase=%d\n\n",bbox->r1,bbox->r2,bbo
 ** flags&4  : trim r1
 ** flags&8  : trim r2
 ** flags&16 : Find rowbase, font size, etc.
+** flags&32 : Fill in region->colcount and region->rowcount
 **
 ** Row base is where row dist crosses 50% on r2 side.
 ** Font size is where row dist crosses 5% on other side (r1 side).
@@ -625,7 +1690,7 @@ k2printf("    reg->r1=%d, reg->r2=%d, reg->rowbase=%d\n\n",bbox->r1,bbox->r2,bbo
 void bmpregion_trim_margins(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,int flags)
 
     {
-    bmpregion_calc_bbox(region,k2settings,flags&0x10);
+    bmpregion_calc_bbox_ex(region,k2settings,flags&0x10,flags&0x20);
     /* To detect a hyphen, we need to trim and calc text base row */
     /*
     (unnecessary as of v1.70--always done)
@@ -643,7 +1708,16 @@ void bmpregion_trim_margins(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,int
     }
 
 
-static void trim_to(int *count,int *i1,int i2,double gaplen,int dpi,double defect_size_pts)
+/*
+** Move (*i1) toward i2 to the first mark in count[] that isn't a defect
+** (or a defect within gaplen points of it).  If blobs!=NULL, a mark is a
+** defect if all of its pixels are in components smaller than the defect
+** size (count[i] is then line i of the page, columns/rows j1..j2).  The
+** component sizes are for the whole page, not clipped to j1..j2.
+** Otherwise it is a defect if its total pixel count is.
+*/
+static void trim_to(int *count,int *i1,int i2,double gaplen,int dpi,double defect_size_pts,
+                    INKBLOBS *blobs,int j1,int j2,int is_col)
 
     {
     int del,dcount,igaplen,clevel,dlevel,defect_start,last_defect;
@@ -653,7 +1727,10 @@ static void trim_to(int *count,int *i1,int i2,double gaplen,int dpi,double defec
         igaplen=1;
     /* clevel=(int)(defect_size_pts*dpi/72./3.); */
     clevel=0;
-    dlevel=(int)(pow(defect_size_pts*dpi/72.,2.)*PI/4.+.5);
+    dlevel=defect_level(dpi,defect_size_pts);
+    /* Any component is big enough */
+    if (dlevel<=1)
+        blobs=NULL;
     del=i2>(*i1) ? 1 : -1;
     defect_start=-1;
     last_defect=-1;
@@ -673,7 +1750,8 @@ static void trim_to(int *count,int *i1,int i2,double gaplen,int dpi,double defec
             defect_start=(*i1);
             }
         dcount += count[(*i1)];
-        if (dcount >= dlevel)
+        if (blobs!=NULL ? inkblobs_line_is_real(blobs,(*i1),j1,j2,is_col,dlevel)
+                        : dcount >= dlevel)
             {
             if (last_defect>=0 && abs(defect_start-last_defect)<=igaplen)
                 (*i1)=last_defect;
@@ -695,6 +1773,52 @@ static void trim_to(int *count,int *i1,int i2,double gaplen,int dpi,double defec
         (*i1)=defect_start;
     }
 
+
+/*
+** Pixel count of a round mark defect_size_pts across.
+*/
+static int defect_level(int dpi,double defect_size_pts)
+
+    {
+    return((int)(pow(defect_size_pts*dpi/72.,2.)*PI/4.+.5));
+    }
+
+
+/*
+** Does row i (column i if is_col), columns (rows) j1..j2, have any pixels of a
+** component with at least dlevel pixels?
+*/
+static int inkblobs_line_is_real(INKBLOBS *blobs,int i,int j1,int j2,int is_col,int dlevel)
+
+    {
+    int j;
+
+    if (is_col)
+        {
+        for (j=j1;j<=j2;j++)
+            {
+            int k;
+
+            k=inkblobs_label_at(blobs,j,i);
+            if (k>=0 && blobs->blob[k].npixels>=dlevel)
+                return(1);
+            }
+        }
+    else
+        {
+        INKRUNS *runs;
+        int n;
+
+        runs=blobs->runs;
+        n=runs->rowstart[i+1];
+        for (j=inkruns_first(runs,i,j1);j<n && runs->run[2*j]<=j2;j++)
+            if (blobs->blob[blobs->label[j]].npixels>=dlevel)
+                return(1);
+        }
+    return(0);
+    }
+
+
 /*
 ** Calculate weighted height of a rectangular region.
 ** This weighted height is intended to be close to the height of
@@ -713,7 +1837,7 @@ static int height2_calc(int *rc,int n)
 
     if (n<=0)
         return(1);
-    willus_dmem_alloc_warn(12,(void **)&c,sizeof(int)*n,funcname,10);
+    willus_pmem_alloc_warn(12,(void **)&c,sizeof(int)*n,funcname,10);
     memcpy(c,rc,n*sizeof(int));
     sorti(c,n);
 #if (WILLUSDEBUGX & 8)
@@ -734,7 +1858,7 @@ fclose(f);
     /* for (i=0;i<n-1 && c[i]==0;i++); */
     /* v2.33:  change from c[(i+n)/3] to c[9*n/10]/2 */
     thresh=c[9*n/10]/2;
-    willus_dmem_free(12,(double **)&c,funcname);
+    willus_pmem_free(12,(double **)&c,funcname);
     for (i=0;i<n-1;i++)
         if (rc[i]>=thresh)
             break;
@@ -750,6 +1874,11 @@ fclose(f);
     }
 
 
+/* Is pixel (r,c) dark?  (Bit test if the page's ink mask is built.) */
+#define HYPHEN_DARK(r,c) (mask!=NULL ? (int)inkmask_pixel(mask,r,c) \
+                                  : p[(r)*rowbytes+(c)]<region->bgcolor)
+
+
 /*
 ** Does region end in a hyphen?  If so, fill in HYPHENINFO structure.
 */
@@ -764,6 +1893,7 @@ void bmpregion_hyphen_detect(BMPREGION *region,int hyphen_detect,int left_to_rig
     unsigned char *p;
     static char *funcname="bmpregion_hyphen_detect";
     TEXTROW *textrow;
+    INKMASK *mask;
 
 #if (WILLUSDEBUGX & 16)
 static int count=0;
@@ -811,7 +1941,7 @@ printf("    width < 2.\n");
 #endif
         return;
         }
-    willus_dmem_alloc_warn(27,(void **)&r0,sizeof(int)*4*width,funcname,10);
+    willus_pmem_alloc_warn(27,(void **)&r0,sizeof(int)*4*width,funcname,10);
     r1=&r0[width];
     r2=&r1[width];
     r3=&r2[width];
@@ -825,6 +1955,8 @@ printf("    width < 2.\n");
         rmax = textrow->r2;
     rowbytes=bmp_bytewidth(region->bmp8);
     p=bmp_rowptr_from_top(region->bmp8,0);
+    /* Only worth using if something else already built it */
+    mask = (region->inkmask!=NULL && !region->inkmask->stale) ? bmpregion_inkmask(region) : NULL;
     nrmid=rsum=0;
     if (left_to_right)
         {
@@ -852,9 +1984,9 @@ fprintf(out,"   j     r0     r1     r2     r3\n");
         /* Find dark region closest to center line */
         for (dr=0;dr<drmax;dr++)
             {
-            if (rmid+dr<=textrow->r2 && p[(rmid+dr)*rowbytes+j]<region->bgcolor)
+            if (rmid+dr<=textrow->r2 && HYPHEN_DARK((rmid+dr),j))
                 break;
-            if (rmid-dr>=textrow->r1 && p[(rmid-dr)*rowbytes+j]<region->bgcolor)
+            if (rmid-dr>=textrow->r1 && HYPHEN_DARK((rmid-dr),j))
                 {
                 dr=-dr;
                 break;
@@ -900,27 +2032,27 @@ fprintf(out,"    dr=%d/%d, rmid+dr=%d, rmin=%d, rmax=%d, nrmid=%d\n",dr,drmax,rm
             }
         */
         for (r=rmid;r>=textrow->r1;r--)
-            if (p[r*rowbytes+j]>=region->bgcolor)
+            if (!HYPHEN_DARK(r,j))
                 break;
         r1[j-textrow->c1]=r+1;
         r0[j-textrow->c1]=-1;
         if (r>=textrow->r1)
             {
             for (;r>=textrow->r1;r--)
-                if (p[r*rowbytes+j]<region->bgcolor)
+                if (HYPHEN_DARK(r,j))
                     break;
             if (r>=textrow->r1)
                 r0[j-textrow->c1]=r;
             }
         for (r=rmid;r<=textrow->r2;r++)
-            if (p[r*rowbytes+j]>=region->bgcolor)
+            if (!HYPHEN_DARK(r,j))
                 break;
         r2[j-textrow->c1]=r-1;
         r3[j-textrow->c1]=-1;
         if (r<=textrow->r2)
             {
             for (;r<=textrow->r2;r++)
-                if (p[r*rowbytes+j]<region->bgcolor)
+                if (HYPHEN_DARK(r,j))
                     break;
             if (r<=textrow->r2)
                 r3[j-textrow->c1]=r;
@@ -1038,7 +2170,7 @@ fprintf(out,"  Bad aspect ratio = %g (s/b between .08 and .75).\n",ar);
             textrow->hyphen.ch = -1;
 }
         }
-    willus_dmem_free(27,(double **)&r0,funcname);
+    willus_pmem_free(27,(double **)&r0,funcname);
 #if (WILLUSDEBUGX & 16)
 if (textrow->hyphen.ch>=0)
 {
@@ -1167,7 +2299,7 @@ void bmpregion_find_textrows(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,
     {
     static char *funcname="bmpregion_find_textrows";
     int nr,i,brc,brcmin,dtrc,trc,figrow,labelrow;
-    int rhmin_pix,rhmean_pixels;
+    int rhmin_pix,rhmean_pixels,c1,c2;
     BMPREGION *newregion,_newregion;
     TEXTROWS *textrows;
     int *rowthresh;
@@ -1176,8 +2308,15 @@ void bmpregion_find_textrows(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,
     min_fig_height=k2settings->dst_min_figure_height_in;
     max_fig_gap=0.16;
     max_label_height=0.5;
-    /* Trim region (calculate bounding box) */
+    /*
+    ** Trim region (calculate bounding box).  The row counts are over the
+    ** untrimmed columns, as bmpregion_trim_margins(...,0x20) would give, but
+    ** are taken from the parent's row profile when possible.
+    */
+    c1=region->c1;
+    c2=region->c2;
     bmpregion_trim_margins(region,k2settings,k2settings->src_trim ? 0xf : 0);
+    bmpregion_fill_rowcount(region,c1,c2);
     newregion=&_newregion;
     bmpregion_init(newregion);
     bmpregion_copy(newregion,region,0);
@@ -1186,7 +2325,7 @@ void bmpregion_find_textrows(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,
         k2printf("@bmpregion_find_textrows:  (%d,%d) - (%d,%d)\n",
                 region->c1,region->r1,region->c2,region->r2);
     nr=region->r2-region->r1+1;
-    willus_dmem_alloc_warn(15,(void **)&rowthresh,sizeof(int)*nr,funcname,10);
+    willus_pmem_alloc_warn(15,(void **)&rowthresh,sizeof(int)*nr,funcname,10);
     brcmin = k2settings->max_vertical_gap_inches*region->dpi;
     bmpregion_fill_row_threshold_array(region,k2settings,dynamic_aperture,rowthresh,&rhmean_pixels);
 #if (WILLUSDEBUGX & 0x2)
@@ -1444,7 +2583,7 @@ printf("DD\n");
     for (i=0;i<textrows->n;i++)
         textrow_determine_type(region,k2settings,i);
 
-    willus_dmem_free(15,(double **)&rowthresh,funcname);
+    willus_pmem_free(15,(double **)&rowthresh,funcname);
     bmpregion_free(newregion);
     }
 
@@ -1591,7 +2730,7 @@ printf("Region #%d\n",rn);
     textrows_add_textrow(&region->textrows,&region->bbox);
 
     /* Trim columns to text row */
-    bmpregion_trim_margins(newregion,k2settings,0x13);
+    bmpregion_trim_margins(newregion,k2settings,0x33);
     if (newregion->c2-newregion->c1+1<6)
         {
         bmpregion_free(newregion);
@@ -1623,7 +2762,7 @@ printf("Region #%d\n",rn);
     */
     ngaps=0;
     width=newregion->c2-newregion->c1+1;
-    willus_dmem_alloc_warn(31,(void **)&gw,sizeof(int)*width*2,funcname,10);
+    willus_pmem_alloc_warn(31,(void **)&gw,sizeof(int)*width*2,funcname,10);
     copt=&gw[width];
     bmpregion_count_text_row_pixels(newregion,gw,copt,&ngaps,k2settings);
 
@@ -1704,7 +2843,7 @@ printf("    Subdivided:  New len = %d pixels, multiplier=%g.\n",c2-c1+1,multipli
         multiplier=1.0;
         }
     /* End of scope which includes gw[] and copt[] arrays */
-    willus_dmem_free(31,(double **)&gw,funcname);
+    willus_pmem_free(31,(double **)&gw,funcname);
 
     textwords_compute_col_gaps(textwords,newregion->c2);
     lcheight = newregion->bbox.lcheight;
@@ -1762,7 +2901,7 @@ static void bmpregion_count_text_row_pixels(BMPREGION *region,int *gw,int *copt,
     ** Could do this more intelligently--maybe calculate a histogram?
     */
     nc=region->c2-region->c1+1;
-    willus_dmem_alloc_warn(18,(void **)&bp,sizeof(int)*nc,funcname,10);
+    willus_pmem_alloc_warn(18,(void **)&bp,sizeof(int)*nc,funcname,10);
     memset(bp,0,nc*sizeof(int));
     /*
     ** Look for "space-sized" gaps, i.e. gaps that would occur between words.
@@ -1855,7 +2994,7 @@ fclose(f);
 }
 #endif
     bmpregion_find_gaps(region,bp,gw,copt,ngaps);
-    willus_dmem_free(18,(double **)&bp,funcname);
+    willus_pmem_free(18,(double **)&bp,funcname);
     }
 
 
@@ -1980,7 +3119,7 @@ printf("@get_word_gap_threshold, ngaps=%d, dr=%d\n",ngaps,dr);
         return((int)(fabs(k2settings->word_spacing)*dr+.5));
     if (expected<0.1)
         expected=0.1;
-    willus_dmem_alloc_warn(36,(void **)&dgap,sizeof(int)*ngaps*2,funcname,10);
+    willus_pmem_alloc_warn(36,(void **)&dgap,sizeof(int)*ngaps*2,funcname,10);
     gapcount=&dgap[ngaps];
 
     for (i=0;i<ngaps-1;i++)
@@ -2136,7 +3275,7 @@ aprintf("DECREMENT FROM %d TO %d\n",gt0,gt);
 #endif
         }
 #endif /* COMMENT */
-    willus_dmem_free(36,(double **)&dgap,funcname);
+    willus_pmem_free(36,(double **)&dgap,funcname);
 #if (WILLUSDEBUGX & 0x1000)
 printf("Done get_word_gap_threshold, gt=%d.\n",gt);
 #endif
@@ -2187,6 +3326,23 @@ void bmpregion_whiteout(BMPREGION *dstregion,BMPREGION *croppedregion)
         bmp_draw_filled_rect(dstregion->bmp8,croppedregion->c1,croppedregion->r1,
                                              croppedregion->c2,croppedregion->r2,
                                              255,255,255);
+    /* Page pixels changed--dark pixel counts and cached bboxes are stale */
+    if (dstregion->bboxcache!=NULL && dstregion->bboxcache->bmp8==dstregion->bmp8)
+        bboxcache_clear(dstregion->bboxcache,dstregion->bmp8);
+    if (dstregion->rowprofile!=NULL && dstregion->rowprofile->bmp8==dstregion->bmp8)
+        rowprofile_clear(dstregion->rowprofile,dstregion->bmp8);
+    if (dstregion->blacksat!=NULL && dstregion->blacksat->bmp8==dstregion->bmp8)
+        blacksat_build(dstregion->blacksat,dstregion->bmp8,dstregion->blacksat->bgcolor);
+    if (dstregion->inkmask!=NULL && dstregion->inkmask->bmp8==dstregion->bmp8)
+        {
+        inkmask_clear(dstregion->inkmask,dstregion->bmp8,dstregion->inkmask->bgcolor);
+        if (dstregion->inkruns!=NULL && dstregion->inkruns->bmp8==dstregion->bmp8)
+            {
+            inkruns_clear(dstregion->inkruns,dstregion->inkmask);
+            if (dstregion->inkblobs!=NULL && dstregion->inkblobs->runs==dstregion->inkruns)
+                inkblobs_clear(dstregion->inkblobs,dstregion->inkruns);
+            }
+        }
     }
 
 
@@ -2227,22 +3383,37 @@ int bmpregion_clean_to_row(BMPREGION *region,int row,int whitethresh)
 
     {
     int i,max,pixwidth;
+    BLACKSAT *sat;
+    INKMASK *mask;
 
     max=(int)(.01*region->dpi+.5);
     if (max<1)
         max=1;
     pixwidth=region->c2-region->c1+1;
+    sat=bmpregion_blacksat(region);
+    if (sat!=NULL && sat->bgcolor!=whitethresh)
+        sat=NULL;
+    mask = sat==NULL ? bmpregion_inkmask(region) : NULL;
+    if (mask!=NULL && mask->bgcolor!=whitethresh)
+        mask=NULL;
     for (i=region->r2+1;i<row;i++)
         {
         unsigned char *p;
-        int pc,j;
 
-        pc=0;
+        if (sat!=NULL)
+            {
+            if (blacksat_count(sat,i,i,region->c1,region->c2) >= max)
+                return(0);
+            continue;
+            }
+        if (mask!=NULL)
+            {
+            if (inkmask_count_row(mask,i,region->c1,region->c2) >= max)
+                return(0);
+            continue;
+            }
         p=bmp_rowptr_from_top(region->bmp8,i)+region->c1;
-        for (j=0;j<pixwidth;j++,p++)
-            if (p[0] < whitethresh)
-                pc++;
-        if (pc >= max)
+        if (bmpscan_count_below(p,pixwidth,whitethresh) >= max)
             return(0);
         }
     return(1);
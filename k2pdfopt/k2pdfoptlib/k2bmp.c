@@ -23,6 +23,8 @@
 #include "k2pdfopt.h"
 
 
+static void bmp_pick_contrast(WILLUSBITMAP *srcgrey,K2PDFOPT_SETTINGS *k2settings,int *white,
+                              double *cgrey,double *ccolor);
 static int inflection_count(double *x,int n,int delta,int *wthresh);
 static int vert_line_erase(WILLUSBITMAP *bmp,WILLUSBITMAP *cbmp,WILLUSBITMAP *tmp,
                     int row0,int col0,double tanth,double minheight_in,
@@ -41,8 +43,12 @@ static int k2pagebreakmarks_too_close_to_others(K2PAGEBREAKMARKS *k2pagebreakmar
                                                 int markrow,int dpi);
 
 
+/*
+** If mupdfdoc is not NULL and is open, the page is rendered from that
+** document session rather than re-opening filename.
+*/
 int bmp_get_one_document_page(WILLUSBITMAP *src,K2PDFOPT_SETTINGS *k2settings,
-                              int src_type,char *filename,
+                              int src_type,char *filename,WMUPDFDOC *mupdfdoc,
                               int pageno,double dpi,int bpp,FILE *out)
 
     {
@@ -62,7 +68,12 @@ if (status==0 && bpp!=24)
 bmp_convert_to_grayscale(src);
 return(status);
 #else
-            status=bmpmupdf_pdffile_to_bmp(src,filename,pageno,dpi*k2settings->document_scale_factor,bpp);
+            if (mupdfdoc!=NULL && mupdfdoc->ctx!=NULL)
+                status=bmpmupdf_pdfdoc_to_bmp(src,mupdfdoc,pageno,
+                                              dpi*k2settings->document_scale_factor,bpp);
+            else
+                status=bmpmupdf_pdffile_to_bmp(src,filename,pageno,
+                                               dpi*k2settings->document_scale_factor,bpp);
             if (!status || k2settings->usegs<0)
                 return(status);
 #endif
@@ -103,13 +114,134 @@ return(status);
     }
 
 
-void bmp_adjust_contrast(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,
-                         K2PDFOPT_SETTINGS *k2settings,int *white)
+/*
+** Get the pixel dimensions (width x height) that page pageno will have when
+** read at the specified dpi.  With a MuPDF document session, only the page
+** bounds are read (no rendering).  Otherwise the page is read into tmp at
+** 10 dpi and the dimensions are scaled up from that.
+*/
+int bmp_get_one_document_page_size(WILLUSBITMAP *tmp,K2PDFOPT_SETTINGS *k2settings,
+                                   int src_type,char *filename,WMUPDFDOC *mupdfdoc,
+                                   int pageno,double dpi,double *width,double *height,
+                                   FILE *out)
+
+    {
+    int status;
+
+#ifdef HAVE_MUPDF_LIB
+    if (src_type==SRC_TYPE_PDF && k2settings->usegs<=0
+                               && mupdfdoc!=NULL && mupdfdoc->ctx!=NULL)
+        {
+        double width_in,height_in;
+
+        status=bmpmupdf_pdfdoc_width_and_height(mupdfdoc,pageno,&width_in,&height_in);
+        if (!status)
+            {
+            (*width) = width_in*dpi*k2settings->document_scale_factor;
+            (*height) = height_in*dpi*k2settings->document_scale_factor;
+            return(0);
+            }
+        if (k2settings->usegs<0)
+            return(status);
+        }
+#endif
+    /* Read at low dpi and scale up */
+    status=bmp_get_one_document_page(tmp,k2settings,src_type,filename,mupdfdoc,pageno,10.,8,out);
+    if (status<0)
+        return(status);
+    (*width) = (dpi/10.)*tmp->width;
+    (*height) = (dpi/10.)*tmp->height;
+    return(0);
+    }
+
+
+/*
+** Source page tone adjustment:  contrast (see bmp_pick_contrast()) and, if
+** -paintwhite is set, painting pixels at or above the white threshold white.
+** Both are per-level mappings, so they are composed into one 256-entry table
+** for srcgrey and applied, together with the matching change to the colour
+** bitmap, in a single pass over the page.
+*/
+void bmp_adjust_source_tone(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,
+                            K2PDFOPT_SETTINGS *k2settings,int *white)
 
     {
-    int i,j,tries,wc,tc,hist[256];
+    int i,j,paint,color,bpp;
+    double cgrey,ccolor;
+    unsigned char lutg[256],lutc[256],painted[256];
+
+    bmp_pick_contrast(srcgrey,k2settings,white,&cgrey,&ccolor);
+    paint = k2settings->src_paintwhite;
+    color = (src!=NULL && src!=srcgrey) ? (src->bpp>8 ? 2 : 1) : 0;
+    /* Colour contrast only applies to 24-bit colour output */
+    if (color==2 && (!k2settings->dst_color || fabs(ccolor-1.0)<=1e-4))
+        color=paint ? 1 : 0;
+    if (fabs(cgrey-1.0)<=1e-4 && !paint && color!=2)
+        return;
+    if (fabs(cgrey-1.0)>1e-4)
+        bmp_contrast_lut(lutg,cgrey);
+    else
+        for (i=0;i<256;i++)
+            lutg[i]=i;
+    for (i=0;i<256;i++)
+        {
+        painted[i] = (paint && lutg[i]>=(*white));
+        if (painted[i])
+            lutg[i]=255;
+        }
+    if (color==2)
+        bmp_contrast_lut(lutc,ccolor);
+    bpp = src!=NULL && src->bpp==24 ? 3 : 1;
+    for (j=0;j<srcgrey->height;j++)
+        {
+        unsigned char *pg,*p;
+
+        pg=bmp_rowptr_from_top(srcgrey,j);
+        if (color==0)
+            {
+            for (i=0;i<srcgrey->width;i++)
+                pg[i]=lutg[pg[i]];
+            continue;
+            }
+        p=bmp_rowptr_from_top(src,j);
+        if (color==1)
+            {
+            for (i=0;i<srcgrey->width;i++,p+=bpp)
+                {
+                if (painted[pg[i]])
+                    memset(p,255,bpp);
+                pg[i]=lutg[pg[i]];
+                }
+            continue;
+            }
+        for (i=0;i<srcgrey->width;i++,p+=3)
+            {
+            if (painted[pg[i]])
+                p[0]=p[1]=p[2]=255;
+            else
+                {
+                p[0]=lutc[p[0]];
+                p[1]=lutc[p[1]];
+                p[2]=lutc[p[2]];
+                }
+            pg[i]=lutg[pg[i]];
+            }
+        }
+    }
+
+
+/*
+** Chooses the contrast for the source page:  the contrast for srcgrey in
+** *cgrey and the one for the colour bitmap in *ccolor.  These are the same
+** except when no contrast up to -cmax brings enough pixels to white--then
+** *ccolor is one step past the last one tried, as it always has been.
+*/
+static void bmp_pick_contrast(WILLUSBITMAP *srcgrey,K2PDFOPT_SETTINGS *k2settings,int *white,
+                              double *cgrey,double *ccolor)
+
+    {
+    int i,j,tries,wc,tc,hist0[256],hist[256];
     double contrast,rat0;
-    WILLUSBITMAP *dst,_dst;
 
     if (k2settings->debug && k2settings->verbose)
         k2printf("\nAt adjust_contrast.\n");
@@ -118,33 +250,42 @@ void bmp_adjust_contrast(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,
     /* If contrast_max negative, use it as fixed contrast adjustment. */
     if (k2settings->contrast_max < 0.)
         {
-        bmp_contrast_adjust(srcgrey,srcgrey,-k2settings->contrast_max);
-        if (k2settings->dst_color && src!=srcgrey && src!=NULL && src->bpp>8
-                                  && fabs(k2settings->contrast_max+1.0)>1e-4)
-            bmp_contrast_adjust(src,src,-k2settings->contrast_max);
+        (*cgrey)=(*ccolor)=-k2settings->contrast_max;
         return;
         }
-    dst=&_dst;
-    bmp_init(dst);
     wc=0; /* Avoid compiler warning */
     tc=srcgrey->width*srcgrey->height;
     rat0=0.5; /* Avoid compiler warning */
+    /*
+    ** Contrast adjustment is a mapping of pixel values, so the histogram
+    ** for each contrast tried comes from the source histogram.
+    */
+    for (i=0;i<256;i++)
+        hist0[i]=0;
+    for (j=0;j<srcgrey->height;j++)
+        {
+        unsigned char *p;
+        p=bmp_rowptr_from_top(srcgrey,j);
+        for (i=0;i<srcgrey->width;i++,p++)
+            hist0[p[0]]++;
+        }
+    (*cgrey)=1.0;
     for (contrast=1.0,tries=0;contrast<k2settings->contrast_max+.01;tries++)
         {
+        (*cgrey)=contrast;
         if (fabs(contrast-1.0)>1e-4)
-            bmp_contrast_adjust(dst,srcgrey,contrast);
-        else
-            bmp_copy(dst,srcgrey);
-        /*Get bitmap histogram */
-        for (i=0;i<256;i++)
-            hist[i]=0;
-        for (j=0;j<dst->height;j++)
             {
-            unsigned char *p;
-            p=bmp_rowptr_from_top(dst,j);
-            for (i=0;i<dst->width;i++,p++)
-                hist[p[0]]++;
+            unsigned char newval[256];
+
+            bmp_contrast_lut(newval,contrast);
+            for (i=0;i<256;i++)
+                hist[i]=0;
+            for (i=0;i<256;i++)
+                hist[newval[i]]+=hist0[i];
             }
+        else
+            for (i=0;i<256;i++)
+                hist[i]=hist0[i];
         if (tries==0)
             {
             int h1;
@@ -177,17 +318,7 @@ void bmp_adjust_contrast(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,
     if (k2settings->debug)
         k2printf("Contrast=%7.2f, rat[252-255]/rat0=%.4f\n",
                        contrast,(double)wc/tc/rat0);
-/*
-bmp_write(dst,"outc.png",stdout,100);
-wfile_written_info("outc.png",stdout);
-exit(10);
-*/
-    bmp_copy(srcgrey,dst);
-    /* Maybe don't adjust the contrast for the color bitmap? */
-    if (k2settings->dst_color && src!=srcgrey && src!=NULL && src->bpp>8
-                              && fabs(contrast-1.0)>1e-4)
-        bmp_contrast_adjust(src,src,contrast);
-    bmp_free(dst);
+    (*ccolor)=contrast;
     }
 
 
@@ -788,14 +919,16 @@ printf("del=%d\n",del);
             if (c<0 || c>bmp->width-1)
                 break;
             p=bmp_rowptr_from_top(bmp,r);
-            for (i=c;i<=c+maxdev && i<bmp->width;i++)
-                if (p[i]<white_thresh)
-                    break;
+            /* First dark pixel in c .. c+maxdev */
+            i=c+bmpscan_first_below(&p[c],bmp->width-c<maxdev+1 ? bmp->width-c : maxdev+1,
+                                    white_thresh);
             if (i>c+maxdev || i>=bmp->width)
                 {
-                for (i=c-1;i>=c-maxdev && i>=0;i--)
-                    if (p[i]<white_thresh)
-                        break;
+                int i0;
+
+                /* Last dark pixel in c-maxdev .. c-1 (i0-1 if none) */
+                i0 = c-maxdev<0 ? 0 : c-maxdev;
+                i=i0+bmpscan_last_below(&p[i0],c-i0,white_thresh);
                 if (i<c-maxdev || i<0)
                     {
                     brc++;
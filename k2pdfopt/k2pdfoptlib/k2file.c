@@ -41,7 +41,14 @@ static int toclist_valid(char *s,FILE *out);
 static WPDFOUTLINE *wpdfoutline_from_pagelist(char *pagelist,int maxpages);
 static int tocwrites=0;
 static int get_source_type(char *filename);
-static int file_numpages(char *filename,char *mupdffilename,int src_type,int *usegs);
+static int file_numpages(char *filename,char *mupdffilename,int src_type,WMUPDFDOC *mupdfdoc,
+                         int *usegs);
+#ifdef HAVE_MUPDF_LIB
+static int mupdf_numpages(char *mupdffilename,WMUPDFDOC *mupdfdoc);
+static void k2file_render_ahead(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings,int i,
+                                int pagestep,int pagecount,int np,int dpi,int bpp);
+static void k2file_mupdf_cache_report(MASTERINFO *masterinfo);
+#endif
 #ifdef HAVE_GHOSTSCRIPT
 static void   gs_postprocess(char *filename);
 #endif
@@ -519,14 +526,20 @@ printf("pagelist[%d]=%d\n",i,pagelist[i]);
         }
     if (src_type==SRC_TYPE_PDF || src_type==SRC_TYPE_DJVU)
         {
-        np=file_numpages(filename,mupdffilename,src_type,&k2settings->usegs);
+#ifdef HAVE_MUPDF_LIB
+        wmupdfdoc_set_store_size(k2settings->mupdf_store_mb);
+#endif
+        np=file_numpages(filename,mupdffilename,src_type,&masterinfo->mupdfdoc,&k2settings->usegs);
 #ifdef HAVE_MUPDF_LIB
         if (src_type==SRC_TYPE_PDF)
             {
             /* Get bookmarks / outline from PDF file */
             if (!or_detect && k2settings->use_toc!=0 && !toclist_valid(k2settings->toclist,NULL))
                 {
-                masterinfo->outline=wpdfoutline_read_from_pdf_file(mupdffilename);
+                if (masterinfo->mupdfdoc.ctx!=NULL)
+                    masterinfo->outline=wpdfoutline_read_from_pdfdoc(&masterinfo->mupdfdoc);
+                else
+                    masterinfo->outline=wpdfoutline_read_from_pdf_file(mupdffilename);
                 /* Save TOC if requested */
                 if (k2settings->tocsavefile[0]!='\0')
                     {
@@ -623,9 +636,18 @@ printf("pagelist[%d]=%d\n",i,pagelist[i]);
         else
            k2printf("%ss",folder?"file":"page");
         k2printf(" from " TTEXT_BOLD2 "%s" TTEXT_NORMAL " ...\n",filename);
+        if (k2settings->verbose)
+            k2printf("Pixel scan kernels:  %s\n",bmpscan_kernel_name());
         }
     if (or_detect)
         k2printf("\nDetecting document orientation ... ");
+#ifdef HAVE_MUPDF_LIB
+    /* Render upcoming PDF pages on other threads while each page is processed */
+    if (src_type==SRC_TYPE_PDF && !folder && k2settings->usegs<=0 && pagecount>1
+             && k2settings->render_threads>0 && k2settings->render_ahead>0)
+        bmpmupdf_renderq_start(&masterinfo->renderq,&masterinfo->mupdfdoc,
+                               k2settings->render_threads,k2settings->render_ahead);
+#endif
     bormean=1.0;
     for (i=0;1;i+=pagestep)
         {
@@ -662,17 +684,19 @@ willus_mem_debug_update(bmpfile);
             }
         else
             { 
-            double npix;
+            double npix,ww,hh;
+            int bpp;
 
             /* If not a PDF/DJVU/PS file, only read it once. */
             if (i>0 && src_type!=SRC_TYPE_PDF && src_type!=SRC_TYPE_DJVU
                     && src_type!=SRC_TYPE_PS)
                 break;
 
-            /* Pre-read at low dpi to check bitmap size */
+            /* Get bitmap size (without rendering the page if possible) */
             wsys_set_decimal_period(1);
-            status=bmp_get_one_document_page(src,k2settings,src_type,mupdffilename,pageno,10.,8,
-                                             stdout);
+            status=bmp_get_one_document_page_size(src,k2settings,src_type,mupdffilename,
+                                                  &masterinfo->mupdfdoc,pageno,(double)dpi,
+                                                  &ww,&hh,stdout);
             wsys_set_decimal_period(1);
             if (status<0)
                 {
@@ -690,27 +714,24 @@ willus_mem_debug_update(bmpfile);
                 }
 
             /* Sanity check the bitmap size */
-            npix = (double)(dpi/10.)*(dpi/10.)*src->width*src->height;
+            npix = ww*hh;
             if (npix > 2.5e8 && !pixwarn)
                 {
-                int ww,hh;
-                ww=(int)((double)(dpi/10.)*src->width+.5);
-                hh=(int)((double)(dpi/10.)*src->height+.5);
                 k2printf("\a\n" TTEXT_WARN "\n\a ** Source resolution is very high (%d x %d pixels)!\n"
                         "    You may want to reduce the -odpi or -idpi setting!\n"
                         "    k2pdfopt may crash when reading the source file..."
-                        TTEXT_NORMAL "\n\n",ww,hh);
+                        TTEXT_NORMAL "\n\n",(int)(ww+.5),(int)(hh+.5));
                 pixwarn=1;
                 }
 
             /* Read again at nominal source dpi */
+            bpp=k2settings_need_color_initially(k2settings) ? 24 : 8;
+#ifdef HAVE_MUPDF_LIB
+            k2file_render_ahead(masterinfo,k2settings,i,pagestep,pagecount,np,dpi,bpp);
+#endif
             wsys_set_decimal_period(1);
-            if (k2settings_need_color_initially(k2settings))
-                status=bmp_get_one_document_page(src,k2settings,src_type,mupdffilename,pageno,
-                                                 dpi,24,stdout);
-            else
-                status=bmp_get_one_document_page(src,k2settings,src_type,mupdffilename,pageno,
-                                                 dpi,8,stdout);
+            status=bmp_get_one_document_page(src,k2settings,src_type,mupdffilename,
+                                             &masterinfo->mupdfdoc,pageno,dpi,bpp,stdout);
             wsys_set_decimal_period(1);
             if (status<0)
                 {
@@ -814,6 +835,8 @@ willus_mem_debug_update(bmpfile);
             k2printf("%d new page%s saved.\n",np,np==1?"":"s");
             }
         pw=masterinfo->published_pages;
+        /* Done with this page's analysis temporaries */
+        willus_pmem_page_end(k2settings->verbose);
         }
 /*
 willus_mem_debug_update("End");
@@ -890,12 +913,21 @@ willus_mem_debug_update("End");
 #ifdef HAVE_MUPDF_LIB
     if (src_type==SRC_TYPE_PDF)
         {
-        if (wmupdf_info_field(mupdffilename,"Author",author,255)<0)
-            author[0]='\0';
-        if (wmupdf_info_field(mupdffilename,"CreationDate",cdate,127)<0)
-            cdate[0]='\0';
-        if (wmupdf_info_field(mupdffilename,"Title",title,255)<0)
-            title[0]='\0';
+        if (masterinfo->mupdfdoc.ctx!=NULL)
+            {
+            wmupdfdoc_info_field(&masterinfo->mupdfdoc,"Author",author,255);
+            wmupdfdoc_info_field(&masterinfo->mupdfdoc,"CreationDate",cdate,127);
+            wmupdfdoc_info_field(&masterinfo->mupdfdoc,"Title",title,255);
+            }
+        else
+            {
+            if (wmupdf_info_field(mupdffilename,"Author",author,255)<0)
+                author[0]='\0';
+            if (wmupdf_info_field(mupdffilename,"CreationDate",cdate,127)<0)
+                cdate[0]='\0';
+            if (wmupdf_info_field(mupdffilename,"Title",title,255)<0)
+                title[0]='\0';
+            }
         }
     else
 #endif
@@ -975,6 +1007,10 @@ printf("Calling wmupdf_remake_pdf()...\n");
 #endif
     if (local_tocwrites>0)
         k2printf(TTEXT_BOLD "%d bytes" TTEXT_NORMAL " written to " TTEXT_MAGENTA "%s" TTEXT_NORMAL ".\n\n",(int)(wfile_size(k2settings->tocsavefile)+.5),k2settings->tocsavefile);
+#ifdef HAVE_MUPDF_LIB
+    if (k2settings->verbose)
+        k2file_mupdf_cache_report(masterinfo);
+#endif
     masterinfo_free(masterinfo,k2settings);
     if (folder)
         filelist_free(fl);
@@ -1283,7 +1319,13 @@ static int get_source_type(char *filename)
     }
 
 
-static int file_numpages(char *filename,char *mupdffilename,int src_type,int *usegs)
+/*
+** If mupdfdoc is not NULL, a MuPDF document session is opened on the PDF file
+** and left open (for use by bmp_get_one_document_page()).  The caller must
+** close it with wmupdfdoc_close().
+*/
+static int file_numpages(char *filename,char *mupdffilename,int src_type,WMUPDFDOC *mupdfdoc,
+                         int *usegs)
 
     {
     int np;
@@ -1292,14 +1334,14 @@ static int file_numpages(char *filename,char *mupdffilename,int src_type,int *us
 #ifdef HAVE_MUPDF_LIB
     if (src_type==SRC_TYPE_PDF)
         {
-        np=wmupdf_numpages(mupdffilename);
+        np=mupdf_numpages(mupdffilename,mupdfdoc);
 #ifdef HAVE_WIN32_API
         if (np<0)
             {
             int ns;
             ns=wsys_filename_8dot3(mupdffilename,filename,MAXFILENAMELEN-1);
             if (ns>0 && stricmp(filename,mupdffilename))
-                np=wmupdf_numpages(mupdffilename);
+                np=mupdf_numpages(mupdffilename,mupdfdoc);
             else
                 strcpy(mupdffilename,filename);
             }
@@ -1332,6 +1374,77 @@ static int file_numpages(char *filename,char *mupdffilename,int src_type,int *us
     }
 
 
+#ifdef HAVE_MUPDF_LIB
+static int mupdf_numpages(char *mupdffilename,WMUPDFDOC *mupdfdoc)
+
+    {
+    int status;
+
+    if (mupdfdoc==NULL)
+        return(wmupdf_numpages(mupdffilename));
+    status=wmupdfdoc_open(mupdfdoc,mupdffilename,"");
+    if (status<0)
+        return(status);
+    /* Info fields, outline and page sizes are all read now, in one pass */
+    wmupdfdoc_harvest(mupdfdoc);
+    return(mupdfdoc->np);
+    }
+
+
+/*
+** Queue the source pages after page index i (up to k2settings->render_ahead
+** of them) to be rendered by the render-ahead threads.
+*/
+static void k2file_render_ahead(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings,int i,
+                                int pagestep,int pagecount,int np,int dpi,int bpp)
+
+    {
+    int j;
+
+    if (masterinfo->renderq.sys==NULL)
+        return;
+    for (j=1;j<=k2settings->render_ahead;j++)
+        {
+        int index;
+
+        index=i+j*pagestep;
+        if (index+1>pagecount)
+            break;
+        bmpmupdf_renderq_request(&masterinfo->renderq,
+                  double_pagelist_page_by_index(k2settings->pagelist,k2settings->pagexlist,index,np),
+                  dpi*k2settings->document_scale_factor,bpp);
+        }
+    }
+
+
+/*
+** Echo how often source pages were found already interpreted (display list
+** cache) or rendered (render-ahead threads), for tuning -store, -nt, -ra.
+*/
+static void k2file_mupdf_cache_report(MASTERINFO *masterinfo)
+
+    {
+    WMUPDFDOC *mdoc;
+    WMUPDFRENDERQ *q;
+    int n;
+
+    mdoc=&masterinfo->mupdfdoc;
+    if (mdoc->ctx==NULL)
+        return;
+    n=mdoc->dlist_hits+mdoc->dlist_misses;
+    if (n>0)
+        k2printf("MuPDF page display lists:  %d hits, %d misses (%.0f%% hit rate).\n",
+                 mdoc->dlist_hits,mdoc->dlist_misses,100.*mdoc->dlist_hits/n);
+    q=&masterinfo->renderq;
+    n=q->hits+q->misses;
+    if (n>0)
+        k2printf("Render-ahead (%d threads):  %d of %d pages already rendered (%.0f%%).\n",
+                 q->nthreads,q->hits,n,100.*q->hits/n);
+    k2printf("\n");
+    }
+#endif
+
+
 void k2file_get_overlay_bitmap(WILLUSBITMAP *bmp,double *dpi,char *filename,char *pagelist)
 
     {
@@ -1340,6 +1453,7 @@ void k2file_get_overlay_bitmap(WILLUSBITMAP *bmp,double *dpi,char *filename,char
     static K2PDFOPT_SETTINGS _k2settings;
     K2PDFOPT_SETTINGS *k2settings;
     WILLUSBITMAP *tmp,_tmp;
+    WMUPDFDOC _mupdfdoc,*mupdfdoc;
 
     (*dpi)=100.;
     src_type = get_source_type(filename);
@@ -1351,7 +1465,11 @@ void k2file_get_overlay_bitmap(WILLUSBITMAP *bmp,double *dpi,char *filename,char
     k2pdfopt_settings_init(k2settings);
     k2settings->document_scale_factor=1.0;
     k2settings->usegs=-1;
-    np=file_numpages(filename,mupdffilename,src_type,&k2settings->usegs);
+    mupdfdoc=&_mupdfdoc;
+#ifdef HAVE_MUPDF_LIB
+    wmupdfdoc_init(mupdfdoc);
+#endif
+    np=file_numpages(filename,mupdffilename,src_type,mupdfdoc,&k2settings->usegs);
     for (c=0,i=1;i<=np;i++)
         if (pagelist_includes_page(pagelist,i,np))
             c++;
@@ -1370,7 +1488,8 @@ void k2file_get_overlay_bitmap(WILLUSBITMAP *bmp,double *dpi,char *filename,char
 
         if (!pagelist_includes_page(pagelist,i,np))
             continue;
-        status=bmp_get_one_document_page(tmp,k2settings,src_type,mupdffilename,i,100.,8,NULL);
+        status=bmp_get_one_document_page(tmp,k2settings,src_type,mupdffilename,mupdfdoc,
+                                         i,100.,8,NULL);
         c2++;
 #ifdef HAVE_K2GUI
         if (k2gui_active())
@@ -1391,6 +1510,9 @@ void k2file_get_overlay_bitmap(WILLUSBITMAP *bmp,double *dpi,char *filename,char
             bmp8_merge(bmp,tmp,c);
         }
     bmp_free(tmp);
+#ifdef HAVE_MUPDF_LIB
+    wmupdfdoc_close(mupdfdoc);
+#endif
     }
 
 
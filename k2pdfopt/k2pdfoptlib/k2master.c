@@ -53,6 +53,17 @@ void masterinfo_init(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings)
     extern char *k2pdfopt_version;
     int i;
 
+#ifdef HAVE_MUPDF_LIB
+    wmupdfdoc_init(&masterinfo->mupdfdoc);
+    bmpmupdf_renderq_init(&masterinfo->renderq);
+#endif
+    blacksat_init(&masterinfo->blacksat);
+    inkmask_init(&masterinfo->inkmask);
+    inkruns_init(&masterinfo->inkruns);
+    inkblobs_init(&masterinfo->inkblobs);
+    bboxcache_init(&masterinfo->bboxcache);
+    rowprofile_init(&masterinfo->rowprofile);
+    wpool_init(&masterinfo->analysis_pool);
     /* Init outline / bookmarks */
     masterinfo->outline=NULL;
     masterinfo->outline_srcpage_completed=-1;
@@ -112,11 +123,24 @@ void masterinfo_free(MASTERINFO *masterinfo,K2PDFOPT_SETTINGS *k2settings)
         wpdfboxes_free(&masterinfo->pageinfo.boxes);
 #endif
     wrapbmp_free(&masterinfo->wrapbmp);
+    blacksat_free(&masterinfo->blacksat);
+    inkmask_free(&masterinfo->inkmask);
+    bboxcache_free(&masterinfo->bboxcache);
+    rowprofile_free(&masterinfo->rowprofile);
+    inkblobs_free(&masterinfo->inkblobs);
+    inkruns_free(&masterinfo->inkruns);
+    wpool_end(&masterinfo->analysis_pool);
     bmp_free(&masterinfo->bmp);
 #ifdef K2PDFOPT_KINDLEPDFVIEWER
     wrectmaps_free(&masterinfo->rectmaps);
 #endif
     wpdfoutline_free(masterinfo->outline);
+#ifdef HAVE_MUPDF_LIB
+    /* Render threads use the session, so stop them first */
+    bmpmupdf_renderq_end(&masterinfo->renderq);
+    wmupdfdoc_close(&masterinfo->mupdfdoc);
+#endif
+    willus_pmem_close();
     }
 
 
@@ -183,10 +207,8 @@ printf("masterinfo->landscape=%d\n",masterinfo->landscape);
         bmp_convert_to_greyscale_ex(srcgrey,src);
     if (!OR_DETECT(rot_deg) && k2settings_need_color_permanently(k2settings))
         bmp_promote_to_24(src);
-    bmp_adjust_contrast(src,srcgrey,k2settings,&white);
-    /* v2.20 -- paint pixels above white threshold white if requested */
-    if (k2settings->src_paintwhite)
-        bmp_paint_white(srcgrey,src,white);
+    /* Contrast, and v2.20 -- paint pixels above white threshold white if requested */
+    bmp_adjust_source_tone(src,srcgrey,k2settings,&white);
 
     /*
     if (k2settings->src_whitethresh>0)
@@ -242,6 +264,32 @@ printf("22\n");
     region->bmp = src;
     region->bmp8 = srcgrey;
     region->pageno = pageno;
+    /*
+    ** Dark pixel counts, mask, runs, and components for the whole page, shared by
+    ** all sub-regions.  The mask, runs, and components are built when first used:
+    ** the runs are only read if there is no summed-area table, and the components
+    ** only for defect trimming.
+    */
+    blacksat_build(&masterinfo->blacksat,srcgrey,white);
+    region->blacksat = &masterinfo->blacksat;
+    inkmask_clear(&masterinfo->inkmask,srcgrey,white);
+    region->inkmask = &masterinfo->inkmask;
+    inkruns_clear(&masterinfo->inkruns,&masterinfo->inkmask);
+    region->inkruns = &masterinfo->inkruns;
+    inkblobs_clear(&masterinfo->inkblobs,&masterinfo->inkruns);
+    region->inkblobs = &masterinfo->inkblobs;
+    bboxcache_clear(&masterinfo->bboxcache,srcgrey);
+    region->bboxcache = &masterinfo->bboxcache;
+    rowprofile_clear(&masterinfo->rowprofile,srcgrey);
+    region->rowprofile = &masterinfo->rowprofile;
+    /*
+    ** Analysis threads are only used on pages without a summed-area table, so
+    ** they are started with the first such page and then kept.
+    */
+    if (masterinfo->analysis_pool.sys==NULL && k2settings->analysis_threads>0
+                                           && masterinfo->blacksat.sum==NULL)
+        wpool_start(&masterinfo->analysis_pool,k2settings->analysis_threads);
+    region->pool = masterinfo->analysis_pool.nthreads>0 ? &masterinfo->analysis_pool : NULL;
     /* Not parsed for rows of text yet */
     textrows_clear(&region->textrows);
     region->bbox.type = REGION_TYPE_UNDETERMINED;
@@ -2453,7 +2501,11 @@ printf("    wtcs->n = %d\n",wtcs->n);
     if (pageno!=masterinfo->pageinfo.srcpage || strcmp(pdffile,masterinfo->srcfilename))
         {
         wtextchars_clear(wtcs); /* v2.32 bug fix--clear out any previous words */
-        wtextchars_fill_from_page_ex(wtcs,masterinfo->srcfilename,masterinfo->pageinfo.srcpage,"",1);
+        /* Use the open session so the page display list is shared w/rendering */
+        if (masterinfo->mupdfdoc.ctx!=NULL)
+            wtextchars_fill_from_pdfdoc(wtcs,&masterinfo->mupdfdoc,masterinfo->pageinfo.srcpage,1);
+        else
+            wtextchars_fill_from_page_ex(wtcs,masterinfo->srcfilename,masterinfo->pageinfo.srcpage,"",1);
         wtextchars_rotate_clockwise(wtcs,360-(int)masterinfo->pageinfo.srcpage_rot_deg);
         pageno=masterinfo->pageinfo.srcpage;
         strncpy(pdffile,masterinfo->srcfilename,511);
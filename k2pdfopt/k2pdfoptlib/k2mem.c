@@ -33,6 +33,50 @@ static unsigned char *wmptr[16384];
 static int nm;
 #endif
 
+/*
+** Page scratch memory (willus_pmem_...):  a stack of large chunks that the
+** page analysis temporaries are carved from instead of going through
+** malloc() / free() one at a time.  It is a stack, not an arena that is
+** wiped at the end of each page:  a freed block is only reclaimed once
+** every block above it has been freed too, which is the usual pattern
+** (temporaries are freed in about the reverse order they were allocated).
+** A block freed out of order stays as a hole until then, and so does the
+** old copy of a block that willus_pmem_realloc_warn() had to move.  The
+** chunks are only trimmed back when every block has been freed, which
+** willus_pmem_page_end() checks after each source page--so nothing should
+** hold a scratch block from one page to the next.  Not thread-safe--only
+** the main thread allocates during page analysis.
+*/
+#define PMEM_CHUNK_SIZE  0x400000
+#define PMEM_MAX_CHUNKS  32
+typedef struct
+    {
+    long size;      /* Block size including this header */
+    long prevtop;   /* Offset of the block below this one, -1 if none */
+    int  freed;
+    int  index;
+    } PMEMBLOCK;
+#define PMEM_HDR  ((long)((sizeof(PMEMBLOCK)+15)&(~15)))
+typedef struct
+    {
+    unsigned char *data;
+    long size;
+    long used;
+    long top;       /* Offset of the last block, -1 if none */
+    } PMEMCHUNK;
+static PMEMCHUNK pmem_chunk[PMEM_MAX_CHUNKS];
+static int pmem_nchunks=0;
+static int pmem_cur=0;
+static int pmem_nlive=0;     /* Blocks not yet freed */
+static int pmem_nalloc=0;    /* Blocks allocated since the last page end */
+static long pmem_used=0;     /* Bytes in use (including freed blocks not reclaimed) */
+static long pmem_peak=0;
+
+static void *pmem_alloc(int index,long size);
+static PMEMCHUNK *pmem_chunk_of(void *ptr);
+static void pmem_release(void *ptr);
+static void pmem_show_live(void);
+
 
 void willus_dmem_alloc_warn(int index,void **ptr,int size,char *funcname,int exitcode)
 
@@ -109,6 +153,288 @@ void willus_dmem_free(int index,double **ptr,char *funcname)
     }
 
 
+/*
+** Allocate page scratch memory.  Must be freed with willus_pmem_free().
+*/
+void willus_pmem_alloc_warn(int index,void **ptr,int size,char *funcname,int exitcode)
+
+    {
+#if (!(WILLUSDEBUGX & 0x100000))
+    (*ptr)=pmem_alloc(index,size);
+    if ((*ptr)!=NULL)
+        return;
+#endif
+    willus_dmem_alloc_warn(index,ptr,size,funcname,exitcode);
+    }
+
+
+/*
+** Resize a block from willus_pmem_alloc_warn() (or NULL), keeping the
+** first oldsize bytes.  Grows in place if it is the last block.
+*/
+void willus_pmem_realloc_warn(int index,void **ptr,int newsize,int oldsize,char *funcname,
+                              int exitcode)
+
+    {
+    void *newptr;
+
+#if (!(WILLUSDEBUGX & 0x100000))
+    if ((*ptr)!=NULL)
+        {
+        PMEMCHUNK *chunk;
+
+        chunk=pmem_chunk_of(*ptr);
+        if (chunk!=NULL && chunk==&pmem_chunk[pmem_cur]
+                        && (unsigned char *)(*ptr)==chunk->data+chunk->top+PMEM_HDR)
+            {
+            PMEMBLOCK *block;
+            long need;
+
+            block=(PMEMBLOCK *)(chunk->data+chunk->top);
+            /* Non-empty blocks so that the pointer is always inside its chunk */
+            need=PMEM_HDR+((newsize+15)&(~15));
+            if (newsize<1)
+                need += 16;
+            if (chunk->top+need <= chunk->size)
+                {
+                pmem_used += need-block->size;
+                if (pmem_used > pmem_peak)
+                    pmem_peak = pmem_used;
+                chunk->used = chunk->top+need;
+                block->size = need;
+                return;
+                }
+            }
+        }
+#endif
+    willus_pmem_alloc_warn(index,&newptr,newsize,funcname,exitcode);
+    if ((*ptr)!=NULL)
+        {
+        memcpy(newptr,(*ptr),oldsize<newsize ? oldsize : newsize);
+        willus_pmem_free(index,(double **)ptr,funcname);
+        }
+    (*ptr)=newptr;
+    }
+
+
+void willus_pmem_free(int index,double **ptr,char *funcname)
+
+    {
+    if ((*ptr)==NULL)
+        return;
+#if (!(WILLUSDEBUGX & 0x100000))
+    if (pmem_chunk_of(*ptr)!=NULL)
+        {
+        pmem_release(*ptr);
+        (*ptr)=NULL;
+        return;
+        }
+#endif
+    willus_dmem_free(index,ptr,funcname);
+    }
+
+
+/*
+** Called after each source page.  Reports the page's scratch memory use if
+** verbose (with the index of each block still in use) and, if everything
+** has been freed, gives back all but the first chunk.
+*/
+void willus_pmem_page_end(int verbose)
+
+    {
+    static char *funcname="willus_pmem_page_end";
+
+    if (verbose)
+        {
+        k2printf("Page scratch memory:  %d allocations, peak %.2f MB, %d still in use.\n",
+                 pmem_nalloc,pmem_peak/1048576.,pmem_nlive);
+        if (pmem_nlive>0)
+            pmem_show_live();
+        }
+    pmem_nalloc=0;
+    pmem_peak=pmem_used;
+    if (pmem_nlive>0)
+        return;
+    while (pmem_nchunks>1)
+        {
+        pmem_nchunks--;
+        willus_mem_free((double **)&pmem_chunk[pmem_nchunks].data,funcname);
+        }
+    if (pmem_nchunks>0)
+        {
+        pmem_chunk[0].used=0;
+        pmem_chunk[0].top=-1;
+        }
+    pmem_cur=0;
+    pmem_used=pmem_peak=0;
+    }
+
+
+/*
+** Frees the scratch chunks.  Called from masterinfo_free(), so any block
+** still in use has been leaked--its index is reported, but its chunk is
+** freed anyway.
+*/
+void willus_pmem_close(void)
+
+    {
+    static char *funcname="willus_pmem_close";
+
+    if (pmem_nlive>0)
+        {
+        k2printf("Page scratch memory:  %d block%s never freed.\n",
+                 pmem_nlive,pmem_nlive==1?"":"s");
+        pmem_show_live();
+        }
+    pmem_nlive=0;
+    while (pmem_nchunks>0)
+        {
+        pmem_nchunks--;
+        willus_mem_free((double **)&pmem_chunk[pmem_nchunks].data,funcname);
+        }
+    pmem_cur=0;
+    pmem_used=pmem_peak=0;
+    pmem_nalloc=0;
+    }
+
+
+/*
+** Returns NULL if no chunk can hold the block (caller falls back to the heap).
+*/
+static void *pmem_alloc(int index,long size)
+
+    {
+    PMEMCHUNK *chunk;
+    PMEMBLOCK *block;
+    long need;
+    static char *funcname="pmem_alloc";
+
+    if (size<0)
+        return(NULL);
+    need=PMEM_HDR+((size+15)&(~15));
+    if (size<1)
+        need += 16;
+    chunk=(pmem_nchunks>0) ? &pmem_chunk[pmem_cur] : NULL;
+    if (chunk==NULL || chunk->used+need > chunk->size)
+        {
+        int ic;
+
+        /* Chunks past the current one are empty--use the next one if big enough */
+        ic = (chunk==NULL) ? 0 : pmem_cur+1;
+        if (ic<pmem_nchunks && pmem_chunk[ic].size<need)
+            while (pmem_nchunks>ic)
+                {
+                pmem_nchunks--;
+                willus_mem_free((double **)&pmem_chunk[pmem_nchunks].data,funcname);
+                }
+        if (ic>=pmem_nchunks)
+            {
+            long csize;
+
+            if (ic>=PMEM_MAX_CHUNKS)
+                return(NULL);
+            csize = need>PMEM_CHUNK_SIZE ? need : PMEM_CHUNK_SIZE;
+            if (!willus_mem_alloc((double **)&pmem_chunk[ic].data,csize,funcname))
+                return(NULL);
+            pmem_chunk[ic].size=csize;
+            pmem_chunk[ic].used=0;
+            pmem_chunk[ic].top=-1;
+            pmem_nchunks=ic+1;
+            }
+        pmem_cur=ic;
+        chunk=&pmem_chunk[ic];
+        }
+    block=(PMEMBLOCK *)(chunk->data+chunk->used);
+    block->size=need;
+    block->prevtop=chunk->top;
+    block->freed=0;
+    block->index=index;
+    chunk->top=chunk->used;
+    chunk->used+=need;
+    pmem_nlive++;
+    pmem_nalloc++;
+    pmem_used+=need;
+    if (pmem_used > pmem_peak)
+        pmem_peak = pmem_used;
+    return((void *)(chunk->data+chunk->top+PMEM_HDR));
+    }
+
+
+static PMEMCHUNK *pmem_chunk_of(void *ptr)
+
+    {
+    int i;
+    unsigned char *p;
+
+    p=(unsigned char *)ptr;
+    for (i=0;i<pmem_nchunks;i++)
+        if (p>=pmem_chunk[i].data && p<pmem_chunk[i].data+pmem_chunk[i].size)
+            return(&pmem_chunk[i]);
+    return(NULL);
+    }
+
+
+/*
+** List the index of each block not yet freed, bottom of the stack first.
+*/
+static void pmem_show_live(void)
+
+    {
+    int i;
+
+    k2printf("    Still in use (index):");
+    for (i=0;i<pmem_nchunks;i++)
+        {
+        long offset;
+
+        for (offset=0;offset<pmem_chunk[i].used;)
+            {
+            PMEMBLOCK *block;
+
+            block=(PMEMBLOCK *)(pmem_chunk[i].data+offset);
+            if (!block->freed)
+                k2printf(" %d",block->index);
+            offset += block->size;
+            }
+        }
+    k2printf("\n");
+    }
+
+
+/*
+** Mark the block freed, then pop freed blocks off the top of the stack.
+*/
+static void pmem_release(void *ptr)
+
+    {
+    PMEMBLOCK *block;
+
+    block=(PMEMBLOCK *)((unsigned char *)ptr-PMEM_HDR);
+    block->freed=1;
+    pmem_nlive--;
+    while (1)
+        {
+        PMEMCHUNK *chunk;
+
+        chunk=&pmem_chunk[pmem_cur];
+        if (chunk->top>=0)
+            {
+            block=(PMEMBLOCK *)(chunk->data+chunk->top);
+            if (!block->freed)
+                break;
+            pmem_used -= block->size;
+            chunk->used=chunk->top;
+            chunk->top=block->prevtop;
+            continue;
+            }
+        if (pmem_cur==0)
+            break;
+        pmem_cur--;
+        }
+    }
+
+
+
 
 #if (WILLUSDEBUGX & 0x100000)
 void willus_dmem_check(void)
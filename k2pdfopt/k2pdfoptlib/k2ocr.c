@@ -497,7 +497,10 @@ printf("@k2ocr_ocrwords_get_from_ocrlayer.\n");
         {
         ocrwords_free(words);
         wtextchars_clear(wtcs);
-        wtextchars_fill_from_page(wtcs,masterinfo->srcfilename,masterinfo->pageinfo.srcpage,"");
+        if (masterinfo->mupdfdoc.ctx!=NULL)
+            wtextchars_fill_from_pdfdoc(wtcs,&masterinfo->mupdfdoc,masterinfo->pageinfo.srcpage,0);
+        else
+            wtextchars_fill_from_page(wtcs,masterinfo->srcfilename,masterinfo->pageinfo.srcpage,"");
 #if (WILLUSDEBUGX & 0x10000)
 {
 int i;
@@ -354,6 +354,30 @@ int parse_cmd_args(K2PDFOPT_CONVERSION *k2conv,STRBUF *env,STRBUF *cmdline,
                 k2settings->user_usegs=(cl->cmdarg[3]=='-' ? (cl->cmdarg[4]=='-' ? -1 : 0) : 1);
             continue;
             }
+        if (!stricmp(cl->cmdarg,"-nt"))
+            {
+            if (!next_is_number(cl,setvals==1,quiet,&good,&readnext,NULL))
+                break;
+            if (good && setvals==1 && atoi(cl->cmdarg)>=0)
+                k2settings->render_threads=atoi(cl->cmdarg);
+            continue;
+            }
+        if (!stricmp(cl->cmdarg,"-ra"))
+            {
+            if (!next_is_number(cl,setvals==1,quiet,&good,&readnext,NULL))
+                break;
+            if (good && setvals==1 && atoi(cl->cmdarg)>=0)
+                k2settings->render_ahead=atoi(cl->cmdarg);
+            continue;
+            }
+        if (!stricmp(cl->cmdarg,"-store"))
+            {
+            if (!next_is_number(cl,setvals==1,quiet,&good,&readnext,NULL))
+                break;
+            if (good && setvals==1 && atoi(cl->cmdarg)>0)
+                k2settings->mupdf_store_mb=atoi(cl->cmdarg);
+            continue;
+            }
         if (!stricmp(cl->cmdarg,"-n") || !stricmp(cl->cmdarg,"-n-"))
             {
             if (setvals==1)
@@ -377,6 +401,14 @@ int parse_cmd_args(K2PDFOPT_CONVERSION *k2conv,STRBUF *env,STRBUF *cmdline,
             continue;
             }
 #endif
+        if (!stricmp(cl->cmdarg,"-nta"))
+            {
+            if (!next_is_number(cl,setvals==1,quiet,&good,&readnext,NULL))
+                break;
+            if (good && setvals==1 && atoi(cl->cmdarg)>=0)
+                k2settings->analysis_threads=atoi(cl->cmdarg);
+            continue;
+            }
         if (!stricmp(cl->cmdarg,"-r") || !stricmp(cl->cmdarg,"-r-"))
             {
             if (setvals==1)
@@ -284,6 +284,10 @@ typedef struct
     int src_dpi;
     int user_usegs;
     int usegs;
+    int render_threads; /* Threads rendering source pages ahead (0 = off) */
+    int render_ahead;   /* Max source pages rendered ahead */
+    int analysis_threads; /* Extra threads for page analysis (0 = off) */
+    int mupdf_store_mb; /* MuPDF resource store (fonts, images, glyphs) limit */
     int query_user;
     int query_user_explicit;
     int jpeg_quality;
@@ -517,6 +521,123 @@ typedef struct
     int n,na;
     } WRECTMAPS;
     
+/*
+** BLACKSAT is a summed-area table of the dark pixels (< bgcolor) of a
+** source page's grayscale bitmap, so that the number of dark pixels in any
+** row, column, or rectangle of the page is found with four lookups.
+** sum[(r+1)*(width+1)+(c+1)] = # of dark pixels in rows 0..r, columns 0..c.
+*/
+typedef struct
+    {
+    WILLUSBITMAP *bmp8; /* Bitmap the table was built from */
+    int bgcolor;
+    int width,height;
+    int *sum;           /* NULL if not built */
+    long size_allocated;
+    } BLACKSAT;
+
+/*
+** INKMASK is a packed 1-bit-per-pixel copy of a source page's grayscale
+** bitmap:  a set bit is a pixel darker than bgcolor.  Pixel c of row r is
+** bit (c&31) of bits[r*wpr+(c>>5)], so dark pixels in a row can be counted
+** a 32-bit word at a time (popcount).  It is only built when first asked
+** for (see bmpregion_inkmask()).
+*/
+typedef struct
+    {
+    WILLUSBITMAP *bmp8; /* Bitmap the mask was built from */
+    int bgcolor;
+    int width,height;
+    int wpr;            /* 32-bit words per row */
+    unsigned int *bits; /* NULL if not built */
+    long size_allocated;
+    int stale;          /* 1 = (re)build from bmp8 at first use */
+    } INKMASK;
+
+/*
+** INKRUNS lists the runs of dark pixels in each row of a source page
+** (built from the page's INKMASK).  Row r has runs
+** run[2*i] .. run[2*i+1] (inclusive columns) for i = rowstart[r] .. rowstart[r+1]-1,
+** so work done on it scales with the amount of ink, not the page area.
+*/
+typedef struct
+    {
+    INKMASK *mask;      /* Mask the runs were built from */
+    WILLUSBITMAP *bmp8; /* Bitmap the runs were built from */
+    int bgcolor;
+    int width,height;
+    int *rowstart;      /* height+1 entries, NULL if not built */
+    int *run;
+    int nruns;
+    int rowstart_allocated; /* entries */
+    int run_allocated;      /* runs */
+    int stale;          /* 1 = (re)build from mask at first use */
+    } INKRUNS;
+
+/*
+** INKBLOBS are the 8-connected components of dark pixels of a source page,
+** found from the page's INKRUNS.  Run i (of INKRUNS) is part of component
+** blob[label[i]].  Components are in order of their first pixel (top to
+** bottom, left to right).
+*/
+typedef struct
+    {
+    int c1,r1,c2,r2;    /* Bounding box (inclusive) */
+    int npixels;
+    } INKBLOB;
+
+typedef struct
+    {
+    INKRUNS *runs;      /* Runs the components were built from */
+    WILLUSBITMAP *bmp8;
+    int bgcolor;
+    int *label;         /* One entry per run, NULL if not built */
+    INKBLOB *blob;
+    int n;
+    int label_allocated;
+    int blob_allocated;
+    int stale;          /* 1 = (re)build from runs at first use */
+    } INKBLOBS;
+
+/*
+** BBOXCACHE remembers the results of bmpregion_calc_bbox() for rectangles
+** of a source page, since the same rectangles get trimmed over and over as
+** regions are copied, split, and re-added.  It is direct-mapped:  a new
+** result replaces whatever was in its slot.  Must be cleared whenever the
+** page's pixels change.
+*/
+typedef struct
+    {
+    int c1,r1,c2,r2;    /* Key:  region rectangle, */
+    int bgcolor;        /*       background threshold, */
+    int flags;          /*       and 0=empty, 1=bbox, 2=bbox+text params */
+    int bc1,br1,bc2,br2;
+    int rowbase,h5050,lcheight,capheight;
+    } BBOXCACHEENTRY;
+
+typedef struct
+    {
+    WILLUSBITMAP *bmp8; /* Bitmap the entries are for */
+    BBOXCACHEENTRY *entry;
+    int n;              /* Power of two, 0 if not allocated */
+    } BBOXCACHE;
+
+/*
+** ROWPROFILE keeps the last per-row dark pixel counts that had to be counted
+** the slow way (no summed-area table), so that a sub-region can get its row
+** counts by subtracting the columns it doesn't include.  Must be cleared
+** whenever the page's pixels change.
+*/
+typedef struct
+    {
+    WILLUSBITMAP *bmp8; /* Bitmap the counts are for */
+    int bgcolor;
+    int c1,c2;          /* Columns counted */
+    int r1,r2;          /* Rows counted, r2 < r1 if empty */
+    int *count;         /* count[r-r1] */
+    int na;             /* Entries allocated */
+    } ROWPROFILE;
+
 /*
 ** BMPREGION is a rectangular region within a bitmap.  This is the main
 ** data structure used by k2pdfopt to break up the source page.
@@ -542,6 +663,13 @@ typedef struct
     WILLUSBITMAP *bmp;
     WILLUSBITMAP *bmp8;
     WILLUSBITMAP *marked;
+    BLACKSAT *blacksat; /* Dark pixel counts of bmp8 (not owned), NULL if none */
+    INKMASK *inkmask;   /* 1-bit dark pixel mask of bmp8 (not owned), NULL if none */
+    INKRUNS *inkruns;   /* Dark pixel runs of bmp8 (not owned), NULL if none */
+    INKBLOBS *inkblobs; /* Connected dark components of bmp8 (not owned), NULL if none */
+    BBOXCACHE *bboxcache; /* Cached bboxes of bmp8 (not owned), NULL if none */
+    ROWPROFILE *rowprofile; /* Last counted row profile of bmp8 (not owned), NULL if none */
+    WPOOL *pool;        /* Threads for page analysis (not owned), NULL if none */
     } BMPREGION;
 
 
@@ -592,6 +720,16 @@ typedef struct
     {
     char srcfilename[MAXFILENAMELEN];
     char ocrfilename[MAXFILENAMELEN];
+    WMUPDFDOC mupdfdoc;   /* Source PDF document session (MuPDF only)--open until */
+                          /* masterinfo_free() */
+    WMUPDFRENDERQ renderq; /* Threads rendering upcoming source pages (MuPDF only) */
+    BLACKSAT blacksat;    /* Dark pixel counts of the current source page */
+    INKMASK inkmask;      /* 1-bit dark pixel mask of the current source page */
+    INKRUNS inkruns;      /* Dark pixel runs of the current source page */
+    INKBLOBS inkblobs;    /* Connected dark components of the current source page */
+    BBOXCACHE bboxcache;  /* Bounding boxes found on the current source page */
+    ROWPROFILE rowprofile; /* Last row counts taken on the current source page */
+    WPOOL analysis_pool;  /* Threads splitting up page analysis (-nta) */
     int outline_srcpage_completed; /* Which source page was last checked in the outline */
     PDFFILE outfile;      /* PDF output file data structure */
     WPDFOUTLINE *outline; /* PDF outline / bookmarks structure--loaded by MuPDF only */
@@ -733,6 +871,32 @@ int  userinput_any_string(char *message,char *dstval,int maxlen,char *defname);
 int  get_ttyrows(void);
 
 /* bmpregion.c */
+void blacksat_init(BLACKSAT *sat);
+void blacksat_free(BLACKSAT *sat);
+void blacksat_build(BLACKSAT *sat,WILLUSBITMAP *bmp8,int bgcolor);
+BLACKSAT *bmpregion_blacksat(BMPREGION *region);
+void inkmask_init(INKMASK *mask);
+void inkmask_free(INKMASK *mask);
+void inkmask_build(INKMASK *mask,WILLUSBITMAP *bmp8,int bgcolor);
+void inkmask_clear(INKMASK *mask,WILLUSBITMAP *bmp8,int bgcolor);
+INKMASK *bmpregion_inkmask(BMPREGION *region);
+void inkruns_init(INKRUNS *runs);
+void inkruns_free(INKRUNS *runs);
+void inkruns_build(INKRUNS *runs,INKMASK *mask);
+void inkruns_clear(INKRUNS *runs,INKMASK *mask);
+INKRUNS *bmpregion_inkruns(BMPREGION *region);
+void inkblobs_init(INKBLOBS *blobs);
+void inkblobs_free(INKBLOBS *blobs);
+void inkblobs_build(INKBLOBS *blobs,INKRUNS *runs);
+void inkblobs_clear(INKBLOBS *blobs,INKRUNS *runs);
+INKBLOBS *bmpregion_inkblobs(BMPREGION *region);
+int inkblobs_label_at(INKBLOBS *blobs,int r,int c);
+void bboxcache_init(BBOXCACHE *cache);
+void bboxcache_free(BBOXCACHE *cache);
+void bboxcache_clear(BBOXCACHE *cache,WILLUSBITMAP *bmp8);
+void rowprofile_init(ROWPROFILE *prof);
+void rowprofile_free(ROWPROFILE *prof);
+void rowprofile_clear(ROWPROFILE *prof,WILLUSBITMAP *bmp8);
 int  bmpregion_row_black_count(BMPREGION *region,int r0);
 int  bmpregion_col_black_count(BMPREGION *region,int c0);
 void bmpregion_write(BMPREGION *region,char *filename);
@@ -750,7 +914,10 @@ void bmpregion_k2pagebreakmarks_allocate(BMPREGION *region);
 void bmpregion_k2pagebreakmarks_free(BMPREGION *region);
 void bmpregion_copy(BMPREGION *dst,BMPREGION *src,int copy_textrows);
 void bmpregion_calc_bbox(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,int calc_text_params);
+void bmpregion_calc_bbox_ex(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,int calc_text_params,
+                            int need_counts);
 void bmpregion_trim_margins(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,int flags);
+void bmpregion_fill_rowcount(BMPREGION *region,int c1,int c2);
 void bmpregion_hyphen_detect(BMPREGION *region,int hyphen_detect,int left_to_right);
 int  bmpregion_textheight(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,int i1,int i2);
 int  bmpregion_is_centered(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,int i1,int i2);
@@ -956,8 +1123,12 @@ void pagelist_get_array(int **pagelist,char *asciilist);
 
 /* k2bmp.c */
 int    bmp_get_one_document_page(WILLUSBITMAP *src,K2PDFOPT_SETTINGS *k2pdfopt,
-                              int src_type,char *filename,
+                              int src_type,char *filename,WMUPDFDOC *mupdfdoc,
                               int pageno,double dpi,int bpp,FILE *out);
+int    bmp_get_one_document_page_size(WILLUSBITMAP *tmp,K2PDFOPT_SETTINGS *k2settings,
+                                   int src_type,char *filename,WMUPDFDOC *mupdfdoc,
+                                   int pageno,double dpi,double *width,double *height,
+                                   FILE *out);
 double bmp_orientation(WILLUSBITMAP *bmp);
 void   bmp_clear_outside_crop_border(MASTERINFO *masterinfo,WILLUSBITMAP *src,
                                      WILLUSBITMAP *srcgrey,K2PDFOPT_SETTINGS *k2settings);
@@ -972,8 +1143,8 @@ void   bmp_detect_vertical_lines(WILLUSBITMAP *bmp,WILLUSBITMAP *cbmp,double dpi
                                       double maxwidth_in,double minheight_in,double anglemax_deg,
                                       int white_thresh,int erase_vertical_lines,
                                       int debug,int verbose);
-void   bmp_adjust_contrast(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,
-                           K2PDFOPT_SETTINGS *k2settings,int *white);
+void   bmp_adjust_source_tone(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,
+                              K2PDFOPT_SETTINGS *k2settings,int *white);
 void   bmp_paint_white(WILLUSBITMAP *bmpgray,WILLUSBITMAP *bmp,int white_thresh);
 void   bmp_change_colors(WILLUSBITMAP *bmp,char *fgcolor,int fgtype,char *bgcolor,int bgtype);
 void   bmp8_merge(WILLUSBITMAP *dst,WILLUSBITMAP *src,int count);
@@ -984,6 +1155,12 @@ void   k2pagebreakmarks_find_pagebreak_marks(K2PAGEBREAKMARKS *k2pagebreakmarks,
 /* k2mem.c */
 void willus_dmem_alloc_warn(int index,void **ptr,int size,char *funcname,int exitcode);
 void willus_dmem_free(int index,double **ptr,char *funcname);
+void willus_pmem_alloc_warn(int index,void **ptr,int size,char *funcname,int exitcode);
+void willus_pmem_realloc_warn(int index,void **ptr,int newsize,int oldsize,char *funcname,
+                              int exitcode);
+void willus_pmem_free(int index,double **ptr,char *funcname);
+void willus_pmem_page_end(int verbose);
+void willus_pmem_close(void);
 #if (WILLUSDEBUGX & 0x100000)
 void willus_dmem_check(void);
 #endif
@@ -23,6 +23,33 @@
 
 #include "k2pdfopt.h"
 
+/*
+** Clear-shaft values for one row span of bmpregion_find_multicolumn_divider(),
+** filled in by the analysis threads a block at a time, in the order that
+** the sweep will ask for them.
+*/
+typedef struct
+    {
+    BMPREGION *region;
+    int *row_black_count;
+    int *col_black_count;
+    int *pixel_count_array;
+    int rows_per_column;
+    double gt_in;
+    int r1,r2;    /* Rows of the shafts */
+    int width;    /* Shaft width (clipped at region->c2) */
+    int c0;       /* Column of gap[0] */
+    int n;        /* Number of gap[] values */
+    int *gap;     /* bmpregion_is_clear() of the shaft starting at column c0+i, */
+                  /* or -1 if not done yet.                                     */
+    int *col;     /* Columns of the shafts in the block being filled in */
+    int *rowmin,*rowmax; /* The sweep's record of shafts already ruled out */
+    int middle;   /* Sweep goes out both ways from this column */
+    int dm;       /* ... for this many steps */
+    int next;     /* First sweep step not yet filled in */
+    int nblock;   /* Number of shafts to fill in next time */
+    } SHAFTSCAN;
+
 static void bmpregion_source_box_process(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,
                                          MASTERINFO *masterinfo,int level,int pages_done);
 static void pageregions_grid(PAGEREGIONS *pageregions,BMPREGION *region,
@@ -45,6 +72,11 @@ static int add_crop_box(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,
 static int bmpregion_find_multicolumn_divider(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,
                                               int *row_black_count,PAGEREGIONS *pageregions,
                                               K2NOTES *notes);
+static void shaftscan_start(SHAFTSCAN *ss,WPOOL *pool,int r1,int r2);
+static void shaftscan_fill(SHAFTSCAN *ss,WPOOL *pool,int step,int itop,int ibottom,
+                           int ileft,int iright);
+static void shaftscan_one(void *data,int i);
+static int shaftscan_is_clear(SHAFTSCAN *ss,BMPREGION *shaft);
 static void bmpregion_vertically_break(BMPREGION *region,K2PDFOPT_SETTINGS *k2settings,
                           MASTERINFO *masterinfo,double force_scale,int source_page,int ncols,
                           BMPREGION *notes);
@@ -613,6 +645,7 @@ void pageregions_find_columns(PAGEREGIONS *pageregions_sorted,BMPREGION *srcregi
                 /* Insert sub-divided regions into sorted array */
                 pageregions_delete_one(pageregions_sorted,j);
                 pageregions_insert(pageregions_sorted,j,pageregions);
+                pageregions_free(pageregions);
                 j--;
                 }
             }
@@ -645,7 +678,7 @@ static void pageregions_find_next_level(PAGEREGIONS *pageregions_sorted,BMPREGIO
     ** Store information about which rows are mostly clear for future
     ** processing (saves processing time).
     */
-    willus_dmem_alloc_warn(4,(void **)&row_black_count,srcregion->bmp8->height*sizeof(int),
+    willus_pmem_alloc_warn(4,(void **)&row_black_count,srcregion->bmp8->height*sizeof(int),
                            funcname,10);
     for (cgr=0,r0=0;r0<srcregion->bmp8->height;r0++)
         {
@@ -698,7 +731,8 @@ pageregions->pageregion[i].bmpregion.r2);
 #if (WILLUSDEBUGX & 0x200)
 printf("No notes found--trying multi-column.  level=%d, col=%d\n",level,k2settings->max_columns);
 #endif
-            pageregions->n=n0;
+            for (;pageregions->n>n0;pageregions->n--)
+                pageregion_free(&pageregions->pageregion[pageregions->n-1]);
             rh=bmpregion_find_multicolumn_divider(srcregion,k2settings,row_black_count,pageregions,NULL);
 #if (WILLUSDEBUGX & 0x200)
 printf("    rh=%d, found %d regions.\n",rh,pageregions->n-n0);
@@ -781,7 +815,7 @@ printf("    rh=%d, found %d regions.\n",rh,pageregions->n-n0);
         ipr=jpr;
         }
     pageregions_free(pageregions);
-    willus_dmem_free(4,(double **)&row_black_count,funcname);
+    willus_pmem_free(4,(double **)&row_black_count,funcname);
     }
 
 
@@ -1531,6 +1565,7 @@ static int bmpregion_find_multicolumn_divider(BMPREGION *region,K2PDFOPT_SETTING
     int *pixel_count_array;
     int rows_per_column;
     int notesleft;
+    SHAFTSCAN _ss,*ss;
     TEXTROWS *textrows;
     TEXTROW *textrow;
     static char *funcname="bmpregion_find_multicolumn_divider";
@@ -1594,23 +1629,26 @@ printf("After remove small rows:  %d rows left\n",textrows->n);
         fflush(stdout);
         }
     textrows_sort_by_row_position(&region->textrows);
-    willus_dmem_alloc_warn(5,(void **)&rowmin,(region->c2+10)*3*sizeof(int),funcname,10);
+    willus_pmem_alloc_warn(5,(void **)&rowmin,(region->c2+10)*5*sizeof(int),funcname,10);
     rowmax=&rowmin[region->c2+10];
     black_pixel_count_by_column=&rowmax[region->c2+10];
     rows_per_column=0;
 
     /*
     ** If enough memory cache pixel counts into large 2-D array for fast calcs
+    ** (not needed if the page has a summed-area table or ink runs--see
+    ** bmpregion_is_clear()).
     */
     pixel_count_array=NULL;
     rows_per_column=0;
 #if (WILLUSDEBUGX & 0x100000)
-    willus_dmem_alloc_warn(38,(void **)&pixel_count_array,
+    willus_pmem_alloc_warn(38,(void **)&pixel_count_array,
                                   sizeof(int)*(region->c2+2)*(region->r2+2),
                                   funcname,10);
     if (1)
 #else
-    if (willus_mem_alloc((double **)&pixel_count_array,sizeof(int)*(region->c2+2)*(region->r2+2),
+    if (bmpregion_blacksat(region)==NULL && bmpregion_inkruns(region)==NULL
+          && willus_mem_alloc((double **)&pixel_count_array,sizeof(int)*(region->c2+2)*(region->r2+2),
                                   funcname))
 #endif
         {
@@ -1665,6 +1703,38 @@ printf("After remove small rows:  %d rows left\n",textrows->n);
         textrow[0].r1=region->r1;
         textrow[n-1].r2=region->r2;
         }
+    /*
+    ** Shaft checks can be done a little ahead of the sweep by the analysis
+    ** threads--except with a summed-area table, where each one is just four
+    ** look-ups.  The threads only fill in a table; the sweep below still
+    ** makes every decision in order, so the divider found is the same as
+    ** without threads.  See shaftscan_fill().
+    */
+    ss=&_ss;
+    ss->region=region;
+    ss->row_black_count=row_black_count;
+    ss->col_black_count=black_pixel_count_by_column;
+    ss->pixel_count_array=pixel_count_array;
+    ss->rows_per_column=rows_per_column;
+    ss->gt_in=k2settings->gtc_in;
+    ss->width=min_col_gap_pixels;
+    ss->rowmin=rowmin;
+    ss->rowmax=rowmax;
+    ss->middle=region->c1+middle;
+    ss->dm=dm;
+    ss->c0=ss->middle-dm+1-min_col_gap_pixels;
+    if (ss->c0 < region->c1)
+        ss->c0 = region->c1;
+    i=ss->middle+dm-1+min_col_gap_pixels;
+    if (i > region->c2)
+        i = region->c2;
+    ss->n=i-ss->c0+1;
+    ss->gap=(region->pool!=NULL && bmpregion_blacksat(region)==NULL && ss->n>0)
+                ? &black_pixel_count_by_column[region->c2+10] : NULL;
+    ss->col=&black_pixel_count_by_column[2*(region->c2+10)];
+    /* The threads read the page's ink runs--build them here, not in a thread */
+    if (ss->gap!=NULL)
+        bmpregion_inkruns(region);
 
     /* Start with top-most and bottom-most regions, look for column dividers */
     for (itop=0;itop<n && textrow[itop].r1<region->r2+1-min_height_pixels;itop++)
@@ -1682,6 +1752,7 @@ k2printf("itop=%d/%d\n",itop,n);
 #if (WILLUSDEBUGX & 128)
 int qec,lec,colmin,colmax;
 #endif
+            shaftscan_start(ss,region->pool,textrow[itop].r1,textrow[ibottom].r2);
             /*
             ** Look for vertical shaft of clear space that clearly demarcates
             ** two columns
@@ -1702,6 +1773,7 @@ printf("    region->c1=%d, middle=%d\n",region->c1,middle);
                 {
                 int foundgap,ii,c1,c2,iiopt,status;
 
+                shaftscan_fill(ss,region->pool,i,itop,ibottom,ileft,iright);
                 newregion->c1=region->c1+middle-i;
 #if (WILLUSDEBUGX & 128)
 printf("i=%d of %d\n",i,dm);
@@ -1732,8 +1804,7 @@ lec++;
 #if (WILLUSDEBUGX & 128)
 printf("    Checking shaft:  (%d,%d) - (%d,%d)\n",newregion->c1,newregion->r1,newregion->c2,newregion->r2);
 #endif
-                foundgap=bmpregion_is_clear(newregion,row_black_count,black_pixel_count_by_column,
-                                             pixel_count_array,rows_per_column,k2settings->gtc_in);
+                foundgap=shaftscan_is_clear(ss,newregion);
                 if (!foundgap && i>0)
                     {
                     newregion->c1=region->c1+middle+i;
@@ -1761,10 +1832,7 @@ lec++;
 #if (WILLUSDEBUGX & 128)
 printf("    Checking shaft:  (%d,%d) - (%d,%d)\n",newregion->c1,newregion->r1,newregion->c2,newregion->r2);
 #endif
-                    foundgap=bmpregion_is_clear(newregion,row_black_count,
-                                           black_pixel_count_by_column,
-                                           pixel_count_array,rows_per_column,
-                                           k2settings->gtc_in);
+                    foundgap=shaftscan_is_clear(ss,newregion);
                     }
                 if (!foundgap)
                     continue;
@@ -1785,10 +1853,7 @@ printf("    Shaft is clear!\n");
                     newregion->c2=c2+ii;
                     if (newregion->c2 < region->c1 || newregion->c2 > region->c2)
                         continue;
-                    newgap=bmpregion_is_clear(newregion,row_black_count,
-                                             black_pixel_count_by_column,
-                                             pixel_count_array,rows_per_column,
-                                             k2settings->gtc_in);
+                    newgap=shaftscan_is_clear(ss,newregion);
                     if (newgap>0 && newgap<foundgap)
                         {
                         iiopt=ii;
@@ -1887,11 +1952,11 @@ printf("Notes region: (%d - %d) / %d\n",column[ic1].c1,column[ic1].c2,region->c2
                     }
                     colheight = textrow[ibottom].r2-region->r1+1;
 #if (WILLUSDEBUGX & 0x100000)
-                    willus_dmem_free(38,(double **)&pixel_count_array,funcname);
+                    willus_pmem_free(38,(double **)&pixel_count_array,funcname);
 #else
                     willus_mem_free((double **)&pixel_count_array,funcname);
 #endif
-                    willus_dmem_free(5,(double **)&rowmin,funcname);
+                    willus_pmem_free(5,(double **)&rowmin,funcname);
                     bmpregion_free(&column[1]);
                     bmpregion_free(&column[0]);
                     bmpregion_free(newregion);
@@ -1919,11 +1984,11 @@ printf("Done looking for columns.\n");
                            k2settings,k2settings->src_trim?0xf:0);
     /* (*divider_column)=region->c2+1; */
 #if (WILLUSDEBUGX & 0x100000)
-    willus_dmem_free(38,(double **)&pixel_count_array,funcname);
+    willus_pmem_free(38,(double **)&pixel_count_array,funcname);
 #else
     willus_mem_free((double **)&pixel_count_array,funcname);
 #endif
-    willus_dmem_free(5,(double **)&rowmin,funcname);
+    willus_pmem_free(5,(double **)&rowmin,funcname);
     bmpregion_free(&column[1]);
     bmpregion_free(&column[0]);
     bmpregion_free(newregion);
@@ -1934,6 +1999,117 @@ k2printf("Returning %d\n",region->r2-region->r1+1);
     }
 
 
+/*
+** Start a new row span (rows r1 - r2):  nothing is filled in yet.
+*/
+static void shaftscan_start(SHAFTSCAN *ss,WPOOL *pool,int r1,int r2)
+
+    {
+    int i;
+
+    if (ss->gap==NULL)
+        return;
+    ss->r1=r1;
+    ss->r2=r2;
+    for (i=0;i<ss->n;i++)
+        ss->gap[i]=-1;
+    ss->next=0;
+    ss->nblock=pool->nthreads+1;
+    }
+
+
+/*
+** Called by the sweep at the start of each step.  Once the sweep reaches
+** the shafts filled in so far, fill in the next block of them:  the shafts
+** the sweep will check from this step on, outward from the middle column,
+** leaving out the ones it will skip (the same tests as the sweep--already
+** checked, or already ruled out for this row span by rowmin[]/rowmax[]).
+** The block doubles in size each time, so if the sweep stops at a gap, at
+** most about half of the shafts filled in went unused.  Does nothing if
+** ss->gap is NULL.
+*/
+static void shaftscan_fill(SHAFTSCAN *ss,WPOOL *pool,int step,int itop,int ibottom,
+                           int ileft,int iright)
+
+    {
+    int n;
+
+    if (ss->gap==NULL || step<ss->next)
+        return;
+    for (n=0;step<ss->dm && n<ss->nblock;step++)
+        {
+        int c;
+
+        c=ss->middle-step;
+        if (c<=ileft && c>=ss->c0 && c<ss->c0+ss->n && ss->gap[c-ss->c0]<0
+                     && !(itop >= ss->rowmin[c] && ibottom <= ss->rowmax[c]))
+            ss->col[n++]=c;
+        if (step==0)
+            continue;
+        c=ss->middle+step;
+        if (c>=iright && c>=ss->c0 && c<ss->c0+ss->n && ss->gap[c-ss->c0]<0
+                      && !(itop >= ss->rowmin[c] && ibottom <= ss->rowmax[c]))
+            ss->col[n++]=c;
+        }
+    ss->next=step;
+    ss->nblock*=2;
+    wpool_run(pool,shaftscan_one,(void *)ss,n);
+    }
+
+
+/*
+** Called from the analysis threads:  only reads the page and writes gap[i].
+*/
+static void shaftscan_one(void *data,int i)
+
+    {
+    SHAFTSCAN *ss;
+    BMPREGION shaft;
+
+    ss=(SHAFTSCAN *)data;
+    shaft=(*ss->region);
+    shaft.c1=ss->col[i];
+    shaft.c2=shaft.c1+ss->width-1;
+    if (shaft.c2 > ss->region->c2)
+        shaft.c2 = ss->region->c2;
+    shaft.r1=ss->r1;
+    shaft.r2=ss->r2;
+    ss->gap[shaft.c1-ss->c0]=bmpregion_is_clear(&shaft,ss->row_black_count,ss->col_black_count,
+                                  ss->pixel_count_array,ss->rows_per_column,ss->gt_in);
+    }
+
+
+/*
+** bmpregion_is_clear() of the shaft, from ss->gap[] if it was filled in for it
+** (and saved there if not).
+*/
+static int shaftscan_is_clear(SHAFTSCAN *ss,BMPREGION *shaft)
+
+    {
+    int c2,*gap;
+
+    gap=NULL;
+    if (ss->gap!=NULL && shaft->r1==ss->r1 && shaft->r2==ss->r2
+                      && shaft->c1>=ss->c0 && shaft->c1<ss->c0+ss->n)
+        {
+        c2=shaft->c1+ss->width-1;
+        if (c2 > ss->region->c2)
+            c2 = ss->region->c2;
+        if (shaft->c2==c2)
+            {
+            gap=&ss->gap[shaft->c1-ss->c0];
+            if ((*gap)>=0)
+                return(*gap);
+            }
+        }
+    c2=bmpregion_is_clear(shaft,ss->row_black_count,ss->col_black_count,
+                          ss->pixel_count_array,ss->rows_per_column,ss->gt_in);
+    if (gap!=NULL)
+        (*gap)=c2;
+    return(c2);
+    }
+
+
 /*
 ** Input:  A generic rectangular region from the source file.  It will not
 **         be checked for multiple columns, but the text may be wrapped
@@ -2027,13 +2203,13 @@ k2printf("    notes=%p\n",notes);
 #if (WILLUSDEBUGX & 0x40000)
 printf("text row count=%d\n",n);
 #endif
-    willus_dmem_alloc_warn(35,(void **)&firstrow,n*2*sizeof(int),funcname,10);
+    willus_pmem_alloc_warn(35,(void **)&firstrow,n*2*sizeof(int),funcname,10);
     lastrow=&firstrow[n];
     if (notes)
         {
         bmpregion_find_textrows(notes,k2settings,1,1);
         notesrows=&notes->textrows;
-        willus_dmem_alloc_warn(43,(void **)&nfirstrow,notesrows->n*2*sizeof(int),funcname,10);
+        willus_pmem_alloc_warn(43,(void **)&nfirstrow,notesrows->n*2*sizeof(int),funcname,10);
         nlastrow=&nfirstrow[notesrows->n];
 #if (WILLUSDEBUGX & 0x40000)
 k2printf("    notes row count=%d\n",notesrows->n);
@@ -2316,8 +2492,8 @@ printf("row0=%d\n",row0);
     if (revert)
         k2pdfopt_settings_restore_output_dpi(k2settings);
     if (notes)
-        willus_dmem_free(43,(double **)&nfirstrow,funcname);
-    willus_dmem_free(35,(double **)&firstrow,funcname);
+        willus_pmem_free(43,(double **)&nfirstrow,funcname);
+    willus_pmem_free(35,(double **)&firstrow,funcname);
     }
 
 
@@ -2711,7 +2887,7 @@ k2printf("    i1=%d, i2=%d, mlp->nlines=%d\n",mlp->i1,mlp->i2,mlp->nlines);
     /*
     ** Allocate arrays for determining median values
     */
-    willus_dmem_alloc_warn(13,(void **)&c1,sizeof(double)*8*mlp->nlines,funcname,10);
+    willus_pmem_alloc_warn(13,(void **)&c1,sizeof(double)*8*mlp->nlines,funcname,10);
     c2=&c1[mlp->nlines];
     ch=&c2[mlp->nlines];
     lch=&ch[mlp->nlines];
@@ -2960,7 +3136,7 @@ k2printf("Mean c1, c2 = %g, %g; stddevs = %g, %g\n",mean1,mean2,stdev1,stdev2);
 k2printf("textheight = %d, line_spacing = %d\n",textheight,line_spacing);
 }
 */
-    willus_dmem_free(13,(double **)&c1,funcname);
+    willus_pmem_free(13,(double **)&c1,funcname);
     }
 
 
@@ -3002,7 +3178,7 @@ static void multiline_params_alloc(MULTILINE_PARAMS *mlp)
     {
     static char *funcname="multiline_params_alloc";
 
-    willus_dmem_alloc_warn(14,(void **)&mlp->just,sizeof(int)*3*mlp->maxlines,funcname,10);
+    willus_pmem_alloc_warn(14,(void **)&mlp->just,sizeof(int)*3*mlp->maxlines,funcname,10);
     mlp->indented=&mlp->just[mlp->maxlines];
     mlp->short_line=&mlp->indented[mlp->maxlines];
     }
@@ -3013,7 +3189,7 @@ static void multiline_params_free(MULTILINE_PARAMS *mlp)
     {
     static char *funcname="multiline_params_free";
 
-    willus_dmem_free(14,(double **)&mlp->just,funcname);
+    willus_pmem_free(14,(double **)&mlp->just,funcname);
     }
 
 
@@ -76,6 +76,10 @@ void k2pdfopt_settings_init(K2PDFOPT_SETTINGS *k2settings)
     k2settings->user_usegs=1;
 #endif
     k2settings->usegs=k2settings->user_usegs;
+    k2settings->render_threads=2;
+    k2settings->render_ahead=0;
+    k2settings->analysis_threads=2;
+    k2settings->mupdf_store_mb=256;
     k2settings->query_user=-1;
     k2settings->query_user_explicit=0;
     k2settings->jpeg_quality=-1;
@@ -481,6 +481,12 @@ static void k2settings_to_cmd(STRBUF *cmdline,K2PDFOPT_SETTINGS *dst,
     double_check(cmdline,nongui,"-cmax",&src->contrast_max,dst->contrast_max);
     double_check(cmdline,nongui,"-ch",&src->min_column_height_inches,dst->min_column_height_inches);
     double_check(cmdline,nongui,"-ds",&src->document_scale_factor,dst->document_scale_factor);
+#ifdef HAVE_MUPDF_LIB
+    integer_check(cmdline,nongui,"-nt",&src->render_threads,dst->render_threads);
+    integer_check(cmdline,nongui,"-ra",&src->render_ahead,dst->render_ahead);
+    integer_check(cmdline,nongui,"-store",&src->mupdf_store_mb,dst->mupdf_store_mb);
+#endif
+    integer_check(cmdline,nongui,"-nta",&src->analysis_threads,dst->analysis_threads);
     double_check(cmdline,nongui,"-idpi",&src->user_src_dpi,dst->user_src_dpi);
     integer_check(cmdline,NULL,"-odpi",&src->dst_dpi,dst->dst_dpi);
     cropbox_check(cmdline,nongui,"-m",&src->srccropmargins,&dst->srccropmargins);
@@ -204,8 +204,11 @@ static char *k2pdfopt_options=
 "                  Default is on.\n"
 "-de <size>        Defect size in points.  For scanned documents, marks\n"
 "                  or defects smaller than this size are ignored when bounding\n"
-"                  rectangular regions.  The period at the end of a sentence is\n"
-"                  typically over 1 point in size.  The default is 1.0.\n"
+"                  rectangular regions.  A mark's size is that of the whole\n"
+"                  connected shape it is part of on the source page, so part\n"
+"                  of a larger shape that extends past a region's edge is not\n"
+"                  ignored.  The period at the end of a sentence is typically\n"
+"                  over 1 point in size.  The default is 1.0.\n"
 "-dev <name>       Select device profile (sets width, height, dpi, and corner\n"
 "                  marking for selected devices).  Currently the selection is\n"
 "                  limited.  <name> just has to have enough characters to\n"
@@ -498,6 +501,19 @@ static char *k2pdfopt_options=
 "                  \"columns\" of text.   They will be interspersed with the\n"
 "                  text in the adjacent column of main text.\n"
 "                  Note that -nr... or -nl... will also set -cg to 0.05.\n"
+#ifdef HAVE_MUPDF_LIB
+"-nt <n>           Use <n> threads to render upcoming PDF source pages while\n"
+"                  the current page is being processed.  Only used with\n"
+"                  -ra <n> (n > 0).  The output is the same for any value.\n"
+"                  Use -nt 0 to render each page only when it is needed.\n"
+"                  Default is -nt 2.\n"
+#endif
+"-nta <n>          Use <n> extra threads to help look for column dividers on\n"
+"                  very large source pages (more than 16 million pixels,\n"
+"                  e.g. a letter-size page above about 400 dpi).  Normal-size\n"
+"                  pages are analyzed on one thread whatever the value.\n"
+"                  The output is the same for any value.  Use -nta 0 to do\n"
+"                  all of the page analysis on one thread.  Default is -nta 2.\n"
 "-o <namefmt>      Set the output file name using <namefmt>.  %s will be\n"
 "                  replaced with the base name of the source file, and %d\n"
 "                  will be replaced with the source file count (starting\n"
@@ -642,6 +658,12 @@ static char *k2pdfopt_options=
 "                  is no excluded pages (-px -1).\n"
 "-r[-]             Right-to-left [left-to-right] page scans.  Default is\n"
 "                  left to right.\n"
+#ifdef HAVE_MUPDF_LIB
+"-ra <n>           Render at most <n> PDF source pages ahead of the page being\n"
+"                  processed (see -nt).  Each render thread opens its own copy\n"
+"                  of the document, with its own cached page content, so this\n"
+"                  uses more memory.  Default is -ra 0 (off).\n"
+#endif
 #ifdef HAVE_K2GUI
 "-rls[+|-]         Restore [+] or don't restore [-] the last command-line\n"
 "                  settings from the environment variable K2PDFOPT_CUSTOM0.\n"
@@ -688,6 +710,13 @@ static char *k2pdfopt_options=
 "                  if -ocr is specified).\n"
 "-sp[-]            For each file on the command-line, just echo the number\n"
 "                  of pages--don't process.  Default = off (-sp-).\n"
+#ifdef HAVE_MUPDF_LIB
+"-store <MB>       Max memory used by MuPDF to keep decoded fonts, images and\n"
+"                  glyphs of the source PDF file between pages (shared by the\n"
+"                  -nt render threads).  Use -v to see how often pages are\n"
+"                  found already rendered/interpreted.  Values over 2048 are\n"
+"                  capped at 2048.  Default is -store 256.\n"
+#endif
 "-t[-]             Trim [don't trim] the white space from around the edges of\n"
 "                  any output region.  Default is to trim.  Using -t- is not\n"
 "                  recommended unless you want to exactly duplicate the source\n"
@@ -41,12 +41,38 @@ typedef struct
     int prev;
     } PBOX;
 
+/*
+** Index of a PBOX array for overlap queries:  boxes sorted by x1 (and by y1),
+** searched as implicit binary trees where xmax[] (ymax[]) holds the largest
+** x2 (y2) under each node.  A query returns every box whose closed x (or y)
+** extent overlaps the query interval.
+*/
+typedef struct
+    {
+    PBOX *box;
+    int n;
+    int *xorder;    /* Box indices sorted by x1 */
+    double *xmax;
+    int *yorder;    /* Box indices sorted by y1 */
+    double *ymax;
+    int *hit;       /* Query results */
+    int nhit;
+    int *trapped;   /* Scratch for trapped_box()--all zero between calls */
+    int *touched;   /* Entries of trapped[] to clear */
+    } PBOXINDEX;
+
 #if (WILLUSDEBUGX & 0x400000)
 static void pbox_echo(PBOX *box);
 #endif
 static int pbox_position_compare(PBOX *box1,PBOX *box2);
-static int trapped_box(int ibox,PBOX *box,int n,double comax);
-static int pbox_closest(PBOX *lastbox,PBOX *box,int n,int hoverlap,
+static void pboxindex_init(PBOXINDEX *index,PBOX *box,int n);
+static void pboxindex_free(PBOXINDEX *index);
+static double pboxindex_build(PBOXINDEX *index,int *order,double *max,int i1,int i2,int is_y);
+static void pboxindex_query(PBOXINDEX *index,double q1,double q2,int is_y);
+static void pboxindex_query_node(PBOXINDEX *index,int *order,double *max,int i1,int i2,
+                                 double q1,double q2,int is_y);
+static int trapped_box(int ibox,PBOXINDEX *index,double comax);
+static int pbox_closest(PBOX *lastbox,PBOXINDEX *index,int hoverlap,
                         double *alignbest,double *gapbest);
 static void pbox_determine_closeness(PBOX *box0,PBOX *box1,double *gap_inches,
                                      double *colalign,double *rowalign);
@@ -69,7 +95,7 @@ void pageregions_free(PAGEREGIONS *regions)
 
     for (i=regions->n-1;i>=0;i--)
         pageregion_free(&regions->pageregion[i]);
-    willus_mem_free((double **)&regions->pageregion,funcname);
+    willus_pmem_free(46,(double **)&regions->pageregion,funcname);
     }
 
 
@@ -127,8 +153,8 @@ void pageregions_insert(PAGEREGIONS *dst,int index,PAGEREGIONS *src)
         newsize = dst->na<16 ? 32 : dst->na*2;
         while (newsize < dst->n + src->n)
             newsize *= 2;
-        willus_mem_realloc_robust_warn((void **)&dst->pageregion,newsize*sizeof(PAGEREGION),
-                                     dst->na*sizeof(PAGEREGION),funcname,10);
+        willus_pmem_realloc_warn(46,(void **)&dst->pageregion,newsize*sizeof(PAGEREGION),
+                                 dst->na*sizeof(PAGEREGION),funcname,10);
         dst->na=newsize;
         }
     /* Must initialize the new array elements that will be used */
@@ -153,8 +179,8 @@ void pageregions_add_pageregion(PAGEREGIONS *regions,BMPREGION *bmpregion,int le
         int newsize;
 
         newsize = regions->na<16 ? 32 : regions->na*2;
-        willus_mem_realloc_robust_warn((void **)&regions->pageregion,newsize*sizeof(PAGEREGION),
-                                     regions->na*sizeof(PAGEREGION),funcname,10);
+        willus_pmem_realloc_warn(46,(void **)&regions->pageregion,newsize*sizeof(PAGEREGION),
+                                 regions->na*sizeof(PAGEREGION),funcname,10);
         regions->na=newsize;
         }
     pageregion_init(&regions->pageregion[regions->n]);
@@ -179,6 +205,7 @@ void pageregions_sort(PAGEREGIONS *pageregions,double src_dpi,int left_to_right,
     static char *funcname="pageregions_sort";
     int *sorted_index;
     PBOX *box;
+    PBOXINDEX _index,*index;
     double xmin,xmax,ymin,ymax;
     int i,isr,j,itry;
 
@@ -187,8 +214,8 @@ printf("@pageregions_sort, n=%d\n",pageregions->n);
 #endif
     if (pageregions->n<2)
         return;
-    willus_mem_alloc_warn((void **)&box,sizeof(PBOX)*pageregions->n,funcname,10);
-    willus_mem_alloc_warn((void **)&sorted_index,sizeof(int)*pageregions->n,funcname,10);
+    willus_pmem_alloc_warn(47,(void **)&box,sizeof(PBOX)*pageregions->n,funcname,10);
+    willus_pmem_alloc_warn(48,(void **)&sorted_index,sizeof(int)*pageregions->n,funcname,10);
     xmin=ymin=1.0e10;
     xmax=ymax=-1.0e10;
 
@@ -253,6 +280,8 @@ pbox_echo(&box[i]);
             box[i].x2 = xmin + (xmax - box[i].x2);
             double_swap(box[i].x1,box[i].x2);
             }
+    index=&_index;
+    pboxindex_init(index,box,pageregions->n);
 
     /* Sort PBOX array by position of boxes */
     /* Find first--upper left */
@@ -309,7 +338,7 @@ pbox_echo(&box[i]);
             ibestbelow = ibestright = -1;
             if (check_above_below[itry])
                 {
-                ibestbelow = pbox_closest(&box[i],box,pageregions->n,1,&halign,&vgap);
+                ibestbelow = pbox_closest(&box[i],index,1,&halign,&vgap);
                 if (ibestbelow>=0 && box[ibestbelow].ignore)
                     ibestbelow=-1;
                 /* Check for contiguous rows of text */
@@ -334,7 +363,7 @@ printf("    SPACING MATCH between %d and %d.\n",i,ibestbelow);
                 }
             else
                 {
-                ibestright = pbox_closest(&box[i],box,pageregions->n,0,&valign,&hgap);
+                ibestright = pbox_closest(&box[i],index,0,&valign,&hgap);
                 if (ibestright>=0 && box[ibestright].ignore)
                     ibestright=-1;
                 }
@@ -371,7 +400,7 @@ pbox_echo(&box[ibest]);
 #endif
                 box[i].next=ibest;
                 box[ibest].prev=i;
-                if (trapped_box(i,box,pageregions->n,comax_fraction))
+                if (trapped_box(i,index,comax_fraction))
                     {
                     box[i].next = -1;
                     box[ibest].prev = -1;
@@ -411,7 +440,7 @@ printf("Pre-det sorted_index[%d] = %d\n",i,sorted_index[i]);
                     t2=box[j].prev;
                     box[sorted_index[i-1]].next = j;
                     box[j].prev = sorted_index[i-1];
-                    if (k==1 || !trapped_box(sorted_index[i-1],box,pageregions->n,comax_fraction))
+                    if (k==1 || !trapped_box(sorted_index[i-1],index,comax_fraction))
                         jbest=j;
                     box[sorted_index[i-1]].next =t1;
                     box[j].prev = t2;
@@ -595,26 +624,28 @@ printf("    ibest_final = %d\n",ibest);
                 break;
                 }
         }
-    willus_mem_free((double **)&box,funcname);
-    willus_mem_free((double **)&sorted_index,funcname);
+    pboxindex_free(index);
+    willus_pmem_free(48,(double **)&sorted_index,funcname);
+    willus_pmem_free(47,(double **)&box,funcname);
     }
 
 
 /*
 ** Make sure there are no boxes mostly above box0
 */
-static int trapped_box(int ibox,PBOX *box,int n,double comax)
+static int trapped_box(int ibox,PBOXINDEX *index,double comax)
 
     {
-    int i,boxtrapped;
+    int i,j,n,nt,boxtrapped;
     int *trapped;
-    static char *funcname="trapped_box";
+    PBOX *box;
 
     if (comax > .2)
         comax = .2;
-    willus_mem_alloc_warn((void **)&trapped,sizeof(int)*n,funcname,10);
-    for (i=0;i<n;i++)
-        trapped[i]=0;
+    box=index->box;
+    n=index->n;
+    trapped=index->trapped;
+    nt=0;
     /* Find first box in sequence */
     for (i=0;i<n && box[ibox].prev >= 0 && box[ibox].prev <= n-1;i++)
         {
@@ -624,7 +655,10 @@ static int trapped_box(int ibox,PBOX *box,int n,double comax)
             break;
         }
     for (i=ibox;i>=0;i=box[i].next)
+        {
         trapped[i] = 255;
+        index->touched[nt++] = i;
+        }
     while (ibox>=0)
         {
         double ibx1,ibx2,iby1,iby2;
@@ -633,78 +667,77 @@ static int trapped_box(int ibox,PBOX *box,int n,double comax)
         ibx2 = box[ibox].x2 - (box[ibox].x2-box[ibox].x1)*comax;
         iby1 = box[ibox].y1 + (box[ibox].y2-box[ibox].y1)*comax;
         iby2 = box[ibox].y2 - (box[ibox].y2-box[ibox].y1)*comax;
-        for (i=0;i<n;i++)
+        /* Boxes above or below:  only those overlapping ibx1 - ibx2 */
+        pboxindex_query(index,ibx1,ibx2,0);
+        for (j=0;j<index->nhit;j++)
             {
+            i=index->hit[j];
             if (trapped[i]==255)
                 continue;
             if (box[i].prev >= 0)
                 continue;
-            if (box[i].y2 > box[ibox].y1)
-                continue;
-            if (box[i].x2 < ibx1 || box[i].x1 > ibx2)
-                continue;
-            trapped[i] |= 1; /* This box is above one of the boxes */
+            if (box[i].y2 <= box[ibox].y1)
+                {
+                if (trapped[i]==0)
+                    index->touched[nt++] = i;
+                trapped[i] |= 1; /* This box is above one of the boxes */
 #if (WILLUSDEBUGX & 0x400000)
 printf("box %d (i) is above box %d (ibox)\n",i,ibox);
 #endif
-            }
-        for (i=0;i<n;i++)
-            {
-            if (trapped[i]==255)
-                continue;
-            if (box[i].prev >= 0)
-                continue;
-            if (box[i].y1 < box[ibox].y2)
-                continue;
-            if (box[i].x2 < ibx1 || box[i].x1 > ibx2)
-                continue;
-            trapped[i] |= 8; /* This box is below one of the boxes */
+                }
+            if (box[i].y1 >= box[ibox].y2)
+                {
+                if (trapped[i]==0)
+                    index->touched[nt++] = i;
+                trapped[i] |= 8; /* This box is below one of the boxes */
 #if (WILLUSDEBUGX & 0x400000)
 printf("box %d (i) is below box %d (ibox)\n",i,ibox);
 #endif
+                }
             }
-        for (i=0;i<n;i++)
+        /* Boxes left or right:  only those overlapping iby1 - iby2 */
+        pboxindex_query(index,iby1,iby2,1);
+        for (j=0;j<index->nhit;j++)
             {
+            i=index->hit[j];
             if (trapped[i]==255)
                 continue;
             if (box[i].prev >= 0)
                 continue;
-            if (box[i].x2 > box[ibox].x1)
-                continue;
-            if (box[i].y1 > iby2 || box[i].y2 < iby1)
-                continue;
-            trapped[i] |= 2; /* This box is to the left of a box */
+            if (box[i].x2 <= box[ibox].x1)
+                {
+                if (trapped[i]==0)
+                    index->touched[nt++] = i;
+                trapped[i] |= 2; /* This box is to the left of a box */
 #if (WILLUSDEBUGX & 0x400000)
 printf("box %d (i) is left of box %d (ibox)\n",i,ibox);
 #endif
-            }
-        for (i=0;i<n;i++)
-            {
-            if (trapped[i]==255)
-                continue;
-            if (box[i].prev >= 0)
-                continue;
-            if (box[i].x1 < box[ibox].x2)
-                continue;
-            if (box[i].y1 > iby2 || box[i].y2 <iby1)
-                continue;
-            trapped[i] |= 4; /* This box is to the right of a box */
+                }
+            if (box[i].x1 >= box[ibox].x2)
+                {
+                if (trapped[i]==0)
+                    index->touched[nt++] = i;
+                trapped[i] |= 4; /* This box is to the right of a box */
 #if (WILLUSDEBUGX & 0x400000)
 printf("box %d (i) is right of box %d (ibox)\n",i,ibox);
 #endif
+                }
             }
         ibox=box[ibox].next;
         }
-    for (boxtrapped=0,i=0;i<n;i++)
-        if (trapped[i]!=255 && ((trapped[i]&3)==3 || (trapped[i]&5)==5 || (trapped[i]&10)==10))
+    for (boxtrapped=0,j=0;j<nt;j++)
+        {
+        i=index->touched[j];
+        if (!boxtrapped && trapped[i]!=255
+                 && ((trapped[i]&3)==3 || (trapped[i]&5)==5 || (trapped[i]&10)==10))
             {
             boxtrapped=1;
 #if (WILLUSDEBUGX & 0x400000)
             printf("BOX %d is TRAPPED (trapped=%d).\n",i,trapped[i]);
 #endif
-            break;
             }
-    willus_mem_free((double **)&trapped,funcname);
+        trapped[i]=0;
+        }
     return(boxtrapped);
     }
 
@@ -724,12 +757,13 @@ printf("box %d (i) is right of box %d (ibox)\n",i,ibox);
 **     gapbest = gap between regions (inches)
 **
 */
-static int pbox_closest(PBOX *lastbox,PBOX *box,int n,int hoverlap,
+static int pbox_closest(PBOX *lastbox,PBOXINDEX *index,int hoverlap,
                         double *alignbest,double *gapbest)
 
     {
-    int i,ibest;
+    int i,j,ibest;
     double epsilon;
+    PBOX *box;
 
 /*
 printf("@pbox_closest box(ho=%d)=",hoverlap);
@@ -738,12 +772,21 @@ pbox_echo(lastbox);
     epsilon = 0.1; /* Gap change (in inches) that is irrelevant */
     (*alignbest) = -1.0;
     (*gapbest) = 99.;
+    /*
+    ** Only boxes overlapping lastbox in x (hoverlap) or y can qualify.
+    ** Check them in array order so that ties go the same way as a full scan.
+    */
+    box=index->box;
+    pboxindex_query(index,hoverlap ? lastbox->x1 : lastbox->y1,
+                          hoverlap ? lastbox->x2 : lastbox->y2,!hoverlap);
+    sorti(index->hit,index->nhit);
     /* Look for best next/previous region */
-    for (ibest=-1,i=0;i<n;i++)
+    for (ibest=-1,j=0;j<index->nhit;j++)
         {
         PBOX *box1,*box2;
         double calign,ralign,gap_inches;
 
+        i=index->hit[j];
         if (box[i].prev >= 0)
             continue;
         /* Select boxes to be compared */
@@ -793,6 +836,118 @@ printf("        ibest=%d\n",ibest);
     }
 
 
+static void pboxindex_init(PBOXINDEX *index,PBOX *box,int n)
+
+    {
+    double *key,*ikey;
+    int i,k;
+    static char *funcname="pboxindex_init";
+
+    index->box=box;
+    index->n=n;
+    willus_pmem_alloc_warn(49,(void **)&index->xorder,sizeof(int)*n*6,funcname,10);
+    index->yorder=&index->xorder[n];
+    index->hit=&index->yorder[n];
+    index->trapped=&index->hit[n];
+    index->touched=&index->trapped[n];
+    willus_pmem_alloc_warn(50,(void **)&index->xmax,sizeof(double)*n*4,funcname,10);
+    index->ymax=&index->xmax[n];
+    key=&index->ymax[n];
+    ikey=&key[n];
+    for (k=0;k<2;k++)
+        {
+        int *order;
+
+        order = k ? index->yorder : index->xorder;
+        for (i=0;i<n;i++)
+            {
+            key[i] = k ? box[i].y1 : box[i].x1;
+            ikey[i] = i;
+            }
+        sortxyd(key,ikey,n);
+        for (i=0;i<n;i++)
+            order[i]=(int)ikey[i];
+        pboxindex_build(index,order,k ? index->ymax : index->xmax,0,n-1,k);
+        }
+    for (i=0;i<n;i++)
+        index->trapped[i]=0;
+    index->nhit=0;
+    }
+
+
+static void pboxindex_free(PBOXINDEX *index)
+
+    {
+    static char *funcname="pboxindex_free";
+
+    willus_pmem_free(50,(double **)&index->xmax,funcname);
+    willus_pmem_free(49,(double **)&index->xorder,funcname);
+    }
+
+
+/*
+** Node of order[i1..i2] is at its midpoint.  Sets max[] of the node and
+** returns it.
+*/
+static double pboxindex_build(PBOXINDEX *index,int *order,double *max,int i1,int i2,int is_y)
+
+    {
+    int im;
+    double m,m2;
+
+    if (i1>i2)
+        return(-1.0e10);
+    im=(i1+i2)/2;
+    m = is_y ? index->box[order[im]].y2 : index->box[order[im]].x2;
+    m2 = pboxindex_build(index,order,max,i1,im-1,is_y);
+    if (m2 > m)
+        m = m2;
+    m2 = pboxindex_build(index,order,max,im+1,i2,is_y);
+    if (m2 > m)
+        m = m2;
+    max[im] = m;
+    return(m);
+    }
+
+
+/*
+** index->hit[] = boxes with x1 <= q2 and x2 >= q1 (or y1, y2 if is_y).
+*/
+static void pboxindex_query(PBOXINDEX *index,double q1,double q2,int is_y)
+
+    {
+    index->nhit=0;
+    if (is_y)
+        pboxindex_query_node(index,index->yorder,index->ymax,0,index->n-1,q1,q2,1);
+    else
+        pboxindex_query_node(index,index->xorder,index->xmax,0,index->n-1,q1,q2,0);
+    }
+
+
+static void pboxindex_query_node(PBOXINDEX *index,int *order,double *max,int i1,int i2,
+                                 double q1,double q2,int is_y)
+
+    {
+    int im;
+    PBOX *b;
+
+    if (i1>i2)
+        return;
+    im=(i1+i2)/2;
+    /* Nothing under this node reaches q1 */
+    if (max[im] < q1)
+        return;
+    pboxindex_query_node(index,order,max,i1,im-1,q1,q2,is_y);
+    b=&index->box[order[im]];
+    /* This box and all to its right start past q2 */
+    if ((is_y ? b->y1 : b->x1) > q2)
+        return;
+    if ((is_y ? b->y2 : b->x2) >= q1)
+        index->hit[index->nhit++]=order[im];
+    pboxindex_query_node(index,order,max,im+1,i2,q1,q2,is_y);
+    }
+
+
 #if (WILLUSDEBUGX & 0x400000)
 static void pbox_echo(PBOX *box)
 
@@ -42,7 +42,7 @@ void textrows_free(TEXTROWS *textrows)
     {
     static char *funcname="textrows_free";
 
-    willus_mem_free((double **)&textrows->textrow,funcname);
+    willus_pmem_free(45,(double **)&textrows->textrow,funcname);
     textrows->n=textrows->na=0;
     }
 
@@ -80,9 +80,9 @@ void textrows_insert(TEXTROWS *dst,int index,TEXTROWS *src)
         newsize = dst->na<128 ? 256 : dst->na*2;
         while (newsize < dst->n + src->n)
             newsize *= 2;
-        willus_mem_realloc_robust_warn((void **)&dst->textrow,
-                                     newsize*sizeof(TEXTROW),
-                                     dst->na*sizeof(TEXTROW),funcname,10);
+        willus_pmem_realloc_warn(45,(void **)&dst->textrow,
+                                 newsize*sizeof(TEXTROW),
+                                 dst->na*sizeof(TEXTROW),funcname,10);
         dst->na=newsize;
         }
     for (i=dst->n+src->n-1;i-src->n>=index;i--)
@@ -110,8 +110,8 @@ printf("    textrows->textrow=%p\n",textrows->textrow);
         int newsize;
 
         newsize = textrows->na<128 ? 256 : textrows->na*2;
-        willus_mem_realloc_robust_warn((void **)&textrows->textrow,newsize*sizeof(TEXTROW),
-                                     textrows->na*sizeof(TEXTROW),funcname,10);
+        willus_pmem_realloc_warn(45,(void **)&textrows->textrow,newsize*sizeof(TEXTROW),
+                                 textrows->na*sizeof(TEXTROW),funcname,10);
         textrows->na=newsize;
         }
     textrows->textrow[textrows->n]=(*textrow);
@@ -256,7 +256,7 @@ k2printf("    nrows=%d\n",textrows->n);
     c1=region->c1;
     c2=region->c2;
     nc=c2-c1+1;
-    willus_dmem_alloc_warn(16,(void **)&rh,2*sizeof(int)*textrows->n,funcname,10);
+    willus_pmem_alloc_warn(16,(void **)&rh,2*sizeof(int)*textrows->n,funcname,10);
     gap=&rh[textrows->n];
     for (i=nr=ng=0;i<textrows->n;i++)
         {
@@ -269,7 +269,7 @@ k2printf("    nrows=%d\n",textrows->n);
         }
     if (nr<2)
         {
-        willus_dmem_free(16,(double **)&rh,funcname);
+        willus_pmem_free(16,(double **)&rh,funcname);
         return;
         }
     sorti(rh,nr);
@@ -287,7 +287,7 @@ k2printf("    nrows=%d\n",textrows->n);
 k2printf("mh = %d x %g = %d\n",rh[textrows->n/2],fracrh,mh);
 k2printf("mg = %d x %g = %d\n",gap[textrows->n/2],fracgap,mg);
 #endif
-    willus_dmem_free(16,(double **)&rh,funcname);
+    willus_pmem_free(16,(double **)&rh,funcname);
     for (i=0;i<textrows->n;i++)
         {
         TEXTROW *textrow;
@@ -614,7 +614,7 @@ printf("TRYING PARTIAL ANALYSIS OF TEXTROW %d\n",i);
                pregion->r2=textrows->textrow[i].r2;
               
                /* Fill in colcount and rowcount */
-               bmpregion_calc_bbox(pregion,k2settings,0);
+               bmpregion_calc_bbox_ex(pregion,k2settings,0,1);
                /*
                ** Find left-edge minimum in column count--looking for where
                ** the large letter would end.
@@ -632,10 +632,10 @@ printf("    c1=%d, c1new=%d, trh=%d\n",pregion->c1,c1new,trh);
                */
                pregion->c1 += trh*2;
 
-               /* Re-count rows and columns with new first column */
-               bmpregion_calc_bbox(pregion,k2settings,0);
+               /* Re-count rows with new first column (from the counts above) */
+               bmpregion_fill_rowcount(pregion,pregion->c1,pregion->c2);
                nrt=pregion->r2-pregion->r1+1;
-               willus_dmem_alloc_warn(37,(void **)&prowthresh,sizeof(int)*nrt,funcname,10);
+               willus_pmem_alloc_warn(37,(void **)&prowthresh,sizeof(int)*nrt,funcname,10);
                bmpregion_fill_row_threshold_array(pregion,k2settings,dynamic_aperture,
                                                   prowthresh,&rhmean_pixels);
                /*
@@ -819,7 +819,7 @@ printf("    2. row[%d]: (%d,%d) - (%d,%d)\n",ii,textrow->c1,textrow->r1,textrow-
                    }
                }
            if (partial)
-               willus_dmem_free(37,(double **)&prowthresh,funcname);
+               willus_pmem_free(37,(double **)&prowthresh,funcname);
            }
         }
 #if (WILLUSDEBUGX & 256)
@@ -112,11 +112,11 @@ void textwords_add_word_gaps(TEXTWORDS *textwords,int lcheight,double *median_ga
             double *gap_sorted;  /* v2.02--this variable is no longer static */
 
             n = (nn>1024) ? 1024 : nn;
-            willus_dmem_alloc_warn(28,(void **)&gap_sorted,sizeof(double)*n,funcname,10);
+            willus_pmem_alloc_warn(28,(void **)&gap_sorted,sizeof(double)*n,funcname,10);
             memcpy(gap_sorted,gap,n*sizeof(double));
             sortd(gap_sorted,n);
             (*median_gap)=gap_sorted[n/2];
-            willus_dmem_free(28,&gap_sorted,funcname);
+            willus_pmem_free(28,&gap_sorted,funcname);
             }
         else
             (*median_gap)=0.7;
@@ -0,0 +1,135 @@
+/*
+** bmp_resample_test.c   Checks that bmp_resample() stays inside the source
+**                       bitmap when the crop box ends on its right or
+**                       bottom edge and starts at a fractional position.
+**
+** The source pixels are put at the very end of a buffer that is followed
+** by an inaccessible page (where mmap() is available), so any read past
+** the last row or column faults.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <willus.h>
+
+#if (defined(__unix__) || defined(__APPLE__))
+#include <unistd.h>
+#include <sys/mman.h>
+#define GUARD_PAGE
+#endif
+
+static unsigned char *guarded_alloc(int size,void **base,size_t *basesize);
+static void guarded_free(void *base,size_t basesize);
+static int check_resample(int bpp,int width,int height,double x1,double y1,int newwidth,
+                          int newheight);
+
+
+int main(void)
+
+    {
+    static int dims[][2] = { {37,29}, {64,48}, {101,7}, {5,113} };
+    static double starts[] = { 0.1, 0.25, 0.3, 0.7, 1.1, 2.9 };
+    int i,j,n,nfail,ntests;
+
+    nfail=ntests=0;
+    for (i=0;i<sizeof(dims)/sizeof(dims[0]);i++)
+        for (j=0;j<sizeof(starts)/sizeof(starts[0]);j++)
+            for (n=1;n<=67;n+=3)
+                {
+                int bpp;
+                for (bpp=8;bpp<=24;bpp+=16)
+                    {
+                    ntests++;
+                    if (!check_resample(bpp,dims[i][0],dims[i][1],starts[j],starts[j]/2.,
+                                        n,(n*7)%53+1))
+                        nfail++;
+                    }
+                }
+    printf("bmp_resample_test:  %d of %d cases failed.\n",nfail,ntests);
+    return(nfail>0 ? 1 : 0);
+    }
+
+
+/*
+** Resample the box (x1,y1)-(width,height) of a uniform bitmap and make sure
+** every output pixel keeps the uniform value.
+*/
+static int check_resample(int bpp,int width,int height,double x1,double y1,int newwidth,
+                          int newheight)
+
+    {
+    WILLUSBITMAP _src,*src,_dst,*dst;
+    void *base;
+    size_t basesize;
+    int i,nbytes,status,ok;
+
+    src=&_src;
+    dst=&_dst;
+    bmp_init(src);
+    bmp_init(dst);
+    src->width=width;
+    src->height=height;
+    src->bpp=bpp;
+    for (i=0;i<256;i++)
+        src->red[i]=src->green[i]=src->blue[i]=i;
+    nbytes=bmp_bytewidth(src)*height;
+    src->data=guarded_alloc(nbytes,&base,&basesize);
+    src->size_allocated=nbytes;
+    memset(src->data,100,nbytes);
+    status=bmp_resample(dst,src,x1,y1,(double)width,(double)height,newwidth,newheight);
+    ok = (status==0);
+    if (ok)
+        {
+        nbytes=bmp_bytewidth(dst)*dst->height;
+        for (i=0;i<nbytes;i++)
+            if (dst->data[i]!=100)
+                {
+                ok=0;
+                break;
+                }
+        }
+    if (!ok)
+        printf("FAIL:  %d-bit %dx%d, box (%g,%g)-(%d,%d) -> %dx%d (status=%d)\n",
+               bpp,width,height,x1,y1,width,height,newwidth,newheight,status);
+    bmp_free(dst);
+    guarded_free(base,basesize);
+    return(ok);
+    }
+
+
+static unsigned char *guarded_alloc(int size,void **base,size_t *basesize)
+
+    {
+#ifdef GUARD_PAGE
+    size_t page,npages;
+    unsigned char *p;
+
+    page=(size_t)sysconf(_SC_PAGESIZE);
+    npages=(size+page-1)/page;
+    (*basesize)=(npages+1)*page;
+    p=mmap(NULL,(*basesize),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (p==MAP_FAILED)
+        {
+        printf("bmp_resample_test:  mmap() failed.\n");
+        exit(2);
+        }
+    mprotect(p+npages*page,page,PROT_NONE);
+    (*base)=p;
+    return(p+npages*page-size);
+#else
+    (*basesize)=size;
+    (*base)=malloc(size);
+    return((unsigned char *)(*base));
+#endif
+    }
+
+
+static void guarded_free(void *base,size_t basesize)
+
+    {
+#ifdef GUARD_PAGE
+    munmap(base,basesize);
+#else
+    free(base);
+#endif
+    }
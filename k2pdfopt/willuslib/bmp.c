@@ -99,6 +99,26 @@
         ptr+=3; \
         }
 
+/*
+** Resampling weights along one axis:  destination pixel i is the sum of
+** w[offset[i]+k] times source pixel start[i]+k for k=0..ntaps[i]-1.
+*/
+#define RESAMPLE_WBITS  14  /* Fractional bits of the weights */
+#define RESAMPLE_HBITS   6  /* Fractional bits kept after the horizontal pass */
+typedef struct
+    {
+    int *start;
+    int *ntaps;
+    int *offset;
+    int *w;
+    int n;
+    int maxtaps;
+    } RESAMPLECOEFFS;
+
+/* Fractional bits of the bmp_rotate_fast_ex() interpolation weights */
+#define ROTATE_WBITS  10
+#define ROTATE_WMASK  ((1<<ROTATE_WBITS)-1)
+
 static double willusbmp_dpi=150.;
 static int    willusbmp_pageno=-1;
 
@@ -120,16 +140,11 @@ static int  bmp24_write(WILLUSBITMAP *bmap,char *filename,FILE *out);
 static void insert_int32lsbmsb(char *a,int x);
 static int  retrieve_int32lsbmsb(char *a);
 static void get_file_ext(char *fileext,char *filename);
-static void bmp_resample_1(double *tempbmp,WILLUSBITMAP *src,double x1,double y1,
-                           double x2,double y2,int newwidth,int newheight,
-                           double *temprow,int color);
-static void resample_1d(double *dst,double *src,double x1,double x2,int n);
-static double resample_single(double *y,double x1,double x2);
-static void bmp_resample_1_fixed_point(int *tempbmp,WILLUSBITMAP *src,int x1_fp,int y1_fp,
-                                       int x2_fp,int y2_fp,int newwidth,int newheight,
-                                       int *temprow,int color);
-static void resample_1d_fixed_point(int *dst,int *src,int x1_fp,int x2_fp,int n);
-static double resample_single_fixed_point(int *y,int x1_fp,int x2_fp);
+static int  resample_coeffs(RESAMPLECOEFFS *rc,double x1,double x2,int n,int size,
+                            char *funcname);
+static void resample_coeffs_free(RESAMPLECOEFFS *rc,char *funcname);
+static void resample_row_horizontal(int *dst,unsigned char *src,int channels,
+                                    RESAMPLECOEFFS *rc);
 #ifdef HAVE_PNG_LIB
 static void bmp_read_png_from_memory(png_structp png_ptr,void *buf,int nbytes);
 #endif
@@ -146,6 +161,15 @@ static void bmp_apply_filter_gray(WILLUSBITMAP *dest,WILLUSBITMAP *src,
                                   double **filter,int ncols,int nrows);
 static double bmp_row_by_row_stdev(WILLUSBITMAP *bmp,int ccount,int whitethresh,
                                    double theta_radians);
+static void bmp_inkmask_4x(WILLUSBITMAP *mask,WILLUSBITMAP *grey,int whitethresh);
+static double bmp_inkmask_row_stdev(WILLUSBITMAP *mask,double theta_radians);
+static double bmp_row_stdev_peak(WILLUSBITMAP *grey,int whitethresh,double deg1,double deg2,
+                                 double tolerance,double *sdpeak);
+static double bmp_row_stdev_cached(WILLUSBITMAP *grey,int whitethresh,double *sd,int i,
+                                   int na,double stepsize);
+static int bmp_row_stdev_descend(WILLUSBITMAP *grey,int whitethresh,double *sd,int i,
+                                 int ilo,int ihi,int na,double stepsize);
+static void rotate_col_range(double a,double b,double lo,double hi,int *c1,int *c2);
 static int pixval_dither(int pv,int n,int maxsrc,int maxdst,int x0,int y0);
 static int dither_rec(int bits,int x0,int y0);
 
@@ -1357,83 +1381,260 @@ void bmp_crop_ex(WILLUSBITMAP *dst,WILLUSBITMAP *src,int x0,int y0_from_top,int
     }
 
 
+/*
+** Rotate bmp by degrees about its center using bilinear interpolation.
+** Uncovered areas are filled with the color of the lower-left pixel
+** (bmp_pix_vali(bmp,0,0)).  If expand is non-zero, the bitmap grows to hold all of
+** the rotated image.  The result is always WILLUSBITMAP_TYPE_NATIVE.
+*/
 void bmp_rotate_fast(WILLUSBITMAP *bmp,double degrees,int expand)
 
     {
     WILLUSBITMAP _dst,*dst;
-    double th,sth,cth;
-    int i,r,g,b,w,h,row,col;
 
     dst=&_dst;
+    bmp_init(dst);
+    bmp_rotate_fast_ex(dst,bmp,degrees,expand);
+    /* Hand the new pixels to bmp instead of copying them */
+    bmp_swap(bmp,dst);
+    bmp_free(dst);
+    }
+
+
+/*
+** Same as bmp_rotate_fast(), but the rotated image goes into dst (which
+** must not be src).  dst's buffer is re-used if it is big enough, so a
+** caller rotating several bitmaps can keep one dst for all of them.
+**
+** Source positions are stepped across each destination row in fixed
+** point, and wherever the whole 2x2 neighborhood is inside src the pixel
+** is interpolated straight from the row pointers.  The thin band along
+** the src border goes through bmp_grey_pix_vald() / bmp_pix_vald(), which
+** handle the edge clamping.
+*/
+void bmp_rotate_fast_ex(WILLUSBITMAP *dst,WILLUSBITMAP *src,double degrees,int expand)
+
+    {
+    double th,sth,cth;
+    int i,r,g,b,w,h,row,bpp,fb,maxdim,c0,c2,identity;
+    int greylut[256];
+    unsigned char **srow;
+    static char *funcname="bmp_rotate_fast_ex";
+
     th=degrees*PI/180.;
     sth=sin(th);
     cth=cos(th);
     if (expand)
         {
-        w=(int)(fabs(bmp->width*cth)+fabs(bmp->height*sth)+.5);
-        h=(int)(fabs(bmp->height*cth)+fabs(bmp->width*sth)+.5);
+        w=(int)(fabs(src->width*cth)+fabs(src->height*sth)+.5);
+        h=(int)(fabs(src->height*cth)+fabs(src->width*sth)+.5);
         }
     else
         {
-        w=bmp->width;
-        h=bmp->height;
+        w=src->width;
+        h=src->height;
         }
-    dst=&_dst;
-    bmp_init(dst);
     dst->width=w;
     dst->height=h;
-    dst->bpp=bmp->bpp;
+    dst->bpp=src->bpp;
+    dst->type=WILLUSBITMAP_TYPE_NATIVE;
     if (dst->bpp==8)
         for (i=0;i<=255;i++)
             dst->red[i] = dst->green[i] = dst->blue[i]=i;
     bmp_alloc(dst);
-    bmp_pix_vali(bmp,0,0,&r,&g,&b);
+    bmp_pix_vali(src,0,0,&r,&g,&b);
     bmp_fill(dst,r,g,b);
-    if (dst->bpp==8)
-        for (row=0;row<dst->height;row++)
+    if (src->width<2 || src->height<2)
+        return;
+    bpp=src->bpp>>3;
+    /* 8-bit pixels are interpolated as grey levels */
+    for (identity=1,i=0;i<256;i++)
+        {
+        greylut[i]=bmp8_greylevel_convert(src->red[i],src->green[i],src->blue[i]);
+        if (greylut[i]!=i)
+            identity=0;
+        }
+    /* Win32 24-bit pixels are BGR */
+    c0 = (bpp==3 && src->type==WILLUSBITMAP_TYPE_WIN32) ? 2 : 0;
+    c2 = 2-c0;
+    /* Fractional bits for the stepped coordinates, leaving room for the integer part */
+    maxdim = src->width > src->height ? src->width : src->height;
+    for (fb=16;fb>ROTATE_WBITS && ((maxdim+2)>>(30-fb))!=0;fb--);
+    willus_mem_alloc_warn((void **)&srow,sizeof(unsigned char *)*src->height,funcname,10);
+    for (i=0;i<src->height;i++)
+        srow[i]=bmp_rowptr_from_top(src,i);
+    for (row=0;row<h;row++)
+        {
+        int col,cv1,cv2,ci1,ci2,u,v,du,dv;
+        double x0,y0,y2;
+        unsigned char *p;
+
+        /*
+        ** Source position of dest column col (same mapping as bmp_grey_pix_vald(),
+        ** with y from the bottom):
+        **     x1 = x0 + col*cth,  y1 = y0 - col*sth
+        */
+        y2=h/2.-row;
+        x0 = -.5 + src->width/2. - (w/2.)*cth + y2*sth;
+        y0 = -.5 + src->height/2. + y2*cth + (w/2.)*sth;
+        /* Columns that land anywhere on src (one extra either side for round-off) */
+        cv1=0;
+        cv2=w-1;
+        rotate_col_range(x0,cth,0.,(double)src->width,&cv1,&cv2);
+        rotate_col_range(y0,-sth,0.,(double)src->height,&cv1,&cv2);
+        if (cv1>cv2)
+            continue;
+        cv1 = cv1>0 ? cv1-1 : 0;
+        cv2 = cv2<w-1 ? cv2+1 : w-1;
+        /* Columns whose 2x2 neighborhood is safely inside src */
+        ci1=cv1;
+        ci2=cv2;
+        rotate_col_range(x0,cth,1.5,src->width-1.5,&ci1,&ci2);
+        rotate_col_range(y0,-sth,1.5,src->height-1.5,&ci1,&ci2);
+        p=bmp_rowptr_from_top(dst,row);
+        for (col=cv1;col<=cv2;col++)
             {
-            unsigned char *p;
-            double x1,y1,x2,y2;
+            double x1,y1;
 
-            y2=dst->height/2.-row;
-            p=bmp_rowptr_from_top(dst,row);  
-            for (x2=-dst->width/2.,col=0;col<dst->width;col++,p++,x2+=1.0)
+            if (col==ci1 && ci1<=ci2)
                 {
-                double g;
-                x1 = -.5 + bmp->width/2. + x2*cth + y2*sth;
-                y1 = -.5 + bmp->height/2. + y2*cth - x2*sth;
-                if (x1<0. || x1>=bmp->width || y1<0. || y1>=bmp->height)
-                    continue;
-                g=bmp_grey_pix_vald(bmp,x1,y1);
-                if (g>=0.)
-                    p[0]=g;
+                col=ci2;
+                continue;
                 }
-            }
-    else
-        for (row=0;row<dst->height;row++)
-            {
-            unsigned char *p;
-            double x1,y1,x2,y2;
-
-            y2=dst->height/2.-row;
-            p=bmp_rowptr_from_top(dst,row);  
-            for (x2=-dst->width/2.,col=0;col<dst->width;col++,p+=3,x2+=1.0)
+            x1 = x0 + col*cth;
+            y1 = y0 - col*sth;
+            if (x1<0. || x1>=src->width || y1<0. || y1>=src->height)
+                continue;
+            if (bpp==1)
+                {
+                double gg;
+                gg=bmp_grey_pix_vald(src,x1,y1);
+                if (gg>=0.)
+                    p[col]=gg;
+                }
+            else
                 {
                 double rr,gg,bb;
-                x1 = -.5 + bmp->width/2. + x2*cth + y2*sth;
-                y1 = -.5 + bmp->height/2. + y2*cth - x2*sth;
-                if (x1<0. || x1>=bmp->width || y1<0. || y1>=bmp->height)
-                    continue;
-                bmp_pix_vald(bmp,x1,y1,&rr,&gg,&bb);
+                bmp_pix_vald(src,x1,y1,&rr,&gg,&bb);
                 if (rr<0.)
                     continue;
-                p[0]=rr;
-                p[1]=gg;
-                p[2]=bb;
+                p[col*3]=rr;
+                p[col*3+1]=gg;
+                p[col*3+2]=bb;
                 }
             }
-    bmp_copy(bmp,dst);
-    bmp_free(dst);
+        if (ci1>ci2)
+            continue;
+        /* Interior:  sample point is (u,v) in src pixel units, v from the top */
+        u=(int)floor((x0+ci1*cth-.5)*(1<<fb)+.5);
+        v=(int)floor((src->height-.5-(y0-ci1*sth))*(1<<fb)+.5);
+        du=(int)floor(cth*(1<<fb)+.5);
+        dv=(int)floor(sth*(1<<fb)+.5);
+        p+=ci1*bpp;
+        if (bpp==1)
+            {
+            for (col=ci1;col<=ci2;col++,p++,u+=du,v+=dv)
+                {
+                int iu,iv,wu,wv,top,bot;
+                unsigned char *p0,*p1;
+
+                iu=u>>fb;
+                iv=v>>fb;
+                wu=(u>>(fb-ROTATE_WBITS))&ROTATE_WMASK;
+                wv=(v>>(fb-ROTATE_WBITS))&ROTATE_WMASK;
+                p0=&srow[iv][iu];
+                p1=&srow[iv+1][iu];
+                if (identity)
+                    {
+                    top=(p0[0]<<ROTATE_WBITS)+(p0[1]-p0[0])*wu;
+                    bot=(p1[0]<<ROTATE_WBITS)+(p1[1]-p1[0])*wu;
+                    }
+                else
+                    {
+                    top=(greylut[p0[0]]<<ROTATE_WBITS)+(greylut[p0[1]]-greylut[p0[0]])*wu;
+                    bot=(greylut[p1[0]]<<ROTATE_WBITS)+(greylut[p1[1]]-greylut[p1[0]])*wu;
+                    }
+                p[0]=((top<<ROTATE_WBITS)+(bot-top)*wv)>>(2*ROTATE_WBITS);
+                }
+            }
+        else
+            {
+            for (col=ci1;col<=ci2;col++,p+=3,u+=du,v+=dv)
+                {
+                int iu,iv,wu,wv,c,rgb[3];
+                unsigned char *p0,*p1;
+
+                iu=u>>fb;
+                iv=v>>fb;
+                wu=(u>>(fb-ROTATE_WBITS))&ROTATE_WMASK;
+                wv=(v>>(fb-ROTATE_WBITS))&ROTATE_WMASK;
+                p0=&srow[iv][iu*3];
+                p1=&srow[iv+1][iu*3];
+                for (c=0;c<3;c++)
+                    {
+                    int top,bot;
+
+                    top=(p0[c]<<ROTATE_WBITS)+(p0[c+3]-p0[c])*wu;
+                    bot=(p1[c]<<ROTATE_WBITS)+(p1[c+3]-p1[c])*wu;
+                    rgb[c]=((top<<ROTATE_WBITS)+(bot-top)*wv)>>(2*ROTATE_WBITS);
+                    }
+                p[0]=rgb[c0];
+                p[1]=rgb[1];
+                p[2]=rgb[c2];
+                }
+            }
+        }
+    willus_mem_free((double **)&srow,funcname);
+    }
+
+
+/*
+** Narrow the column range [*c1,*c2] to the columns where a + b*col
+** falls in [lo,hi].
+*/
+static void rotate_col_range(double a,double b,double lo,double hi,int *c1,int *c2)
+
+    {
+    double t1,t2;
+
+    if (lo>hi)
+        {
+        (*c1)=(*c2)+1;
+        return;
+        }
+    if (fabs(b)<1e-12)
+        {
+        if (a<lo || a>hi)
+            (*c1)=(*c2)+1;
+        return;
+        }
+    t1=(lo-a)/b;
+    t2=(hi-a)/b;
+    if (t1>t2)
+        {
+        double t;
+        t=t1;
+        t1=t2;
+        t2=t;
+        }
+    if (t1 > (*c1))
+        (*c1) = t1 > (*c2)+1 ? (*c2)+1 : (int)ceil(t1);
+    if (t2 < (*c2))
+        (*c2) = t2 < (*c1)-1 ? (*c1)-1 : (int)floor(t2);
+    }
+
+
+/*
+** Exchange the contents (pixels, palette, and size) of two bitmaps.
+*/
+void bmp_swap(WILLUSBITMAP *bmp1,WILLUSBITMAP *bmp2)
+
+    {
+    WILLUSBITMAP t;
+
+    t=(*bmp1);
+    (*bmp1)=(*bmp2);
+    (*bmp2)=t;
     }
 
 
@@ -2577,6 +2778,12 @@ void bmp_draw_filled_rect(WILLUSBITMAP *bmp,int col1,int row1,int col2,int row2,
 ** The destination bitmap will be 8-bit grayscale if the source bitmap
 ** passes the bmp_is_grayscale() function.  Otherwise it will be 24-bit.
 **
+** Each destination pixel is the area-weighted average of the source pixels
+** it covers.  The weights are worked out once per destination row and
+** column (fixed point), then each source row is resampled horizontally
+** (all colour planes at once) into a small ring of rows that the
+** destination rows are summed from, so no full-size temporary is needed.
+**
 ** Returns 0 for okay.
 **         -1 for not enough memory.
 **         -2 for bad cropping area or destination bitmap size
@@ -2585,11 +2792,11 @@ int bmp_resample(WILLUSBITMAP *dest,WILLUSBITMAP *src,double x1,double y1,
                  double x2,double y2,int newwidth,int newheight)
 
     {
-    int gray,maxlen,colorplanes;
+    int gray,channels,convert,nw,nring,row,i;
     double t;
-    double *tempbmp;
-    double *temprow;
-    int color,hmax,row,col,dy;
+    RESAMPLECOEFFS _rx,*rx,_ry,*ry;
+    int *ring,*ringrow,*acc;
+    unsigned char *rgbrow;
     static char *funcname="bmp_resample";
 
     if (newwidth==0 || newheight==0)
@@ -2629,25 +2836,43 @@ int bmp_resample(WILLUSBITMAP *dest,WILLUSBITMAP *src,double x1,double y1,
         y2=y1;
         y1=t;
         }
-    dy=y2-y1;
-    dy += 2;
     if (x2-x1==0. || y2-y1==0.)
         return(-2);
 
-    /* Allocate temp storage */
-    maxlen = x2-x1 > dy+newheight ? (int)(x2-x1) : dy+newheight;
-    maxlen += 16;
-    hmax = newheight > dy ? newheight : dy;
-    if (!willus_mem_alloc(&temprow,maxlen*sizeof(double),funcname))
+    /* Weights and temp storage */
+    rx=&_rx;
+    ry=&_ry;
+    if (!resample_coeffs(rx,x1,x2,newwidth,src->width,funcname))
         return(-1);
-    if (!willus_mem_alloc(&tempbmp,hmax*newwidth*sizeof(double),funcname))
+    if (!resample_coeffs(ry,y1,y2,newheight,src->height,funcname))
         {
-        willus_mem_free(&temprow,funcname);
+        resample_coeffs_free(rx,funcname);
         return(-1);
         }
-    if ((gray=bmp_is_grayscale(src))!=0)
+    gray=bmp_is_grayscale(src);
+    channels = gray ? 1 : 3;
+    /* Palette and Win32 (BGR) rows are put in RGB order first */
+    convert = (!gray && (src->bpp==8 || src->type==WILLUSBITMAP_TYPE_WIN32));
+    nw=newwidth*channels;
+    nring=ry->maxtaps;
+    if (!willus_mem_alloc((double **)&ring,(long)sizeof(int)*(nring*(nw+1)+nw),funcname))
+        {
+        resample_coeffs_free(ry,funcname);
+        resample_coeffs_free(rx,funcname);
+        return(-1);
+        }
+    acc=&ring[nring*nw];
+    ringrow=&acc[nw];
+    rgbrow=NULL;
+    if (convert && !willus_mem_alloc((double **)&rgbrow,(long)3*src->width,funcname))
+        {
+        willus_mem_free((double **)&ring,funcname);
+        resample_coeffs_free(ry,funcname);
+        resample_coeffs_free(rx,funcname);
+        return(-1);
+        }
+    if (gray)
         {
-        int i;
         dest->bpp=8;
         for (i=0;i<256;i++)
             dest->red[i]=dest->blue[i]=dest->green[i]=i;
@@ -2659,400 +2884,217 @@ int bmp_resample(WILLUSBITMAP *dest,WILLUSBITMAP *src,double x1,double y1,
     dest->type=WILLUSBITMAP_TYPE_NATIVE;
     if (!bmp_alloc(dest))
         {
-        willus_mem_free(&tempbmp,funcname);
-        willus_mem_free(&temprow,funcname);
+        willus_mem_free((double **)&rgbrow,funcname);
+        willus_mem_free((double **)&ring,funcname);
+        resample_coeffs_free(ry,funcname);
+        resample_coeffs_free(rx,funcname);
         return(-1);
         }
-    colorplanes = gray ? 1 : 3;
-    for (color=0;color<colorplanes;color++)
-        {
-        bmp_resample_1(tempbmp,src,x1,y1,x2,y2,newwidth,newheight,
-                       temprow,gray ? -1 : color);
-        for (row=0;row<newheight;row++)
-            {
-            unsigned char *p;
-            double *s;
-            p=bmp_rowptr_from_top(dest,row)+color;
-            s=&tempbmp[row*newwidth];
-            if (colorplanes==1)
-                for (col=0;col<newwidth;p[0]=(int)(s[0]+.5),col++,s++,p++);
-            else
-                for (col=0;col<newwidth;p[0]=(int)(s[0]+.5),col++,s++,p+=colorplanes);
-            }
-        }
-    willus_mem_free(&tempbmp,funcname);
-    willus_mem_free(&temprow,funcname);
-    return(0);
-    }
-
-
-static void bmp_resample_1(double *tempbmp,WILLUSBITMAP *src,double x1,double y1,
-                           double x2,double y2,int newwidth,int newheight,
-                           double *temprow,int color)
-
-    {
-    int row,col,x0,dx,y0,dy;
-
-    x0=floor(x1);
-    dx=ceil(x2)-x0;
-    x1-=x0;
-    x2-=x0;
-    y0=floor(y1);
-    dy=ceil(y2)-y0;
-    y1-=y0;
-    y2-=y0;
-    if (src->type==WILLUSBITMAP_TYPE_WIN32 && color>=0)
-        color=2-color;
-    for (row=0;row<dy;row++)
+    for (i=0;i<nring;i++)
+        ringrow[i]=-1;
+    for (row=0;row<newheight;row++)
         {
+        int k,*wy;
         unsigned char *p;
-        p=bmp_rowptr_from_top(src,row+y0);
-        if (src->bpp==8)
+
+        memset(acc,0,sizeof(int)*nw);
+        wy=&ry->w[ry->offset[row]];
+        for (k=0;k<ry->ntaps[row];k++)
             {
-            switch (color)
+            int srow,slot,w,*h;
+
+            srow=ry->start[row]+k;
+            slot=srow%nring;
+            h=&ring[slot*nw];
+            if (ringrow[slot]!=srow)
                 {
-                case -1:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=p[0];
-                    break;
-                case 0:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=src->red[p[0]];
-                    break;
-                case 1:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=src->green[p[0]];
-                    break;
-                case 2:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=src->blue[p[0]];
-                    break;
+                p=bmp_rowptr_from_top(src,srow);
+                if (convert)
+                    {
+                    int c,c0,c2;
+                    unsigned char *d;
+
+                    /* Win32 planes are swapped, same as the older versions of this function */
+                    c0 = src->type==WILLUSBITMAP_TYPE_WIN32 ? 2 : 0;
+                    c2 = 2-c0;
+                    d=rgbrow;
+                    if (src->bpp==8)
+                        {
+                        int *r0,*r2;
+
+                        r0 = c0==0 ? src->red : src->blue;
+                        r2 = c0==0 ? src->blue : src->red;
+                        for (c=0;c<src->width;c++,p++,d+=3)
+                            {
+                            d[0]=r0[p[0]];
+                            d[1]=src->green[p[0]];
+                            d[2]=r2[p[0]];
+                            }
+                        }
+                    else
+                        for (c=0;c<src->width;c++,p+=3,d+=3)
+                            {
+                            d[0]=p[c0];
+                            d[1]=p[1];
+                            d[2]=p[c2];
+                            }
+                    p=rgbrow;
+                    }
+                resample_row_horizontal(h,p,channels,rx);
+                ringrow[slot]=srow;
                 }
+            w=wy[k];
+            for (i=0;i<nw;i++)
+                acc[i] += w*h[i];
             }
-        else
-            {
-            p+=color;
-            for (col=0,p+=3*x0;col<dx;temprow[col]=p[0],col++,p+=3);
-            }
-        resample_1d(&tempbmp[row*newwidth],temprow,x1,x2,newwidth);
-        }
-    for (col=0;col<newwidth;col++)
-        {
-        double *p,*s;
-        p=&tempbmp[col];
-        s=&temprow[dy];
-        for (row=0;row<dy;row++,p+=newwidth)
-            temprow[row]=p[0];
-        resample_1d(s,temprow,y1,y2,newheight);
-        p=&tempbmp[col];
-        for (row=0;row<newheight;row++,p+=newwidth,s++)
-            p[0]=s[0];
+        p=bmp_rowptr_from_top(dest,row);
+        for (i=0;i<nw;i++)
+            p[i]=(acc[i]+(1<<(RESAMPLE_WBITS+RESAMPLE_HBITS-1)))>>(RESAMPLE_WBITS+RESAMPLE_HBITS);
         }
+    willus_mem_free((double **)&rgbrow,funcname);
+    willus_mem_free((double **)&ring,funcname);
+    resample_coeffs_free(ry,funcname);
+    resample_coeffs_free(rx,funcname);
+    return(0);
     }
 
 
 /*
-** Resample src[] into dst[].
-** Examples:  resample_1d(dst,src,0.,5.,5) would simply copy the
-**            first five elements of src[] to dst[].
-**
-**            resample_1d(dst,src,0.,5.,10) would work as follows:
-**                dst[0] and dst[1] would get src[0].
-**                dst[2] and dst[3] would get src[1].
-**                and so on.
-**
+** Destination pixel i covers x1+(x2-x1)*i/n to x1+(x2-x1)*(i+1)/n.  Its
+** weights are the overlap of each source pixel with that span, rounded so
+** that they always add up to exactly 1<<RESAMPLE_WBITS.
 */
-static void resample_1d(double *dst,double *src,double x1,double x2,int n)
+static int resample_coeffs(RESAMPLECOEFFS *rc,double x1,double x2,int n,int size,
+                           char *funcname)
 
     {
-    int i;
-    double new,last;
+    int i,nt,maxw,jmax;
+    double a;
 
-    last=x1;
-    for (i=0;i<n;i++)
-        {
-        new=x1+(x2-x1)*(i+1)/n;
-        dst[i] = resample_single(src,last,new);
-        last=new;
+    maxw=(int)(x2-x1)+2*n+4;
+    if (!willus_mem_alloc((double **)&rc->start,(long)sizeof(int)*(3*n+maxw),funcname))
+        return(0);
+    rc->ntaps=&rc->start[n];
+    rc->offset=&rc->ntaps[n];
+    rc->w=&rc->offset[n];
+    rc->n=n;
+    rc->maxtaps=1;
+    /* Last source pixel the spans may touch */
+    jmax=(int)ceil(x2)-1;
+    if (jmax>size-1)
+        jmax=size-1;
+    a=x1;
+    for (nt=i=0;i<n;i++)
+        {
+        int j,j1,j2,q,qlast;
+        double b,span,cum;
+
+        /* Round-off can put b an ulp past x2, so the last span ends exactly there */
+        b = (i==n-1) ? x2 : x1+(x2-x1)*(i+1)/n;
+        if (b>x2)
+            b=x2;
+        j1=floor(a);
+        j2=(int)ceil(b)-1;
+        if (j2>jmax)
+            j2=jmax;
+        if (j1>jmax)
+            j1=jmax;
+        if (j2<j1)
+            j2=j1;
+        rc->start[i]=j1;
+        rc->offset[i]=nt;
+        rc->ntaps[i]=j2-j1+1;
+        if (j2==j1)
+            rc->w[nt++]=1<<RESAMPLE_WBITS;
+        else
+            {
+            span=b-a;
+            for (cum=0.,qlast=0,j=j1;j<=j2;j++)
+                {
+                double lo,hi;
+
+                lo = j<a ? a : j;
+                hi = j+1>b ? b : j+1;
+                if (hi>lo)
+                    cum += hi-lo;
+                q = (j==j2) ? (1<<RESAMPLE_WBITS) : (int)(cum*(1<<RESAMPLE_WBITS)/span+.5);
+                rc->w[nt++]=q-qlast;
+                qlast=q;
+                }
+            }
+        if (rc->ntaps[i] > rc->maxtaps)
+            rc->maxtaps = rc->ntaps[i];
+        a=b;
         }
+    return(1);
     }
 
 
-static double resample_single(double *y,double x1,double x2)
+static void resample_coeffs_free(RESAMPLECOEFFS *rc,char *funcname)
 
     {
-    int i,i1,i2;
-    double dx,dx1,dx2,sum;
-
-    i1=floor(x1);
-    i2=floor(x2);
-    if (i1==i2)
-        return(y[i1]);
-    dx=x2-x1;
-    if (dx>1.)
-        dx=1.;
-    dx1= 1.-(x1-i1);
-    dx2= x2-i2;
-    sum=0.;
-    if (dx1 > 1e-8*dx)
-        sum += dx1*y[i1];
-    if (dx2 > 1e-8*dx)
-        sum += dx2*y[i2];
-    for (i=i1+1;i<=i2-1;sum+=y[i],i++);
-    return(sum/(x2-x1));
+    willus_mem_free((double **)&rc->start,funcname);
     }
 
 
-
-
-/*
-** Determine fixed-point accuracy of resample function
-*/
-#define FPBITS     10
-#define FPPIXBITS   8
-/*
-** Derived quantities
-*/
-#define FPMULT     (1<<FPBITS)
-#define FPMAX      ((1<<(31-FPBITS))-1)
-#define FPPIXMULT  (1<<FPPIXBITS)
-#define FPARMAX    (1<<(22-FPPIXBITS))
-#define FPDIMMAX   (1<<(30-FPBITS))
 /*
-** Resample (re-size) bitmap, but use fixed-point and all integer math.
-** Only slightly less accurate than floating point, but faster.
+** dst[i*channels+c] = sum of the weights of destination pixel i times source
+** plane c, scaled to RESAMPLE_HBITS fractional bits.  src is interleaved.
 */
-int bmp_resample_fixed_point(WILLUSBITMAP *dest,WILLUSBITMAP *src,double fx1,double fy1,
-                             double fx2,double fy2,int newwidth,int newheight)
+static void resample_row_horizontal(int *dst,unsigned char *src,int channels,
+                                    RESAMPLECOEFFS *rc)
 
     {
-    int gray,maxlen,colorplanes;
-    /* Assumes integers are 32-bit */
-    int *tempbmp;
-    int *temprow;
-    int x1_fp,y1_fp,x2_fp,y2_fp,swidth_fp,sheight_fp;
-    int color,hmax,row,col,dy,dx;
-    static char *funcname="bmp_resample";
-
-    if (newwidth==0 || newheight==0)
-        return(-1);
-    /* Quick check if we should use simple bmp_copy() call */
-    if (fx1==0. && fy1==0. && fx2==newwidth && fy2==newheight)
-        {
-        bmp_copy(dest,src);
-        return(0);
-        }
-    /*
-    ** Make sure we won't have fixed-precision overruns.
-    ** If so, just use the float routine
-    */
-    if (fabs(fx2-fx1)*fabs(fy2-fy1)/(newheight*newwidth) > FPARMAX
-          || fx1>FPDIMMAX || fx2>FPDIMMAX || fy1>FPDIMMAX || fy2>FPDIMMAX
-          || newwidth>FPDIMMAX || newheight>FPDIMMAX
-          || src->width>FPDIMMAX || src->height>FPDIMMAX)
-        return(bmp_resample(dest,src,fx1,fy1,fx2,fy2,newwidth,newheight));
-
-    /* Convert to fixed-point integers */
-    x1_fp=fx1*FPMULT+0.5;
-    y1_fp=fy1*FPMULT+0.5;
-    x2_fp=fx2*FPMULT+0.5;
-    y2_fp=fy2*FPMULT+0.5;
-    swidth_fp = src->width<<FPBITS;
-    sheight_fp = src->height<<FPBITS;
-    /* Clip and sort x1,y1 and x2,y2 */
-    if (x1_fp>swidth_fp)
-        x1_fp=swidth_fp;
-    else if (x1_fp<0)
-        x1_fp=0;
-    if (x2_fp>swidth_fp)
-        x2_fp=swidth_fp;
-    else if (x2_fp<0)
-        x2_fp=0;
-    if (y1_fp>sheight_fp)
-        y1_fp=sheight_fp;
-    else if (y1_fp<0)
-        y1_fp=0;
-    if (y2_fp>sheight_fp)
-        y2_fp=sheight_fp;
-    else if (y2_fp<0)
-        y2_fp=0;
-    if (x2_fp<x1_fp)
-        {
-        int t;
-        t=x2_fp;
-        x2_fp=x1_fp;
-        x1_fp=t;
-        }
-    if (y2_fp<y1_fp)
-        {
-        int t;
-        t=y2_fp;
-        y2_fp=y1_fp;
-        y1_fp=t;
-        }
-    dy=(y2_fp-y1_fp)>>FPBITS;
-    dy += 2;
-    if (x2_fp==x1_fp || y2_fp==y1_fp)
-        return(-2);
+    int i,k;
 
-    /* Allocate temp storage */
-    dx = (x2_fp-x1_fp)>>FPBITS;
-    maxlen = dx > dy+newheight ? dx : dy+newheight;
-    maxlen += 16;
-    hmax = newheight > dy ? newheight : dy;
-    if (!willus_mem_alloc((double **)&temprow,maxlen*sizeof(int),funcname))
-        return(-1);
-    if (!willus_mem_alloc((double **)&tempbmp,hmax*newwidth*sizeof(int),funcname))
-        {
-        willus_mem_free((double **)&temprow,funcname);
-        return(-1);
-        }
-    if ((gray=bmp_is_grayscale(src))!=0)
-        {
-        int i;
-        dest->bpp=8;
-        for (i=0;i<256;i++)
-            dest->red[i]=dest->blue[i]=dest->green[i]=i;
-        }
-    else
-        dest->bpp=24;
-    dest->width=newwidth;
-    dest->height=newheight;
-    dest->type=WILLUSBITMAP_TYPE_NATIVE;
-    if (!bmp_alloc(dest))
-        {
-        willus_mem_free((double **)&tempbmp,funcname);
-        willus_mem_free((double **)&temprow,funcname);
-        return(-1);
-        }
-    colorplanes = gray ? 1 : 3;
-    for (color=0;color<colorplanes;color++)
+    if (channels==1)
         {
-        bmp_resample_1_fixed_point(tempbmp,src,x1_fp,y1_fp,x2_fp,y2_fp,newwidth,newheight,
-                                   temprow,gray ? -1 : color);
-        for (row=0;row<newheight;row++)
+        for (i=0;i<rc->n;i++)
             {
+            int nt,sum,*w;
             unsigned char *p;
-            int *s;
-            p=bmp_rowptr_from_top(dest,row)+color;
-            s=&tempbmp[row*newwidth];
-            if (colorplanes==1)
-                for (col=0;col<newwidth;p[0]=(s[0]+(FPPIXMULT/2-1))>>FPPIXBITS,col++,s++,p++);
-            else
-                for (col=0;col<newwidth;p[0]=(s[0]+(FPPIXMULT/2-1))>>FPPIXBITS,col++,s++,p+=colorplanes);
+
+            p=&src[rc->start[i]];
+            w=&rc->w[rc->offset[i]];
+            nt=rc->ntaps[i];
+            for (sum=k=0;k<nt;k++)
+                sum += w[k]*p[k];
+            dst[i]=(sum+(1<<(RESAMPLE_WBITS-RESAMPLE_HBITS-1)))>>(RESAMPLE_WBITS-RESAMPLE_HBITS);
             }
+        return;
         }
-    willus_mem_free((double **)&tempbmp,funcname);
-    willus_mem_free((double **)&temprow,funcname);
-    return(0);
-    }
-
-
-static void bmp_resample_1_fixed_point(int *tempbmp,WILLUSBITMAP *src,int x1_fp,int y1_fp,
-                                       int x2_fp,int y2_fp,int newwidth,int newheight,
-                                       int *temprow,int color)
-
-    {
-    int row,col,x0,dx,y0,dy;
-
-    x0=x1_fp>>FPBITS;
-    dx=((x2_fp+(FPMULT-1))>>FPBITS)-x0;
-    x1_fp-=(x0<<FPBITS);
-    x2_fp-=(x0<<FPBITS);
-    y0=y1_fp>>FPBITS;
-    dy=((y2_fp+(FPMULT-1))>>FPBITS)-y0;
-    y1_fp-=(y0<<FPBITS);
-    y2_fp-=(y0<<FPBITS);
-    if (src->type==WILLUSBITMAP_TYPE_WIN32 && color>=0)
-        color=2-color;
-    for (row=0;row<dy;row++)
+    for (i=0;i<rc->n;i++,dst+=3)
         {
+        int nt,s0,s1,s2,*w;
         unsigned char *p;
-        p=bmp_rowptr_from_top(src,row+y0);
-        if (src->bpp==8)
-            {
-            switch (color)
-                {
-                case -1:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=(((unsigned int)p[0])<<FPPIXBITS);
-                    break;
-                case 0:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=src->red[p[0]]<<FPPIXBITS;
-                    break;
-                case 1:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=src->green[p[0]]<<FPPIXBITS;
-                    break;
-                case 2:
-                    for (col=0,p+=x0;col<dx;col++,p++)
-                        temprow[col]=src->blue[p[0]]<<FPPIXBITS;
-                    break;
-                }
-            }
-        else
+
+        p=&src[3*rc->start[i]];
+        w=&rc->w[rc->offset[i]];
+        nt=rc->ntaps[i];
+        for (s0=s1=s2=k=0;k<nt;k++,p+=3)
             {
-            p+=color;
-            for (col=0,p+=3*x0;col<dx;temprow[col]=(((unsigned int)p[0])<<FPPIXBITS),col++,p+=3);
+            s0 += w[k]*p[0];
+            s1 += w[k]*p[1];
+            s2 += w[k]*p[2];
             }
-        resample_1d_fixed_point(&tempbmp[row*newwidth],temprow,x1_fp,x2_fp,newwidth);
-        }
-    for (col=0;col<newwidth;col++)
-        {
-        int *p,*s;
-        p=&tempbmp[col];
-        s=&temprow[dy];
-        for (row=0;row<dy;row++,p+=newwidth)
-            temprow[row]=p[0];
-        resample_1d_fixed_point(s,temprow,y1_fp,y2_fp,newheight);
-        p=&tempbmp[col];
-        for (row=0;row<newheight;row++,p+=newwidth,s++)
-            p[0]=s[0];
+        dst[0]=(s0+(1<<(RESAMPLE_WBITS-RESAMPLE_HBITS-1)))>>(RESAMPLE_WBITS-RESAMPLE_HBITS);
+        dst[1]=(s1+(1<<(RESAMPLE_WBITS-RESAMPLE_HBITS-1)))>>(RESAMPLE_WBITS-RESAMPLE_HBITS);
+        dst[2]=(s2+(1<<(RESAMPLE_WBITS-RESAMPLE_HBITS-1)))>>(RESAMPLE_WBITS-RESAMPLE_HBITS);
         }
     }
 
 
 /*
-** Fixed point version of resample_1d().
+** Kept for older callers--bmp_resample() is fixed point now.
 */
-static void resample_1d_fixed_point(int *dst,int *src,int x1_fp,int x2_fp,int n)
-
-    {
-    int i,new_fp,last_fp;
-
-    last_fp=x1_fp;
-    for (i=0;i<n;i++)
-        {
-        /* Needs to go to double to prevent integer overflow */
-        new_fp=(int)(x1_fp+(double)(x2_fp-x1_fp)*(i+1)/n+.5);
-        dst[i] = resample_single_fixed_point(src,last_fp,new_fp);
-        last_fp=new_fp;
-        }
-    }
-
-
-static double resample_single_fixed_point(int *y,int x1_fp,int x2_fp)
+int bmp_resample_fixed_point(WILLUSBITMAP *dest,WILLUSBITMAP *src,double fx1,double fy1,
+                             double fx2,double fy2,int newwidth,int newheight)
 
     {
-    int i,i1,i2;
-    int dx_fp,dx1_fp,dx2_fp,sum;
-
-    i1=x1_fp>>FPBITS;
-    i2=x2_fp>>FPBITS;
-    if (i1==i2)
-        return(y[i1]);
-    dx_fp = x2_fp-x1_fp;
-    dx1_fp = FPMULT-(x1_fp-(i1<<FPBITS));
-    dx2_fp = x2_fp-(i2<<FPBITS);
-    sum= ((dx1_fp*y[i1]+(FPMULT/2))>>FPBITS) + ((dx2_fp*y[i2]+(FPMULT/2))>>FPBITS);
-    for (i=i1+1;i<=i2-1;sum+=y[i],i++);
-    return((sum<=FPMAX) ? ((sum<<FPBITS)+(FPMULT/2))/dx_fp : ((double)sum*FPMULT+(FPMULT/2))/dx_fp);
+    return(bmp_resample(dest,src,fx1,fy1,fx2,fy2,newwidth,newheight));
     }
 
 
-        
-
 /*
 ** dest bitmap MUST BE 24-bit
 */     
@@ -3215,9 +3257,22 @@ static void new_rgb(int *dpc,int *spc,int *dbgc,int *dfgc,int *sbgc,int *sfgc)
 void bmp_contrast_adjust(WILLUSBITMAP *dest,WILLUSBITMAP *src,double contrast)
 
     {
-    int i;
     static unsigned char newval[256];
 
+    bmp_contrast_lut(newval,contrast);
+    bmp_color_xform(dest,src,newval);
+    }
+
+
+/*
+** Fills newval[0..255] with the pixel value mapping that bmp_contrast_adjust()
+** applies for this contrast.
+*/
+void bmp_contrast_lut(unsigned char *newval,double contrast)
+
+    {
+    int i;
+
     for (i=0;i<256;i++)
         {
         double x,y;
@@ -3243,7 +3298,6 @@ void bmp_contrast_adjust(WILLUSBITMAP *dest,WILLUSBITMAP *src,double contrast)
             v=255;
         newval[i] = v;
         }
-    bmp_color_xform(dest,src,newval);
     }
 
 
@@ -4329,13 +4383,210 @@ static double bmp_row_by_row_stdev(WILLUSBITMAP *bmp,int ccount,int whitethresh,
     }
 
 
+/*
+** mask gets one pixel per 4x4 block of grey:  the number (0-16) of pixels
+** in the block that are darker than whitethresh.  mask is left empty
+** (0 x 0) if grey is less than 4 pixels wide or tall.
+*/
+static void bmp_inkmask_4x(WILLUSBITMAP *mask,WILLUSBITMAP *grey,int whitethresh)
+
+    {
+    int r,w4;
+
+    if (grey->width<4 || grey->height<4)
+        {
+        mask->width=mask->height=0;
+        return;
+        }
+    mask->width=grey->width/4;
+    mask->height=grey->height/4;
+    mask->bpp=8;
+    mask->type=WILLUSBITMAP_TYPE_NATIVE;
+    bmp_alloc(mask);
+    w4=mask->width*4;
+    for (r=0;r<mask->height;r++)
+        {
+        int i,c;
+        unsigned char *m;
+
+        m=bmp_rowptr_from_top(mask,r);
+        memset(m,0,mask->width);
+        for (i=0;i<4;i++)
+            {
+            unsigned char *p;
+
+            p=bmp_rowptr_from_top(grey,r*4+i);
+            for (c=0;c<w4;c++)
+                m[c>>2] += (p[c]<whitethresh);
+            }
+        }
+    }
+
+
+/*
+** Same metric as bmp_row_by_row_stdev(), but on a 4x ink mask from
+** bmp_inkmask_4x(), so each sample is a fraction of a block instead of
+** a single pixel.
+*/
+static double bmp_inkmask_row_stdev(WILLUSBITMAP *mask,double theta_radians)
+
+    {
+    int dc1,dc2,c1,c2;
+    int r,n;
+    double tanth,csum,csumsq,stdev;
+
+    c1=mask->width/15.;
+    c2=mask->width-c1;
+    tanth=-tan(theta_radians);
+    dc1=(int)(tanth*mask->width);
+    if (dc1<0)
+        {
+        dc1=1-dc1;
+        dc2=0;
+        }
+    else
+        {
+        dc2=-dc1-1;
+        dc1=0;
+        }
+    dc1 += mask->height/15.;
+    dc2 -= mask->height/15.;
+    csum=csumsq=0.;
+    n=0;
+    for (r=dc1+1;r<mask->height+dc2-1;r++)
+        {
+        int c,count,nn,r0last;
+        double dcount;
+        unsigned char *p;
+
+        r0last=0;
+        p=bmp_rowptr_from_top(mask,r0last);
+        for (nn=count=0,c=c1;c<c2;c++)
+            {
+            int r0;
+
+            r0=r+tanth*c;
+            if (r0<0 || r0>=mask->height)
+                continue;
+            if (r0!=r0last)
+                {
+                r0last=r0;
+                p=bmp_rowptr_from_top(mask,r0last);
+                }
+            nn++;
+            count+=p[c];
+            }
+        if (nn==0)
+            continue;
+        dcount=100.*count/(16.*nn);
+        csum+=dcount;
+        csumsq+=dcount*dcount;
+        n++;
+        }
+    if (n==0)
+        return(0.);
+    stdev=sqrt(fabs((csum/n)*(csum/n)-csumsq/n));
+    return(stdev);
+    }
+
+
+/*
+** Golden-section search for the angle (deg) between deg1 and deg2 that
+** maximizes bmp_row_by_row_stdev() on the full-resolution bitmap.
+*/
+static double bmp_row_stdev_peak(WILLUSBITMAP *grey,int whitethresh,double deg1,double deg2,
+                                 double tolerance,double *sdpeak)
+
+    {
+    static double gr=0.6180339887498949;
+    double x1,x2,f1,f2;
+
+    x1=deg2-gr*(deg2-deg1);
+    x2=deg1+gr*(deg2-deg1);
+    f1=bmp_row_by_row_stdev(grey,400,whitethresh,x1*PI/180.);
+    f2=bmp_row_by_row_stdev(grey,400,whitethresh,x2*PI/180.);
+    while (deg2-deg1 > tolerance)
+        {
+        if (f1 > f2)
+            {
+            deg2=x2;
+            x2=x1;
+            f2=f1;
+            x1=deg2-gr*(deg2-deg1);
+            f1=bmp_row_by_row_stdev(grey,400,whitethresh,x1*PI/180.);
+            }
+        else
+            {
+            deg1=x1;
+            x1=x2;
+            f1=f2;
+            x2=deg1+gr*(deg2-deg1);
+            f2=bmp_row_by_row_stdev(grey,400,whitethresh,x2*PI/180.);
+            }
+        }
+    if (sdpeak!=NULL)
+        (*sdpeak) = f1>f2 ? f1 : f2;
+    return(f1>f2 ? x1 : x2);
+    }
+
+
+/*
+** bmp_row_by_row_stdev() at grid point i (angle (i-na)*stepsize deg), kept in
+** sd[i] so no grid point is evaluated twice.  Unevaluated points are < 0.
+*/
+static double bmp_row_stdev_cached(WILLUSBITMAP *grey,int whitethresh,double *sd,int i,
+                                   int na,double stepsize)
+
+    {
+    if (sd[i] < 0.)
+        sd[i]=bmp_row_by_row_stdev(grey,400,whitethresh,(i-na)*stepsize*PI/180.);
+    return(sd[i]);
+    }
+
+
+/*
+** Walk downhill on the full-resolution grid from point i, staying within
+** ilo..ihi, and return the local minimum reached.
+*/
+static int bmp_row_stdev_descend(WILLUSBITMAP *grey,int whitethresh,double *sd,int i,
+                                 int ilo,int ihi,int na,double stepsize)
+
+    {
+    double sdi;
+
+    sdi=bmp_row_stdev_cached(grey,whitethresh,sd,i,na,stepsize);
+    while (1)
+        {
+        if (i>ilo && bmp_row_stdev_cached(grey,whitethresh,sd,i-1,na,stepsize) < sdi)
+            i--;
+        else if (i<ihi && bmp_row_stdev_cached(grey,whitethresh,sd,i+1,na,stepsize) < sdi)
+            i++;
+        else
+            break;
+        sdi = sd[i];
+        }
+    return(i);
+    }
+
+
+/*
+** The tilt is found coarse-to-fine:  the row-profile metric is swept
+** across +/-maxdegrees on a 4x-downsampled ink mask, each coarse peak near
+** the best one is refined with a golden-section search at full resolution,
+** and only the few 0.05-degree grid points that the peak, flatness and
+** width tests need are evaluated on the full bitmap.  The least value on
+** each side of the peak is found by walking downhill on that grid from
+** where the coarse curve is least, so the flatness (0.95) and width
+** thresholds are applied to full-resolution values only.
+*/
 double bmp_autostraighten(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,int white,double maxdegrees,
                           double mindegrees,int debug,FILE *out)
 
     {
-    int i,na,n,imax;
-    double stepsize,sdmin,sdmax,rotdeg;
-    double *sdev;
+    int i,na,n,nac,nc,imax,ic,i1,i2;
+    double stepsize,cstep,csmax,sdmax,sdmin,sdpeak,degpeak,rotdeg;
+    double *sdev,*csdev;
+    WILLUSBITMAP _mask,*mask,_rbmp,*rbmp;
     FILE *f;
     static int rpc=0;
     static char *funcname="bmp_autostraighten";
@@ -4352,44 +4603,122 @@ double bmp_autostraighten(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,int white,doub
     if (na<1)
         na=1;
     n = 1+na*2;
-    sdmin=999.;
-    sdmax=-999.;
-    imax=0;
-    willus_mem_alloc_warn((void **)&sdev,n*sizeof(double),funcname,10);
+    cstep=4*stepsize;
+    nac = (int)(na*stepsize/cstep+.5);
+    if (nac<1)
+        nac=1;
+    nc = 1+nac*2;
+    willus_mem_alloc_warn((void **)&sdev,(n+nc)*sizeof(double),funcname,10);
+    csdev=&sdev[n];
+    /* Full-resolution grid values are filled in only as they are needed */
     for (i=0;i<n;i++)
-        {
-        double theta,sdev0;
+        sdev[i] = -1.;
 
-        theta = (i-na)*stepsize*PI/180.;
-        sdev0=bmp_row_by_row_stdev(srcgrey,400,white,theta);
-        if (sdmin > sdev0)
-            sdmin = sdev0;
-        if (sdmax < sdev0)
-            {
-            imax = i;
-            sdmax = sdev0;
-            }
-        sdev[i]=sdev0;
+    /* Coarse sweep */
+    mask=&_mask;
+    bmp_init(mask);
+    bmp_inkmask_4x(mask,srcgrey,white);
+    csmax=-999.;
+    for (i=0;i<nc;i++)
+        {
+        csdev[i]=bmp_inkmask_row_stdev(mask,(i-nac)*cstep*PI/180.);
+        if (csmax < csdev[i])
+            csmax = csdev[i];
         }
-    if (sdmax<=0.)
+    bmp_free(mask);
+    if (csmax<=0.)
         {
         willus_mem_free((double **)&sdev,funcname);
         if (debug)
             fclose(f);
         return(0.);
         }
-    for (i=0;i<n;i++)
-        sdev[i] /= sdmax;
     if (debug)
         {
-        for (i=0;i<n;i++)
-            nprintf(f,"%.3f %g\n",(i-na)*stepsize,sdev[i]);
+        for (i=0;i<nc;i++)
+            nprintf(f,"%.3f %g\n",(i-nac)*cstep,csdev[i]/csmax);
         nprintf(f,"//nc\n");
         }
-    sdmin /= sdmax;
+
+    /* Refine every coarse peak that comes close to the best one */
+    degpeak=0.;
+    sdpeak=-1.;
+    for (i=0;i<nc;i++)
+        {
+        double deg1,deg2,deg,sd;
+
+        if (csdev[i] < .98*csmax || (i>0 && csdev[i-1]>csdev[i])
+                                 || (i<nc-1 && csdev[i+1]>csdev[i]))
+            continue;
+        deg1=(i-nac-1)*cstep;
+        deg2=(i-nac+1)*cstep;
+        if (deg1 < -na*stepsize)
+            deg1 = -na*stepsize;
+        if (deg2 > na*stepsize)
+            deg2 = na*stepsize;
+        deg=bmp_row_stdev_peak(srcgrey,white,deg1,deg2,.02,&sd);
+        if (sd > sdpeak)
+            {
+            sdpeak=sd;
+            degpeak=deg;
+            }
+        }
+    /* Snap the peak to the nearest local maximum on the grid */
+    imax=(int)floor(degpeak/stepsize+.5)+na;
+    if (imax<0)
+        imax=0;
+    if (imax>n-1)
+        imax=n-1;
+    sdmax=bmp_row_stdev_cached(srcgrey,white,sdev,imax,na,stepsize);
+    while (1)
+        {
+        if (imax>0 && bmp_row_stdev_cached(srcgrey,white,sdev,imax-1,na,stepsize) > sdmax)
+            imax--;
+        else if (imax<n-1 && bmp_row_stdev_cached(srcgrey,white,sdev,imax+1,na,stepsize) > sdmax)
+            imax++;
+        else
+            break;
+        sdmax = sdev[imax];
+        }
     rotdeg = -(imax-na)*stepsize;
-    if (sdmin > 0.95 || fabs(rotdeg) <= mindegrees
-                     || fabs(fabs(rotdeg)-fabs(maxdegrees)) < 0.25)
+    /* Least value on each side of the peak, starting where the coarse curve is least */
+    ic=(int)floor((imax-na)*stepsize/cstep+.5)+nac;
+    if (ic<0)
+        ic=0;
+    if (ic>nc-1)
+        ic=nc-1;
+    sdmin=sdmax;
+    i1=i2=-1;
+    if (imax>0)
+        {
+        for (i=0;i<ic;i++)
+            if (i1<0 || csdev[i]<csdev[i1])
+                i1=i;
+        i1 = i1<0 ? 0 : (int)floor((i1-nac)*cstep/stepsize+.5)+na;
+        if (i1<0)
+            i1=0;
+        if (i1>imax-1)
+            i1=imax-1;
+        i1=bmp_row_stdev_descend(srcgrey,white,sdev,i1,0,imax-1,na,stepsize);
+        if (sdmin > sdev[i1])
+            sdmin = sdev[i1];
+        }
+    if (imax<n-1)
+        {
+        for (i=ic+1;i<nc;i++)
+            if (i2<0 || csdev[i]<csdev[i2])
+                i2=i;
+        i2 = i2<0 ? n-1 : (int)floor((i2-nac)*cstep/stepsize+.5)+na;
+        if (i2>n-1)
+            i2=n-1;
+        if (i2<imax+1)
+            i2=imax+1;
+        i2=bmp_row_stdev_descend(srcgrey,white,sdev,i2,imax+1,n-1,na,stepsize);
+        if (sdmin > sdev[i2])
+            sdmin = sdev[i2];
+        }
+    if (sdmax<=0. || sdmin/sdmax > 0.95 || fabs(rotdeg) <= mindegrees
+                  || fabs(fabs(rotdeg)-fabs(maxdegrees)) < 0.25)
         {
         willus_mem_free((double **)&sdev,funcname);
         if (debug)
@@ -4404,27 +4733,56 @@ double bmp_autostraighten(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,int white,doub
         {
         double sd1min,sd2min,sdthresh;
 
-        for (sd1min=sdev[imax-1],i=imax-2;i>=0;i--)
-            if (sd1min > sdev[i])
-                sd1min = sdev[i];
-        for (sd2min=sdev[imax+1],i=imax+2;i<n;i++)
-            if (sd2min > sdev[i])
-                sd2min = sdev[i];
+        sd1min=sdev[i1]/sdmax;
+        sd2min=sdev[i2]/sdmax;
         sdthresh = sd1min > sd2min ? sd1min*1.01 : sd2min*1.01;
         if (sdthresh < 0.9)
             sdthresh = 0.9;
         if (sdthresh < 0.95)
             {
-            double deg1,deg2;
-
-            for (i=imax-1;i>=0;i--)
-                if (sdev[i]<sdthresh)
+            double deg1,deg2,thresh;
+
+            /*
+            ** Find where the curve drops below sdthresh on each side of the
+            ** peak, starting from where the coarse curve does.
+            */
+            thresh=sdthresh*sdmax;
+            for (i=ic-1;i>0;i--)
+                if (csdev[i]<sdthresh*csmax)
                     break;
-            deg1=stepsize*((i-na)+(sdthresh-sdev[i])/(sdev[i+1]-sdev[i]));
-            for (i=imax+1;i<n-1;i++)
-                if (sdev[i]<sdthresh)
+            i1=(int)floor((i-nac)*cstep/stepsize+.5)+na;
+            if (i1<0)
+                i1=0;
+            if (i1>imax-1)
+                i1=imax-1;
+            if (bmp_row_stdev_cached(srcgrey,white,sdev,i1,na,stepsize) < thresh)
+                {
+                while (i1+1<imax && bmp_row_stdev_cached(srcgrey,white,sdev,i1+1,na,stepsize) < thresh)
+                    i1++;
+                }
+            else
+                while (i1>0 && bmp_row_stdev_cached(srcgrey,white,sdev,i1,na,stepsize) >= thresh)
+                    i1--;
+            bmp_row_stdev_cached(srcgrey,white,sdev,i1+1,na,stepsize);
+            deg1=stepsize*((i1-na)+(thresh-sdev[i1])/(sdev[i1+1]-sdev[i1]));
+            for (i=ic+1;i<nc-1;i++)
+                if (csdev[i]<sdthresh*csmax)
                     break;
-            deg2=stepsize*((i-na)-(sdthresh-sdev[i])/(sdev[i-1]-sdev[i]));
+            i2=(int)floor((i-nac)*cstep/stepsize+.5)+na;
+            if (i2>n-1)
+                i2=n-1;
+            if (i2<imax+1)
+                i2=imax+1;
+            if (bmp_row_stdev_cached(srcgrey,white,sdev,i2,na,stepsize) < thresh)
+                {
+                while (i2-1>imax && bmp_row_stdev_cached(srcgrey,white,sdev,i2-1,na,stepsize) < thresh)
+                    i2--;
+                }
+            else
+                while (i2<n-1 && bmp_row_stdev_cached(srcgrey,white,sdev,i2,na,stepsize) >= thresh)
+                    i2++;
+            bmp_row_stdev_cached(srcgrey,white,sdev,i2-1,na,stepsize);
+            deg2=stepsize*((i2-na)-(thresh-sdev[i2])/(sdev[i2-1]-sdev[i2]));
             if (deg2 - deg1 < 2.5)
                 {
                 rotdeg = -(deg1+deg2)/2.;
@@ -4451,19 +4809,28 @@ double bmp_autostraighten(WILLUSBITMAP *src,WILLUSBITMAP *srcgrey,int white,doub
         sprintf(filename,"unrotated%05d.png",rpc);
         bmp_write(srcgrey,filename,stdout,100);
         }
+    /*
+    ** Rotate into one scratch bitmap and swap it in, larger bitmap first so
+    ** that srcgrey can re-use the buffer src leaves behind.
+    */
+    rbmp=&_rbmp;
+    bmp_init(rbmp);
+    if (src!=NULL)
+        {
+        src->data[0]=src->data[1]=src->data[2]=255;
+        bmp_rotate_fast_ex(rbmp,src,rotdeg,0);
+        bmp_swap(src,rbmp);
+        }
     srcgrey->data[0]=255;
-    bmp_rotate_fast(srcgrey,rotdeg,0);
+    bmp_rotate_fast_ex(rbmp,srcgrey,rotdeg,0);
+    bmp_swap(srcgrey,rbmp);
+    bmp_free(rbmp);
     if (debug)
         {
         char filename[256];
         sprintf(filename,"rotated%05d_%03ddeg.png",rpc,(int)(rotdeg*100.));
         bmp_write(srcgrey,filename,stdout,100);
         }
-    if (src!=NULL)
-        {
-        src->data[0]=src->data[1]=src->data[2]=255;
-        bmp_rotate_fast(src,rotdeg,0);
-        }
     willus_mem_free((double **)&sdev,funcname);
     return(rotdeg);
     }
@@ -20,237 +20,951 @@
 **
 */
 #include <stdio.h>
+#include <math.h>
 #include "willus.h"
 
 #ifdef HAVE_MUPDF_LIB
 #include <mupdf/pdf.h>
+#ifdef HAVE_PTHREAD_LIB
+#include <pthread.h>
+#endif
 void pdf_install_load_system_font_funcs(fz_context *ctx);
 
+#ifdef HAVE_PTHREAD_LIB
+typedef struct
+    {
+    WMUPDFRENDERQ *q;
+    WMUPDFDOC wdoc;   /* Thread's clone of the session */
+    pthread_t thread;
+    } RENDERQTHREAD;
+
+typedef struct
+    {
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;  /* Signaled when a page is queued or on quit */
+    pthread_cond_t done;    /* Signaled when a page finishes rendering */
+    RENDERQTHREAD *rt;
+    int nthreads;
+    } RENDERQSYS;
+
+static void *bmpmupdf_renderq_thread(void *data);
+static int bmpmupdf_renderq_get(WMUPDFRENDERQ *q,WILLUSBITMAP *bmp,int pageno,double dpi,
+                                int bpp,int *status);
+#endif
+static int bmpmupdf_render_banded(WILLUSBITMAP *bmp,fz_context *ctx,fz_display_list *list,
+                                  fz_matrix *ctm,fz_irect *bbox,fz_colorspace *colorspace);
+static int bmpmupdf_render_in_place(WILLUSBITMAP *bmp,fz_context *ctx,fz_display_list *list,
+                                    fz_matrix *ctm,fz_rect *scissor,fz_irect *bbox,
+                                    fz_colorspace *colorspace);
+static int bmpmupdf_native_image(WILLUSBITMAP *bmp,fz_context *ctx,fz_display_list *list,
+                                 fz_matrix *ctm,fz_irect *bbox,fz_colorspace *colorspace);
+static int bmpmupdf_pixmap_opaque(unsigned char *samples,int n,int ncomp);
+static void bmpmupdf_pixmap_reduce(WILLUSBITMAP *bmp,unsigned char *samples,int iw,int ih,
+                                   int ncomp,int k);
 static int bmpmupdf_pixmap_to_bmp(WILLUSBITMAP *bmp,fz_context *ctx,fz_pixmap *pixmap);
+static int bmpmupdf_pixmap_rows_to_bmp(WILLUSBITMAP *bmp,int row0,fz_context *ctx,
+                                       fz_pixmap *pixmap);
+
+/*
+** Pages larger than BMPMUPDF_BAND_MIN_PIXELS are rendered in horizontal
+** bands of about BMPMUPDF_BAND_PIXELS pixels each, directly into the bitmap,
+** so that a full-page MuPDF pixmap is never allocated alongside the (still
+** full-page) bitmap.
+*/
+#define BMPMUPDF_BAND_MIN_PIXELS 3.2e7
+#define BMPMUPDF_BAND_PIXELS     4000000
 
 int bmpmupdf_pdffile_to_bmp(WILLUSBITMAP *bmp,char *filename,int pageno,double dpi,
                             int bpp)
 
+    {
+    WMUPDFDOC _mdoc,*mdoc;
+    int status;
+
+    if (pageno<1)
+        return(-99);
+    mdoc=&_mdoc;
+    wmupdfdoc_init(mdoc);
+    if (wmupdfdoc_open(mdoc,filename,"")<0)
+        return(-1);
+    status=bmpmupdf_pdfdoc_to_bmp(bmp,mdoc,pageno,dpi,bpp);
+    wmupdfdoc_close(mdoc);
+    return(status);
+    }
+
+
+/*
+** Render page pageno (1=first page) from an open document session (see
+** wmupdfdoc_open() in wmupdf.c).  The document is not re-opened, so the
+** xref and the resource store are shared by all pages.
+*/
+int bmpmupdf_pdfdoc_to_bmp(WILLUSBITMAP *bmp,WMUPDFDOC *mdoc,int pageno,double dpi,int bpp)
+
     {
     fz_context *ctx;
     fz_colorspace *colorspace;
-    fz_document *doc;
-    fz_page *page;
     fz_display_list *list;
     fz_device *dev;
     fz_pixmap *pix;
     double dpp;
+    double pbounds[4];
     fz_rect bounds,bounds2;
     fz_matrix ctm;
     fz_irect bbox;
-//    fz_glyph_cache *glyphcache;
-//    fz_error error;
-    int np,status;
+    int status;
 
+    if (pageno<1 || pageno>mdoc->np)
+        return(-99);
+    ctx=(fz_context *)mdoc->ctx;
+    if (ctx==NULL)
+        return(-1);
+#ifdef HAVE_PTHREAD_LIB
+    /* Already rendered (or being rendered) by a render-ahead thread? */
+    if (mdoc->renderq!=NULL
+          && bmpmupdf_renderq_get((WMUPDFRENDERQ *)mdoc->renderq,bmp,pageno,dpi,bpp,&status))
+        return(status);
+#endif
+    /* Display list is cached in the session (shared with text extraction) */
+    list=(fz_display_list *)wmupdfdoc_display_list_get(mdoc,pageno,pbounds);
+    if (list==NULL)
+        return(-14);
     dev=NULL;
-    list=NULL;
-    page=NULL;
-    doc=NULL;
+    pix=NULL;
     status=0;
+    fz_var(dev);
+    fz_var(pix);
+    fz_var(status);
+    colorspace=(bpp==8 ? fz_device_gray(ctx) : fz_device_rgb(ctx));
+    fz_try(ctx)
+        {
+        status=-5;
+        dpp=dpi/72.;
+        bounds.x0=pbounds[0];
+        bounds.y0=pbounds[1];
+        bounds.x1=pbounds[2];
+        bounds.y1=pbounds[3];
+        ctm=fz_identity;
+        fz_scale(&ctm,dpp,dpp);
+        bounds2=bounds;
+        fz_transform_rect(&bounds2,&ctm);
+        fz_round_rect(&bbox,&bounds2);
+        /* Scanned page?  Decode the image directly. */
+        if (bmpmupdf_native_image(bmp,ctx,list,&ctm,&bbox,colorspace))
+            status=0;
+        else if ((double)(bbox.x1-bbox.x0)*(bbox.y1-bbox.y0) > BMPMUPDF_BAND_MIN_PIXELS)
+            status=bmpmupdf_render_banded(bmp,ctx,list,&ctm,&bbox,colorspace);
+        else if (bmp->type==WILLUSBITMAP_TYPE_NATIVE)
+            status=bmpmupdf_render_in_place(bmp,ctx,list,&ctm,&bounds2,&bbox,colorspace);
+        else
+            {
+            pix=fz_new_pixmap_with_bbox(ctx,colorspace,&bbox);
+            fz_clear_pixmap_with_value(ctx,pix,255);
+            dev=fz_new_draw_device(ctx,pix);
+            fz_run_display_list(ctx,list,dev,&ctm,&bounds2,NULL);
+            fz_drop_device(ctx,dev);
+            dev=NULL;
+            status=bmpmupdf_pixmap_to_bmp(bmp,ctx,pix);
+            }
+        }
+    fz_always(ctx)
+        {
+        fz_drop_device(ctx,dev);
+        fz_drop_pixmap(ctx,pix);
+        wmupdfdoc_display_list_release(mdoc,list);
+        }
+    fz_catch(ctx)
+        {
+        return(status);
+        }
+    fz_flush_warnings(ctx);
+    if (status<0)
+        return(status-10);
+    return(0);
+    }
+
+/*
+** Returns 0 if got dimensions.
+*/
+int bmpmupdf_pdffile_width_and_height(char *filename,int pageno,double *width_in,double *height_in)
+
+    {
+    WMUPDFDOC _mdoc,*mdoc;
+    int status;
+
     if (pageno<1)
         return(-99);
-    ctx = fz_new_context(NULL,NULL,FZ_STORE_DEFAULT);
-    if (!ctx)
+    mdoc=&_mdoc;
+    wmupdfdoc_init(mdoc);
+    if (wmupdfdoc_open(mdoc,filename,"")<0)
         return(-1);
+    status=bmpmupdf_pdfdoc_width_and_height(mdoc,pageno,width_in,height_in);
+    wmupdfdoc_close(mdoc);
+    return(status);
+    }
+
+
+/*
+** Page dimensions from an open document session.  Only the page bounds are
+** read--the page contents are not interpreted.
+** Returns 0 if got dimensions.
+*/
+int bmpmupdf_pdfdoc_width_and_height(WMUPDFDOC *mdoc,int pageno,double *width_in,
+                                     double *height_in)
+
+    {
+    fz_context *ctx;
+    fz_page *page;
+    fz_rect bounds;
+
+    if (pageno<1 || pageno>mdoc->np)
+        return(-99);
+    ctx=(fz_context *)mdoc->ctx;
+    if (ctx==NULL)
+        return(-1);
+    /* Harvested from the page tree? */
+    if (mdoc->meta.valid && mdoc->meta.pagesize!=NULL && mdoc->meta.pagesize[2*pageno-2]>0.)
+        {
+        if (width_in!=NULL)
+            (*width_in)=mdoc->meta.pagesize[2*pageno-2]/72.;
+        if (height_in!=NULL)
+            (*height_in)=mdoc->meta.pagesize[2*pageno-1]/72.;
+        return(0);
+        }
+    page=NULL;
+    fz_var(page);
     fz_try(ctx)
+        {
+        page=fz_load_page(ctx,(fz_document *)mdoc->doc,pageno-1);
+        fz_bound_page(ctx,page,&bounds);
+        }
+    fz_always(ctx)
+        {
+        fz_drop_page(ctx,page);
+        }
+    fz_catch(ctx)
+        {
+        return(-3);
+        }
+    if (width_in!=NULL)
+        (*width_in)=fabs(bounds.x1-bounds.x0)/72.;
+    if (height_in!=NULL)
+        (*height_in)=fabs(bounds.y1-bounds.y0)/72.;
+    return(0);
+    }
+
+
+/*
+** RENDER-AHEAD QUEUE
+**
+** Each worker thread has its own clone of the session (see wmupdfdoc_clone()),
+** so the threads share the MuPDF resource store but never share an
+** fz_document.  A queued page is handed back by bmpmupdf_pdfdoc_to_bmp() only
+** if it was requested at the same dpi and bpp, so the bitmap is identical to
+** one rendered in the calling thread.
+*/
+void bmpmupdf_renderq_init(WMUPDFRENDERQ *q)
+
     {
-    fz_register_document_handlers(ctx);
-    fz_set_aa_level(ctx,8);
-    /* Sumatra version of MuPDF v1.4 -- use locally installed fonts */
-    pdf_install_load_system_font_funcs(ctx);
-//    fz_accelerate();
-//    glyphcache=fz_new_glyph_cache();
-    colorspace=(bpp==8 ? fz_device_gray(ctx) : fz_device_rgb(ctx));
-    fz_try(ctx) { doc=fz_open_document(ctx,filename); }
-    fz_catch(ctx) 
-        { 
-        fz_drop_context(ctx);
+    q->mdoc=NULL;
+    q->nthreads=0;
+    q->depth=0;
+    q->page=NULL;
+    q->seq=0;
+    q->quit=0;
+    q->hits=0;
+    q->misses=0;
+    q->sys=NULL;
+    }
+
+
+/*
+** Start nthreads render threads on session mdoc with up to depth pages
+** rendered ahead.  Returns 0 if started, < 0 if not (in which case pages
+** are simply rendered on demand).
+*/
+int bmpmupdf_renderq_start(WMUPDFRENDERQ *q,WMUPDFDOC *mdoc,int nthreads,int depth)
+
+    {
+#ifdef HAVE_PTHREAD_LIB
+    RENDERQSYS *sys;
+    int i;
+    static char *funcname="bmpmupdf_renderq_start";
+
+    bmpmupdf_renderq_init(q);
+    if (mdoc->ctx==NULL || nthreads<1 || depth<1)
         return(-1);
+    willus_mem_alloc_warn((void **)&sys,sizeof(RENDERQSYS),funcname,10);
+    willus_mem_alloc_warn((void **)&sys->rt,nthreads*sizeof(RENDERQTHREAD),funcname,10);
+    willus_mem_alloc_warn((void **)&q->page,depth*sizeof(WMUPDFRENDERPAGE),funcname,10);
+    for (i=0;i<depth;i++)
+        {
+        q->page[i].pageno=0;
+        q->page[i].state=0;
+        bmp_init(&q->page[i].bmp);
+        }
+    q->depth=depth;
+    pthread_mutex_init(&sys->mutex,NULL);
+    pthread_cond_init(&sys->queued,NULL);
+    pthread_cond_init(&sys->done,NULL);
+    sys->nthreads=0;
+    q->sys=(void *)sys;
+    q->mdoc=mdoc;
+    for (i=0;i<nthreads;i++)
+        {
+        RENDERQTHREAD *rt;
+
+        rt=&sys->rt[sys->nthreads];
+        rt->q=q;
+        if (wmupdfdoc_clone(&rt->wdoc,mdoc,"")<0)
+            break;
+        if (pthread_create(&rt->thread,NULL,bmpmupdf_renderq_thread,(void *)rt)!=0)
+            {
+            wmupdfdoc_close(&rt->wdoc);
+            break;
+            }
+        sys->nthreads++;
         }
-    /*
-    if (fz_needs_password(doc) && !fz_authenticate_password(doc,password))
+    q->nthreads=sys->nthreads;
+    if (q->nthreads==0)
+        {
+        bmpmupdf_renderq_end(q);
         return(-2);
-    */
-//    error=pdf_load_page_tree(xref);
-//    if (error)
-//        {
-//        pdf_free_xref(xref);
-//        return(-2);
-//        }
-
-    np=fz_count_pages(ctx,doc);
-    if (pageno>np)
-        return(-99);
-    fz_try(ctx) { page = fz_load_page(ctx,doc,pageno-1); }
-    fz_catch(ctx) 
+        }
+    mdoc->renderq=(void *)q;
+    return(0);
+#else
+    bmpmupdf_renderq_init(q);
+    return(-1);
+#endif
+    }
+
+
+/*
+** Queue page pageno (1=first page) to be rendered at dpi and bpp.  Ignored if
+** the page is already queued.  If all slots are taken, the oldest finished
+** page which hasn't been picked up is discarded to make room.
+*/
+void bmpmupdf_renderq_request(WMUPDFRENDERQ *q,int pageno,double dpi,int bpp)
+
+    {
+#ifdef HAVE_PTHREAD_LIB
+    RENDERQSYS *sys;
+    WMUPDFRENDERPAGE *rp;
+    int i;
+
+    sys=(RENDERQSYS *)q->sys;
+    if (sys==NULL || pageno<1 || pageno>q->mdoc->np)
+        return;
+    pthread_mutex_lock(&sys->mutex);
+    for (rp=NULL,i=0;i<q->depth;i++)
         {
-        fz_drop_document(ctx,doc);
-        fz_drop_context(ctx);
-        return(-3);
+        WMUPDFRENDERPAGE *p1;
+
+        p1=&q->page[i];
+        if (p1->pageno==pageno && p1->dpi==dpi && p1->bpp==bpp)
+            break;
+        if (p1->state==0)
+            {
+            if (rp==NULL || rp->state!=0)
+                rp=p1;
+            }
+        else if (p1->state==3 && (rp==NULL || (rp->state==3 && p1->seq<rp->seq)))
+            rp=p1;
         }
-    fz_try(ctx) { list=fz_new_display_list(ctx);
-                  dev=fz_new_list_device(ctx,list);
-                  fz_run_page(ctx,page,dev,&fz_identity,NULL);
-                }
-    fz_catch(ctx)
+    if (i>=q->depth && rp!=NULL && !q->quit)
         {
-        fz_drop_device(ctx,dev);
-        fz_drop_display_list(ctx,list);
-        fz_drop_page(ctx,page);
-        fz_drop_document(ctx,doc);
-        fz_drop_context(ctx);
-        return(-4);
+        rp->pageno=pageno;
+        rp->dpi=dpi;
+        rp->bpp=bpp;
+        rp->state=1;
+        rp->seq=++q->seq;
+        pthread_cond_signal(&sys->queued);
+        }
+    pthread_mutex_unlock(&sys->mutex);
+#endif
+    }
+
+
+/*
+** Stop the render threads and free the queue.
+*/
+void bmpmupdf_renderq_end(WMUPDFRENDERQ *q)
+
+    {
+#ifdef HAVE_PTHREAD_LIB
+    RENDERQSYS *sys;
+    int i;
+    static char *funcname="bmpmupdf_renderq_end";
+
+    sys=(RENDERQSYS *)q->sys;
+    if (sys==NULL)
+        return;
+    pthread_mutex_lock(&sys->mutex);
+    q->quit=1;
+    pthread_cond_broadcast(&sys->queued);
+    pthread_mutex_unlock(&sys->mutex);
+    for (i=0;i<sys->nthreads;i++)
+        {
+        pthread_join(sys->rt[i].thread,NULL);
+        wmupdfdoc_close(&sys->rt[i].wdoc);
         }
-    fz_drop_device(ctx,dev);
+    pthread_cond_destroy(&sys->done);
+    pthread_cond_destroy(&sys->queued);
+    pthread_mutex_destroy(&sys->mutex);
+    for (i=q->depth-1;i>=0;i--)
+        bmp_free(&q->page[i].bmp);
+    willus_mem_free((double **)&q->page,funcname);
+    willus_mem_free((double **)&sys->rt,funcname);
+    willus_mem_free((double **)&sys,funcname);
+    if (q->mdoc!=NULL && q->mdoc->renderq==(void *)q)
+        q->mdoc->renderq=NULL;
+#endif
+    bmpmupdf_renderq_init(q);
+    }
+
+
+#ifdef HAVE_PTHREAD_LIB
+static void *bmpmupdf_renderq_thread(void *data)
+
+    {
+    RENDERQTHREAD *rt;
+    WMUPDFRENDERQ *q;
+    RENDERQSYS *sys;
+
+    rt=(RENDERQTHREAD *)data;
+    q=rt->q;
+    sys=(RENDERQSYS *)q->sys;
+    pthread_mutex_lock(&sys->mutex);
+    while (!q->quit)
+        {
+        WMUPDFRENDERPAGE *rp;
+        int i,status;
+
+        /* Render the earliest requested page first */
+        for (rp=NULL,i=0;i<q->depth;i++)
+            if (q->page[i].state==1 && (rp==NULL || q->page[i].seq<rp->seq))
+                rp=&q->page[i];
+        if (rp==NULL)
+            {
+            pthread_cond_wait(&sys->queued,&sys->mutex);
+            continue;
+            }
+        rp->state=2;
+        pthread_mutex_unlock(&sys->mutex);
+        status=bmpmupdf_pdfdoc_to_bmp(&rp->bmp,&rt->wdoc,rp->pageno,rp->dpi,rp->bpp);
+        pthread_mutex_lock(&sys->mutex);
+        rp->status=status;
+        rp->state=3;
+        pthread_cond_broadcast(&sys->done);
+        }
+    pthread_mutex_unlock(&sys->mutex);
+    return(NULL);
+    }
+
+
+/*
+** If page pageno was requested at dpi and bpp, wait for it to finish rendering,
+** put it into bmp, and return 1 (*status = render status).  Returns 0 if the
+** page needs to be rendered by the caller.
+*/
+static int bmpmupdf_renderq_get(WMUPDFRENDERQ *q,WILLUSBITMAP *bmp,int pageno,double dpi,
+                                int bpp,int *status)
+
+    {
+    RENDERQSYS *sys;
+    WMUPDFRENDERPAGE *rp;
+    WILLUSBITMAP tmp;
+    int i;
+
+    sys=(RENDERQSYS *)q->sys;
+    if (sys==NULL)
+        return(0);
+    pthread_mutex_lock(&sys->mutex);
+    for (rp=NULL,i=0;i<q->depth;i++)
+        if (q->page[i].state!=0 && q->page[i].pageno==pageno
+                && q->page[i].dpi==dpi && q->page[i].bpp==bpp)
+            {
+            rp=&q->page[i];
+            break;
+            }
+    /* Not started yet--caller may as well render it */
+    if (rp!=NULL && rp->state==1)
+        {
+        rp->pageno=0;
+        rp->state=0;
+        rp=NULL;
+        }
+    if (rp==NULL)
+        {
+        q->misses++;
+        pthread_mutex_unlock(&sys->mutex);
+        return(0);
+        }
+    while (rp->state!=3)
+        pthread_cond_wait(&sys->done,&sys->mutex);
+    rp->pageno=0;
+    rp->state=0;
+    /* Different row order than caller wants--caller renders it */
+    if (rp->bmp.type!=bmp->type)
+        {
+        q->misses++;
+        pthread_mutex_unlock(&sys->mutex);
+        return(0);
+        }
+    q->hits++;
+    /* Swap bitmaps so the slot re-uses the caller's memory */
+    (*status)=rp->status;
+    tmp=(*bmp);
+    (*bmp)=rp->bmp;
+    rp->bmp=tmp;
+    pthread_mutex_unlock(&sys->mutex);
+    return(1);
+    }
+#endif /* HAVE_PTHREAD_LIB */
+
+
+/*
+** Render the page one band of rows at a time, each clipped with the scissor
+** rectangle of fz_run_display_list(), and copy each band into bmp.  Peak
+** memory is the bitmap plus one band instead of the bitmap plus a full-page
+** pixmap (which is 2 bytes/pixel for grayscale, 4 for RGB).  That is the only
+** saving:  bmp itself is still the whole page, and the caller's copies of it
+** (e.g. k2pdfopt's grayscale source bitmap and its per-page analysis tables)
+** are full-page too, so the bands are not streamed any further than this.
+** Throws MuPDF exceptions to the caller.
+*/
+static int bmpmupdf_render_banded(WILLUSBITMAP *bmp,fz_context *ctx,fz_display_list *list,
+                                  fz_matrix *ctm,fz_irect *bbox,fz_colorspace *colorspace)
+
+    {
+    fz_pixmap *pix;
+    fz_device *dev;
+    int i,row,bandh,status;
+
+    bmp->width=bbox->x1-bbox->x0;
+    bmp->height=bbox->y1-bbox->y0;
+    bmp->bpp=(colorspace==fz_device_gray(ctx)) ? 8 : 24;
+    bmp_alloc(bmp);
+    if (bmp->bpp==8)
+        for (i=0;i<256;i++)
+            bmp->red[i]=bmp->green[i]=bmp->blue[i]=i;
+    bandh=BMPMUPDF_BAND_PIXELS/bmp->width;
+    if (bandh<1)
+        bandh=1;
+    pix=NULL;
     dev=NULL;
-    dpp=dpi/72.;
+    status=0;
+    fz_var(pix);
+    fz_var(dev);
+    fz_var(status);
+    fz_try(ctx)
+        {
+        for (row=0;row<bmp->height && status==0;row+=bandh)
+            {
+            fz_irect band;
+            fz_rect bandrect;
+
+            band=(*bbox);
+            band.y0=bbox->y0+row;
+            band.y1=band.y0+bandh;
+            if (band.y1>bbox->y1)
+                band.y1=bbox->y1;
+            fz_rect_from_irect(&bandrect,&band);
+            pix=fz_new_pixmap_with_bbox(ctx,colorspace,&band);
+            fz_clear_pixmap_with_value(ctx,pix,255);
+            dev=fz_new_draw_device(ctx,pix);
+            fz_run_display_list(ctx,list,dev,ctm,&bandrect,NULL);
+            fz_drop_device(ctx,dev);
+            dev=NULL;
+            status=bmpmupdf_pixmap_rows_to_bmp(bmp,row,ctx,pix);
+            fz_drop_pixmap(ctx,pix);
+            pix=NULL;
+            }
+        }
+    fz_always(ctx)
+        {
+        fz_drop_device(ctx,dev);
+        fz_drop_pixmap(ctx,pix);
+        }
+    fz_catch(ctx)
+        {
+        fz_rethrow(ctx);
+        }
+    return(status);
+    }
+
+
+/*
+** Render into a pixmap that wraps bmp's own data buffer and then drop the
+** alpha channel in place.  MuPDF 1.7 pixmaps always have an alpha channel,
+** so the draw device can't write the bitmap's format directly, but this way
+** no second page-sized buffer is allocated and no separate copy is made.
+** Only for WILLUSBITMAP_TYPE_NATIVE (top-down, unpadded rows), where the
+** packed pixels never land past the unconverted ones.
+** Throws MuPDF exceptions to the caller.
+*/
+static int bmpmupdf_render_in_place(WILLUSBITMAP *bmp,fz_context *ctx,fz_display_list *list,
+                                    fz_matrix *ctm,fz_rect *scissor,fz_irect *bbox,
+                                    fz_colorspace *colorspace)
+
+    {
+    fz_pixmap *pix;
+    fz_device *dev;
+    unsigned char *p,*d;
+    int i,n,ncomp,size;
+    static char *funcname="bmpmupdf_render_in_place";
+
+    bmp->width=bbox->x1-bbox->x0;
+    bmp->height=bbox->y1-bbox->y0;
+    bmp->bpp=(colorspace==fz_device_gray(ctx)) ? 8 : 24;
+    ncomp=(bmp->bpp==8) ? 2 : 4;
+    n=bmp->width*bmp->height;
+    size=ncomp*n;
+    /* Keep enough room for bmp_alloc() to change the bitmap type later */
+    if (size < bmp_bytewidth_win32(bmp)*bmp->height)
+        size = bmp_bytewidth_win32(bmp)*bmp->height;
+    if (bmp->data!=NULL && bmp->size_allocated<size)
+        willus_mem_free((double **)&bmp->data,funcname);
+    if (bmp->data==NULL)
+        {
+        willus_mem_alloc_warn((void **)&bmp->data,size,funcname,10);
+        bmp->size_allocated=size;
+        }
     pix=NULL;
+    dev=NULL;
     fz_var(pix);
-    fz_bound_page(ctx,page,&bounds);
-    ctm=fz_identity;
-    fz_scale(&ctm,dpp,dpp);
-//    ctm=fz_concat(ctm,fz_rotate(rotation));
-    bounds2=bounds;
-    fz_transform_rect(&bounds2,&ctm);
-    fz_round_rect(&bbox,&bounds2);
-//    ctm=fz_translate(0,-page->mediabox.y1);
-//    ctm=fz_concat(ctm,fz_scale(dpp,-dpp));
-//    ctm=fz_concat(ctm,fz_rotate(page->rotate));
-//    ctm=fz_concat(ctm,fz_rotate(0));
-//    bbox=fz_round_rect(fz_transform_rect(ctm,page->mediabox));
-//    pix=fz_new_pixmap_with_rect(colorspace,bbox);
+    fz_var(dev);
     fz_try(ctx)
         {
-        pix=fz_new_pixmap_with_bbox(ctx,colorspace,&bbox);
+        pix=fz_new_pixmap_with_bbox_and_data(ctx,colorspace,bbox,bmp->data);
         fz_clear_pixmap_with_value(ctx,pix,255);
         dev=fz_new_draw_device(ctx,pix);
-        if (list)
-            fz_run_display_list(ctx,list,dev,&ctm,&bounds2,NULL);
-        else
-            fz_run_page(ctx,page,dev,&ctm,NULL);
+        fz_run_display_list(ctx,list,dev,ctm,scissor,NULL);
+        }
+    fz_always(ctx)
+        {
         fz_drop_device(ctx,dev);
-        dev=NULL;
-        status=bmpmupdf_pixmap_to_bmp(bmp,ctx,pix);
+        /* Doesn't free the samples--they belong to bmp */
         fz_drop_pixmap(ctx,pix);
         }
     fz_catch(ctx)
         {
-        fz_drop_device(ctx,dev);
-        fz_drop_pixmap(ctx,pix);
-        fz_drop_display_list(ctx,list);
-        fz_drop_page(ctx,page);
-        fz_drop_document(ctx,doc);
-        fz_drop_context(ctx);
-        return(-5);
+        fz_rethrow(ctx);
         }
-    if (list)
-        fz_drop_display_list(ctx,list);
-    fz_drop_page(ctx,page);
-//    pdf_free_xref(xref);
-    fz_drop_document(ctx,doc);
-    fz_flush_warnings(ctx);
-    } /* fz_catch before registering handlers */
-    fz_catch(ctx) /* Error registering */
+    /* Strip alpha.  Destination never passes source, so go forward in place. */
+    p=d=bmp->data;
+    if (bmp->bpp==8)
+        {
+        for (i=0;i<n;i++,p+=2)
+            (*d++)=p[0];
+        for (i=0;i<256;i++)
+            bmp->red[i]=bmp->green[i]=bmp->blue[i]=i;
+        }
+    else
+        for (i=0;i<n;i++,p+=4,d+=3)
+            {
+            d[0]=p[0];
+            d[1]=p[1];
+            d[2]=p[2];
+            }
+    return(0);
+    }
+
+
+/*
+** Native-image fast path for scanned pages.
+**
+** NATIVEIMAGE is the user data of a device that is run over the page's
+** display list to see whether the page draws exactly one opaque image and
+** nothing else.  Invisible text (e.g. an OCR layer) is ignored.
+*/
+typedef struct
     {
-    status = -10;
+    int nimages;
+    int other;      /* Anything else was drawn (paths, text, shades, masks, ...) */
+    fz_image *image;
+    fz_matrix ctm;
+    } NATIVEIMAGE;
+
+static void nimg_fill_image(fz_context *ctx,fz_device *dev,fz_image *image,
+                            const fz_matrix *ctm,float alpha)
+
+    {
+    NATIVEIMAGE *ni;
+
+    ni=(NATIVEIMAGE *)dev->user;
+    ni->nimages++;
+    if (ni->nimages>1 || alpha<1.0)
+        {
+        ni->other=1;
+        return;
+        }
+    ni->image=fz_keep_image(ctx,image);
+    ni->ctm=(*ctm);
     }
-    fz_drop_context(ctx);
-//    fz_free_glyph_cache(glyphcache);
-//    fz_flush_warnings();
-    if (status<0)
-        return(status-10);
-    return(0);
+
+static void nimg_other(fz_device *dev)
+
+    {
+    ((NATIVEIMAGE *)dev->user)->other=1;
     }
 
+static void nimg_fill_path(fz_context *ctx,fz_device *dev,fz_path *path,int even_odd,
+                           const fz_matrix *ctm,fz_colorspace *cs,float *color,float alpha)
+    { nimg_other(dev); }
+static void nimg_stroke_path(fz_context *ctx,fz_device *dev,fz_path *path,
+                             fz_stroke_state *stroke,const fz_matrix *ctm,fz_colorspace *cs,
+                             float *color,float alpha)
+    { nimg_other(dev); }
+static void nimg_clip_path(fz_context *ctx,fz_device *dev,fz_path *path,const fz_rect *rect,
+                           int even_odd,const fz_matrix *ctm)
+    { nimg_other(dev); }
+static void nimg_clip_stroke_path(fz_context *ctx,fz_device *dev,fz_path *path,
+                                  const fz_rect *rect,fz_stroke_state *stroke,
+                                  const fz_matrix *ctm)
+    { nimg_other(dev); }
+static void nimg_fill_text(fz_context *ctx,fz_device *dev,fz_text *text,const fz_matrix *ctm,
+                           fz_colorspace *cs,float *color,float alpha)
+    { nimg_other(dev); }
+static void nimg_stroke_text(fz_context *ctx,fz_device *dev,fz_text *text,
+                             fz_stroke_state *stroke,const fz_matrix *ctm,fz_colorspace *cs,
+                             float *color,float alpha)
+    { nimg_other(dev); }
+static void nimg_clip_text(fz_context *ctx,fz_device *dev,fz_text *text,const fz_matrix *ctm,
+                           int accumulate)
+    { nimg_other(dev); }
+static void nimg_clip_stroke_text(fz_context *ctx,fz_device *dev,fz_text *text,
+                                  fz_stroke_state *stroke,const fz_matrix *ctm)
+    { nimg_other(dev); }
+static void nimg_fill_shade(fz_context *ctx,fz_device *dev,fz_shade *shade,
+                            const fz_matrix *ctm,float alpha)
+    { nimg_other(dev); }
+static void nimg_fill_image_mask(fz_context *ctx,fz_device *dev,fz_image *image,
+                                 const fz_matrix *ctm,fz_colorspace *cs,float *color,
+                                 float alpha)
+    { nimg_other(dev); }
+static void nimg_clip_image_mask(fz_context *ctx,fz_device *dev,fz_image *image,
+                                 const fz_rect *rect,const fz_matrix *ctm)
+    { nimg_other(dev); }
+static void nimg_begin_mask(fz_context *ctx,fz_device *dev,const fz_rect *rect,int luminosity,
+                            fz_colorspace *cs,float *bc)
+    { nimg_other(dev); }
+static void nimg_begin_group(fz_context *ctx,fz_device *dev,const fz_rect *rect,int isolated,
+                             int knockout,int blendmode,float alpha)
+    { nimg_other(dev); }
+static int nimg_begin_tile(fz_context *ctx,fz_device *dev,const fz_rect *area,
+                           const fz_rect *view,float xstep,float ystep,const fz_matrix *ctm,
+                           int id)
+    { nimg_other(dev); return(0); }
+
+
 /*
-** Returns 0 if got dimensions.
+** If the page is nothing but one image which fills the page box (bbox)
+** upright at the target resolution or at an integer multiple of it,
+** decode the image straight into bmp--no resampling, no anti-aliasing.
+** At n times the target resolution, n x n blocks of image pixels are
+** averaged (JPEG images are first reduced during decoding, see below).
+** Returns 1 if bmp was filled, 0 if the page has to be rendered.
+** Throws MuPDF exceptions to the caller.
 */
-int bmpmupdf_pdffile_width_and_height(char *filename,int pageno,double *width_in,double *height_in)
+static int bmpmupdf_native_image(WILLUSBITMAP *bmp,fz_context *ctx,fz_display_list *list,
+                                 fz_matrix *ctm,fz_irect *bbox,fz_colorspace *colorspace)
 
     {
-    fz_context *ctx;
-    fz_document *doc;
-    fz_page *page;
-    fz_display_list *list;
+    NATIVEIMAGE _ni,*ni;
     fz_device *dev;
-    fz_rect bounds;
-    int np;
+    fz_pixmap *pix,*pix2;
+    fz_matrix *m;
+    int w,h,iw,ih,k,l2,ncomp,status;
 
+    ni=&_ni;
+    ni->nimages=0;
+    ni->other=0;
+    ni->image=NULL;
+    w=bbox->x1-bbox->x0;
+    h=bbox->y1-bbox->y0;
+    if (w<=0 || h<=0)
+        return(0);
     dev=NULL;
-    list=NULL;
-    page=NULL;
-    doc=NULL;
-    if (pageno<1)
-        return(-99);
-    ctx = fz_new_context(NULL,NULL,FZ_STORE_DEFAULT);
-    if (!ctx)
-        return(-1);
+    pix=pix2=NULL;
+    status=0;
+    fz_var(dev);
+    fz_var(pix);
+    fz_var(pix2);
+    fz_var(status);
     fz_try(ctx)
-    {
-    fz_register_document_handlers(ctx);
-    fz_set_aa_level(ctx,8);
-    /* Sumatra version of MuPDF v1.4 -- use locally installed fonts */
-    pdf_install_load_system_font_funcs(ctx);
-    fz_try(ctx) { doc=fz_open_document(ctx,filename); }
-    fz_catch(ctx) 
-        { 
-        fz_drop_context(ctx);
-        return(-1);
+        {
+        dev=fz_new_device(ctx,ni);
+        dev->fill_path=nimg_fill_path;
+        dev->stroke_path=nimg_stroke_path;
+        dev->clip_path=nimg_clip_path;
+        dev->clip_stroke_path=nimg_clip_stroke_path;
+        dev->fill_text=nimg_fill_text;
+        dev->stroke_text=nimg_stroke_text;
+        dev->clip_text=nimg_clip_text;
+        dev->clip_stroke_text=nimg_clip_stroke_text;
+        dev->fill_shade=nimg_fill_shade;
+        dev->fill_image=nimg_fill_image;
+        dev->fill_image_mask=nimg_fill_image_mask;
+        dev->clip_image_mask=nimg_clip_image_mask;
+        dev->begin_mask=nimg_begin_mask;
+        dev->begin_group=nimg_begin_group;
+        dev->begin_tile=nimg_begin_tile;
+        fz_run_display_list(ctx,list,dev,ctm,NULL,NULL);
+        fz_drop_device(ctx,dev);
+        dev=NULL;
+        m=&ni->ctm;
+        /*
+        ** Exactly one opaque, upright image covering the page box (to a pixel).
+        ** Soft-masked and color-keyed images need compositing over white, so
+        ** they are left to the normal renderer.
+        */
+        if (ni->nimages!=1 || ni->other || ni->image->mask!=NULL || ni->image->usecolorkey
+              || fabs(m->b)>.001 || fabs(m->c)>.001 || m->a<=0. || m->d<=0.
+              || fabs(m->e-bbox->x0)>1. || fabs(m->f-bbox->y0)>1.
+              || fabs(m->e+m->a-bbox->x1)>1. || fabs(m->f+m->d-bbox->y1)>1.)
+            break;
+        iw=ni->image->w;
+        ih=ni->image->h;
+        k=(int)((double)iw/w+.5);
+        if (k<1 || k!=(int)((double)ih/h+.5) || abs(iw-k*w)>k || abs(ih-k*h)>k)
+            break;
+        /*
+        ** Ask for the image reduced by the largest power of two (up to 8)
+        ** that divides k.  For JPEG (DCT) images, MuPDF passes this on to
+        ** libjpeg (scale_num/scale_denom in filter-dct.c), which then skips
+        ** most of the IDCT work.  Asking for the target size instead could
+        ** get a power of two that doesn't divide k (e.g. 2 for k=3).
+        ** The -2 assumes MuPDF's rule of only reducing while the result
+        ** stays two pixels over the requested size (l2factor in
+        ** fz_new_pixmap_from_image()).  Nothing depends on that being
+        ** right:  the size that comes back (pix->w, pix->h) is checked
+        ** again below, the page is rendered normally if it no longer is an
+        ** integer multiple, and otherwise the remaining factor is done by
+        ** bmpmupdf_pixmap_reduce().
+        */
+        for (l2=0;l2<3 && (k%(2<<l2))==0;l2++);
+        if (l2>0)
+            pix=fz_new_pixmap_from_image(ctx,ni->image,(iw>>l2)-2,(ih>>l2)-2);
+        else
+            pix=fz_new_pixmap_from_image(ctx,ni->image,iw,ih);
+        iw=pix->w;
+        ih=pix->h;
+        k=(int)((double)iw/w+.5);
+        if (k<1 || k!=(int)((double)ih/h+.5) || abs(iw-k*w)>k || abs(ih-k*h)>k)
+            break;
+        if (pix->colorspace!=colorspace)
+            {
+            pix2=fz_new_pixmap(ctx,colorspace,iw,ih);
+            fz_convert_pixmap(ctx,pix2,pix);
+            fz_drop_pixmap(ctx,pix);
+            pix=pix2;
+            pix2=NULL;
+            }
+        ncomp=pix->n;
+        if (ncomp!=2 && ncomp!=4)
+            break;
+        /* Images carrying their own alpha (e.g. JPX) have to be composited too */
+        if (!bmpmupdf_pixmap_opaque(pix->samples,iw*ih,ncomp))
+            break;
+        bmp->width=w;
+        bmp->height=h;
+        bmp->bpp=(ncomp==2) ? 8 : 24;
+        bmp_alloc(bmp);
+        if (ncomp==2)
+            {
+            int i;
+            for (i=0;i<256;i++)
+                bmp->red[i]=bmp->green[i]=bmp->blue[i]=i;
+            }
+        bmpmupdf_pixmap_reduce(bmp,pix->samples,iw,ih,ncomp,k);
+        status=1;
         }
-    np=fz_count_pages(ctx,doc);
-    if (pageno>np)
-        return(-99);
-    fz_try(ctx) { page = fz_load_page(ctx,doc,pageno-1); }
-    fz_catch(ctx) 
+    fz_always(ctx)
         {
-        fz_drop_document(ctx,doc);
-        fz_drop_context(ctx);
-        return(-3);
+        fz_drop_device(ctx,dev);
+        fz_drop_pixmap(ctx,pix2);
+        fz_drop_pixmap(ctx,pix);
+        if (ni->image!=NULL)
+            fz_drop_image(ctx,ni->image);
         }
-    fz_try(ctx) { list=fz_new_display_list(ctx);
-                  dev=fz_new_list_device(ctx,list);
-                  fz_run_page(ctx,page,dev,&fz_identity,NULL);
-                }
     fz_catch(ctx)
         {
-        fz_drop_device(ctx,dev);
-        fz_drop_display_list(ctx,list);
-        fz_drop_page(ctx,page);
-        fz_drop_document(ctx,doc);
-        fz_drop_context(ctx);
-        return(-4);
+        fz_rethrow(ctx);
         }
-    fz_drop_device(ctx,dev);
-    dev=NULL;
-    fz_bound_page(ctx,page,&bounds);
-    if (width_in!=NULL)
-        (*width_in)=fabs(bounds.x1-bounds.x0)/72.;
-    if (height_in!=NULL)
-        (*height_in)=fabs(bounds.y1-bounds.y0)/72.;
-    fz_drop_display_list(ctx,list);
-    fz_drop_page(ctx,page);
-    fz_drop_document(ctx,doc);
-    } 
-    fz_catch(ctx) /* Error registering */
+    return(status);
+    }
+
+
+/*
+** 1 if every alpha sample (the last of each ncomp) of the n pixels is 255.
+*/
+static int bmpmupdf_pixmap_opaque(unsigned char *samples,int n,int ncomp)
+
     {
-    fz_drop_context(ctx);
-    return(-20);
+    int i;
+    unsigned char a;
+
+    samples += ncomp-1;
+    for (a=255,i=0;i<n;i++,samples+=ncomp)
+        a &= samples[0];
+    return(a==255);
     }
-    fz_drop_context(ctx);
-    return(0);
+
+
+/*
+** Average k x k blocks of the iw x ih pixmap samples (ncomp components
+** including alpha, which is dropped) into the already allocated bmp.
+** Blocks past the image edge (at most one pixel row/column of the bitmap,
+** see bmpmupdf_native_image()) re-use the last image row/column.
+*/
+static void bmpmupdf_pixmap_reduce(WILLUSBITMAP *bmp,unsigned char *samples,int iw,int ih,
+                                   int ncomp,int k)
+
+    {
+    int row,col,i,j,c,nc,k2;
+
+    nc=ncomp-1;
+    k2=k*k;
+    for (row=0;row<bmp->height;row++)
+        {
+        unsigned char *d;
+
+        d=bmp_rowptr_from_top(bmp,row);
+        for (col=0;col<bmp->width;col++,d+=nc)
+            for (c=0;c<nc;c++)
+                {
+                int sum;
+
+                for (sum=i=0;i<k;i++)
+                    {
+                    unsigned char *p;
+                    int y;
+
+                    y=row*k+i;
+                    if (y>=ih)
+                        y=ih-1;
+                    p=&samples[y*iw*ncomp];
+                    for (j=0;j<k;j++)
+                        {
+                        int x;
+
+                        x=col*k+j;
+                        if (x>=iw)
+                            x=iw-1;
+                        sum+=p[x*ncomp+c];
+                        }
+                    }
+                d[c]=(sum+k2/2)/k2;
+                }
+        }
     }
 
 
 static int bmpmupdf_pixmap_to_bmp(WILLUSBITMAP *bmp,fz_context *ctx,fz_pixmap *pixmap)
 
     {
-	unsigned char *p;
-	int ncomp,i,row,col;
+	int ncomp,i;
 
     bmp->width=fz_pixmap_width(ctx,pixmap);
     bmp->height=fz_pixmap_height(ctx,pixmap);
@@ -263,28 +977,52 @@ static int bmpmupdf_pixmap_to_bmp(WILLUSBITMAP *bmp,fz_context *ctx,fz_pixmap *p
     if (ncomp==2)
         for (i=0;i<256;i++)
             bmp->red[i]=bmp->green[i]=bmp->blue[i]=i;
+    return(bmpmupdf_pixmap_rows_to_bmp(bmp,0,ctx,pixmap));
+    }
+
+
+/*
+** Copy the pixmap rows into bmp starting at bitmap row row0 (the alpha
+** channel is dropped).  bmp must already be allocated.
+*/
+static int bmpmupdf_pixmap_rows_to_bmp(WILLUSBITMAP *bmp,int row0,fz_context *ctx,
+                                       fz_pixmap *pixmap)
+
+    {
+	unsigned char *p;
+	int ncomp,row,col,height;
+
+    ncomp=fz_pixmap_components(ctx,pixmap);
+    if (ncomp != 2 && ncomp != 4)
+        return(-1);
+    if ((ncomp==2 && bmp->bpp!=8) || (ncomp==4 && bmp->bpp!=24)
+          || fz_pixmap_width(ctx,pixmap)!=bmp->width)
+        return(-1);
+    height=fz_pixmap_height(ctx,pixmap);
+    if (row0+height > bmp->height)
+        height=bmp->height-row0;
 	p = fz_pixmap_samples(ctx,pixmap);
     if (ncomp==1)
-        for (row=0;row<bmp->height;row++)
+        for (row=0;row<height;row++)
             {
             unsigned char *dest;
-            dest=bmp_rowptr_from_top(bmp,row);
+            dest=bmp_rowptr_from_top(bmp,row0+row);
             memcpy(dest,p,bmp->width);
             p+=bmp->width;
             }
     else if (ncomp==2)
-        for (row=0;row<bmp->height;row++)
+        for (row=0;row<height;row++)
             {
             unsigned char *dest;
-            dest=bmp_rowptr_from_top(bmp,row);
+            dest=bmp_rowptr_from_top(bmp,row0+row);
             for (col=0;col<bmp->width;col++,dest++,p+=2)
                 dest[0]=p[0];
             }
     else
-        for (row=0;row<bmp->height;row++)
+        for (row=0;row<height;row++)
             {
             unsigned char *dest;
-            dest=bmp_rowptr_from_top(bmp,row);
+            dest=bmp_rowptr_from_top(bmp,row0+row);
             for (col=0;col<bmp->width;col++,dest+=ncomp-1,p+=ncomp)
                 memcpy(dest,p,ncomp-1);
             }
@@ -0,0 +1,526 @@
+/*
+** BMPSCAN.C    For WILLUSLIB, byte-scan kernels for rows of 8-bit
+**              (grayscale) bitmaps:  counting pixels darker than a
+**              threshold, accumulating them per column, and finding the
+**              first / last dark pixel in a row.
+**
+**              SSE2 and AVX2 (x86, chosen at run time) and NEON (ARM64)
+**              versions are used where available.  They give exactly the
+**              same results as the portable C versions.
+**
+** Part of willus.com general purpose C code library.
+**
+** Copyright (C) 2015  http://willus.com
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU Affero General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+*/
+#include <stdio.h>
+#include "willus.h"
+
+#if (defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__)))
+#define BMPSCAN_SSE2
+#include <emmintrin.h>
+#if (__GNUC__ >= 5 || defined(__clang__))
+#define BMPSCAN_AVX2
+#include <immintrin.h>
+#endif
+#endif
+#if (defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON))
+#define BMPSCAN_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+** The kernels count bytes <= tm1 (= threshold-1, so the threshold is
+** always 1 - 255 by the time they are called).
+*/
+typedef struct
+    {
+    char *name;
+    int  (*count_below)(unsigned char *p,int n,unsigned char tm1);
+    void (*accumulate_below)(int *count,unsigned char *p,int n,unsigned char tm1);
+    int  (*first_below)(unsigned char *p,int n,unsigned char tm1);
+    int  (*last_below)(unsigned char *p,int n,unsigned char tm1);
+    } BMPSCANKERNELS;
+
+static BMPSCANKERNELS *bmpscan_kernels(void);
+
+
+/*
+** Returns the number of bytes in p[0..n-1] less than thresh.
+*/
+int bmpscan_count_below(unsigned char *p,int n,int thresh)
+
+    {
+    if (n<=0 || thresh<=0)
+        return(0);
+    if (thresh>255)
+        return(n);
+    return(bmpscan_kernels()->count_below(p,n,thresh-1));
+    }
+
+
+/*
+** count[i] += (p[i] < thresh ? 1 : 0) for i = 0 .. n-1
+*/
+void bmpscan_accumulate_below(int *count,unsigned char *p,int n,int thresh)
+
+    {
+    int i;
+
+    if (n<=0 || thresh<=0)
+        return;
+    if (thresh>255)
+        {
+        for (i=0;i<n;i++)
+            count[i]++;
+        return;
+        }
+    bmpscan_kernels()->accumulate_below(count,p,n,thresh-1);
+    }
+
+
+/*
+** Returns the index of the first byte in p[0..n-1] less than thresh, n if none.
+*/
+int bmpscan_first_below(unsigned char *p,int n,int thresh)
+
+    {
+    if (n<=0 || thresh<=0)
+        return(n<0 ? 0 : n);
+    if (thresh>255)
+        return(0);
+    return(bmpscan_kernels()->first_below(p,n,thresh-1));
+    }
+
+
+/*
+** Returns the index of the last byte in p[0..n-1] less than thresh, -1 if none.
+*/
+int bmpscan_last_below(unsigned char *p,int n,int thresh)
+
+    {
+    if (n<=0 || thresh<=0)
+        return(-1);
+    if (thresh>255)
+        return(n-1);
+    return(bmpscan_kernels()->last_below(p,n,thresh-1));
+    }
+
+
+/*
+** Name of the kernel set in use ("c", "sse2", "avx2", or "neon").
+*/
+char *bmpscan_kernel_name(void)
+
+    {
+    return(bmpscan_kernels()->name);
+    }
+
+
+/*
+** Portable C versions
+*/
+static int bmpscan_count_below_c(unsigned char *p,int n,unsigned char tm1)
+
+    {
+    int i,c;
+
+    for (c=i=0;i<n;i++)
+        if (p[i]<=tm1)
+            c++;
+    return(c);
+    }
+
+
+static void bmpscan_accumulate_below_c(int *count,unsigned char *p,int n,unsigned char tm1)
+
+    {
+    int i;
+
+    for (i=0;i<n;i++)
+        if (p[i]<=tm1)
+            count[i]++;
+    }
+
+
+static int bmpscan_first_below_c(unsigned char *p,int n,unsigned char tm1)
+
+    {
+    int i;
+
+    for (i=0;i<n;i++)
+        if (p[i]<=tm1)
+            break;
+    return(i);
+    }
+
+
+static int bmpscan_last_below_c(unsigned char *p,int n,unsigned char tm1)
+
+    {
+    int i;
+
+    for (i=n-1;i>=0;i--)
+        if (p[i]<=tm1)
+            break;
+    return(i);
+    }
+
+
+#ifdef BMPSCAN_SSE2
+/*
+** SSE2:  p <= tm1 (unsigned) <==> min(p,tm1) == p
+*/
+static int bmpscan_count_below_sse2(unsigned char *p,int n,unsigned char tm1)
+
+    {
+    __m128i vt,zero;
+    int i,c;
+
+    vt=_mm_set1_epi8((char)tm1);
+    zero=_mm_setzero_si128();
+    for (c=i=0;n-i>=16;)
+        {
+        __m128i acc;
+        int k;
+
+        /* Byte counters, so flush at most every 255 blocks */
+        acc=_mm_setzero_si128();
+        for (k=0;k<255 && n-i>=16;k++,i+=16)
+            {
+            __m128i v;
+
+            v=_mm_loadu_si128((__m128i *)&p[i]);
+            acc=_mm_sub_epi8(acc,_mm_cmpeq_epi8(_mm_min_epu8(v,vt),v));
+            }
+        acc=_mm_sad_epu8(acc,zero);
+        c+=_mm_cvtsi128_si32(acc)+_mm_cvtsi128_si32(_mm_srli_si128(acc,8));
+        }
+    return(c+bmpscan_count_below_c(&p[i],n-i,tm1));
+    }
+
+
+static void bmpscan_accumulate_below_sse2(int *count,unsigned char *p,int n,unsigned char tm1)
+
+    {
+    __m128i vt,zero,one;
+    int i;
+
+    vt=_mm_set1_epi8((char)tm1);
+    zero=_mm_setzero_si128();
+    one=_mm_set1_epi8(1);
+    for (i=0;n-i>=16;i+=16)
+        {
+        __m128i v,m,lo,hi,*c;
+
+        v=_mm_loadu_si128((__m128i *)&p[i]);
+        m=_mm_and_si128(_mm_cmpeq_epi8(_mm_min_epu8(v,vt),v),one);
+        lo=_mm_unpacklo_epi8(m,zero);
+        hi=_mm_unpackhi_epi8(m,zero);
+        c=(__m128i *)&count[i];
+        _mm_storeu_si128(&c[0],_mm_add_epi32(_mm_loadu_si128(&c[0]),_mm_unpacklo_epi16(lo,zero)));
+        _mm_storeu_si128(&c[1],_mm_add_epi32(_mm_loadu_si128(&c[1]),_mm_unpackhi_epi16(lo,zero)));
+        _mm_storeu_si128(&c[2],_mm_add_epi32(_mm_loadu_si128(&c[2]),_mm_unpacklo_epi16(hi,zero)));
+        _mm_storeu_si128(&c[3],_mm_add_epi32(_mm_loadu_si128(&c[3]),_mm_unpackhi_epi16(hi,zero)));
+        }
+    bmpscan_accumulate_below_c(&count[i],&p[i],n-i,tm1);
+    }
+
+
+static int bmpscan_first_below_sse2(unsigned char *p,int n,unsigned char tm1)
+
+    {
+    __m128i vt;
+    int i;
+
+    vt=_mm_set1_epi8((char)tm1);
+    for (i=0;n-i>=16;i+=16)
+        {
+        __m128i v;
+        int mask;
+
+        v=_mm_loadu_si128((__m128i *)&p[i]);
+        mask=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v,vt),v));
+        if (mask)
+            return(i+__builtin_ctz(mask));
+        }
+    return(i+bmpscan_first_below_c(&p[i],n-i,tm1));
+    }
+
+
+static int bmpscan_last_below_sse2(unsigned char *p,int n,unsigned char tm1)
+
+    {
+    __m128i vt;
+    int i;
+
+    vt=_mm_set1_epi8((char)tm1);
+    for (i=n;i>=16;)
+        {
+        __m128i v;
+        int mask;
+
+        i-=16;
+        v=_mm_loadu_si128((__m128i *)&p[i]);
+        mask=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v,vt),v));
+        if (mask)
+            return(i+31-__builtin_clz(mask));
+        }
+    return(bmpscan_last_below_c(p,i,tm1));
+    }
+#endif /* BMPSCAN_SSE2 */
+
+
+#ifdef BMPSCAN_AVX2
+#define BMPSCAN_AVX2_FUNC __attribute__((target("avx2")))
+
+BMPSCAN_AVX2_FUNC
+static int bmpscan_count_below_avx2(unsigned char *p,int n,unsigned char tm1)
+
+    {
+    __m256i vt,zero;
+    int i,c;
+
+    vt=_mm256_set1_epi8((char)tm1);
+    zero=_mm256_setzero_si256();
+    for (c=i=0;n-i>=32;)
+        {
+        __m256i acc;
+        __m128i s;
+        int k;
+
+        acc=_mm256_setzero_si256();
+        for (k=0;k<255 && n-i>=32;k++,i+=32)
+            {
+            __m256i v;
+
+            v=_mm256_loadu_si256((__m256i *)&p[i]);
+            acc=_mm256_sub_epi8(acc,_mm256_cmpeq_epi8(_mm256_min_epu8(v,vt),v));
+            }
+        acc=_mm256_sad_epu8(acc,zero);
+        s=_mm_add_epi64(_mm256_castsi256_si128(acc),_mm256_extracti128_si256(acc,1));
+        c+=_mm_cvtsi128_si32(s)+_mm_cvtsi128_si32(_mm_srli_si128(s,8));
+        }
+    return(c+bmpscan_count_below_c(&p[i],n-i,tm1));
+    }
+
+
+BMPSCAN_AVX2_FUNC
+static void bmpscan_accumulate_below_avx2(int *count,unsigned char *p,int n,unsigned char tm1)
+
+    {
+    __m256i vt,one;
+    int i;
+
+    vt=_mm256_set1_epi8((char)tm1);
+    one=_mm256_set1_epi8(1);
+    for (i=0;n-i>=32;i+=32)
+        {
+        __m256i v,m,*c;
+        __m128i lo,hi;
+
+        v=_mm256_loadu_si256((__m256i *)&p[i]);
+        m=_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v,vt),v),one);
+        lo=_mm256_castsi256_si128(m);
+        hi=_mm256_extracti128_si256(m,1);
+        c=(__m256i *)&count[i];
+        _mm256_storeu_si256(&c[0],_mm256_add_epi32(_mm256_loadu_si256(&c[0]),
+                                                   _mm256_cvtepu8_epi32(lo)));
+        _mm256_storeu_si256(&c[1],_mm256_add_epi32(_mm256_loadu_si256(&c[1]),
+                                                   _mm256_cvtepu8_epi32(_mm_srli_si128(lo,8))));
+        _mm256_storeu_si256(&c[2],_mm256_add_epi32(_mm256_loadu_si256(&c[2]),
+                                                   _mm256_cvtepu8_epi32(hi)));
+        _mm256_storeu_si256(&c[3],_mm256_add_epi32(_mm256_loadu_si256(&c[3]),
+                                                   _mm256_cvtepu8_epi32(_mm_srli_si128(hi,8))));
+        }
+    bmpscan_accumulate_below_c(&count[i],&p[i],n-i,tm1);
+    }
+
+
+BMPSCAN_AVX2_FUNC
+static int bmpscan_first_below_avx2(unsigned char *p,int n,unsigned char tm1)
+
+    {
+    __m256i vt;
+    int i;
+
+    vt=_mm256_set1_epi8((char)tm1);
+    for (i=0;n-i>=32;i+=32)
+        {
+        __m256i v;
+        unsigned int mask;
+
+        v=_mm256_loadu_si256((__m256i *)&p[i]);
+        mask=(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v,vt),v));
+        if (mask)
+            return(i+__builtin_ctz(mask));
+        }
+    return(i+bmpscan_first_below_c(&p[i],n-i,tm1));
+    }
+
+
+BMPSCAN_AVX2_FUNC
+static int bmpscan_last_below_avx2(unsigned char *p,int n,unsigned char tm1)
+
+    {
+    __m256i vt;
+    int i;
+
+    vt=_mm256_set1_epi8((char)tm1);
+    for (i=n;i>=32;)
+        {
+        __m256i v;
+        unsigned int mask;
+
+        i-=32;
+        v=_mm256_loadu_si256((__m256i *)&p[i]);
+        mask=(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v,vt),v));
+        if (mask)
+            return(i+31-__builtin_clz(mask));
+        }
+    return(bmpscan_last_below_c(p,i,tm1));
+    }
+#endif /* BMPSCAN_AVX2 */
+
+
+#ifdef BMPSCAN_NEON
+static int bmpscan_count_below_neon(unsigned char *p,int n,unsigned char tm1)
+
+    {
+    uint8x16_t vt;
+    int i,c;
+
+    vt=vdupq_n_u8(tm1);
+    for (c=i=0;n-i>=16;)
+        {
+        uint8x16_t acc;
+        int k;
+
+        acc=vdupq_n_u8(0);
+        for (k=0;k<255 && n-i>=16;k++,i+=16)
+            acc=vsubq_u8(acc,vcleq_u8(vld1q_u8(&p[i]),vt));
+        c+=vaddlvq_u8(acc);
+        }
+    return(c+bmpscan_count_below_c(&p[i],n-i,tm1));
+    }
+
+
+static void bmpscan_accumulate_below_neon(int *count,unsigned char *p,int n,unsigned char tm1)
+
+    {
+    uint8x16_t vt,one;
+    int i;
+
+    vt=vdupq_n_u8(tm1);
+    one=vdupq_n_u8(1);
+    for (i=0;n-i>=16;i+=16)
+        {
+        uint8x16_t m;
+        uint16x8_t lo,hi;
+        int *c;
+
+        m=vandq_u8(vcleq_u8(vld1q_u8(&p[i]),vt),one);
+        lo=vmovl_u8(vget_low_u8(m));
+        hi=vmovl_u8(vget_high_u8(m));
+        c=&count[i];
+        vst1q_s32(&c[0],vaddq_s32(vld1q_s32(&c[0]),vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(lo)))));
+        vst1q_s32(&c[4],vaddq_s32(vld1q_s32(&c[4]),vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(lo)))));
+        vst1q_s32(&c[8],vaddq_s32(vld1q_s32(&c[8]),vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(hi)))));
+        vst1q_s32(&c[12],vaddq_s32(vld1q_s32(&c[12]),vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(hi)))));
+        }
+    bmpscan_accumulate_below_c(&count[i],&p[i],n-i,tm1);
+    }
+
+
+static int bmpscan_first_below_neon(unsigned char *p,int n,unsigned char tm1)
+
+    {
+    uint8x16_t vt;
+    int i;
+
+    vt=vdupq_n_u8(tm1);
+    for (i=0;n-i>=16;i+=16)
+        if (vmaxvq_u8(vcleq_u8(vld1q_u8(&p[i]),vt)))
+            return(i+bmpscan_first_below_c(&p[i],16,tm1));
+    return(i+bmpscan_first_below_c(&p[i],n-i,tm1));
+    }
+
+
+static int bmpscan_last_below_neon(unsigned char *p,int n,unsigned char tm1)
+
+    {
+    uint8x16_t vt;
+    int i;
+
+    vt=vdupq_n_u8(tm1);
+    for (i=n;i>=16;)
+        {
+        i-=16;
+        if (vmaxvq_u8(vcleq_u8(vld1q_u8(&p[i]),vt)))
+            return(i+bmpscan_last_below_c(&p[i],16,tm1));
+        }
+    return(bmpscan_last_below_c(p,i,tm1));
+    }
+#endif /* BMPSCAN_NEON */
+
+
+/*
+** Pick the kernel set once, on first use.  (If two threads get here at
+** the same time, they both store the same answer.)
+*/
+static BMPSCANKERNELS *bmpscan_kernels(void)
+
+    {
+    static BMPSCANKERNELS *kernels=NULL;
+    static BMPSCANKERNELS c_kernels=
+        {"c",bmpscan_count_below_c,bmpscan_accumulate_below_c,
+         bmpscan_first_below_c,bmpscan_last_below_c};
+#ifdef BMPSCAN_SSE2
+    static BMPSCANKERNELS sse2_kernels=
+        {"sse2",bmpscan_count_below_sse2,bmpscan_accumulate_below_sse2,
+         bmpscan_first_below_sse2,bmpscan_last_below_sse2};
+#endif
+#ifdef BMPSCAN_AVX2
+    static BMPSCANKERNELS avx2_kernels=
+        {"avx2",bmpscan_count_below_avx2,bmpscan_accumulate_below_avx2,
+         bmpscan_first_below_avx2,bmpscan_last_below_avx2};
+#endif
+#ifdef BMPSCAN_NEON
+    static BMPSCANKERNELS neon_kernels=
+        {"neon",bmpscan_count_below_neon,bmpscan_accumulate_below_neon,
+         bmpscan_first_below_neon,bmpscan_last_below_neon};
+#endif
+
+    if (kernels==NULL)
+        {
+        BMPSCANKERNELS *k;
+
+        k=&c_kernels;
+#ifdef BMPSCAN_SSE2
+        k=&sse2_kernels;
+#endif
+#ifdef BMPSCAN_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            k=&avx2_kernels;
+#endif
+#ifdef BMPSCAN_NEON
+        k=&neon_kernels;
+#endif
+        kernels=k;
+        }
+    return(kernels);
+    }
@@ -218,6 +218,8 @@ typedef double  real;
 **     HAVE_GOCR_LIB
 **     HAVE_LEPTONICA_LIB
 **     HAVE_TESSERACT_LIB
+**     HAVE_PTHREAD_LIB (POSIX threads--used to render PDF pages ahead and to
+**                       split up page analysis)
 **
 ** COMMENT OUT DEFINE STATEMENTS BELOW AS DESIRED.
 **
@@ -258,6 +260,9 @@ typedef double  real;
 #ifndef HAVE_TESSERACT_LIB
 #define HAVE_TESSERACT_LIB
 #endif
+#if (!defined(HAVE_PTHREAD_LIB) && !defined(HAVE_WIN32_API) && !defined(MSDOS))
+#define HAVE_PTHREAD_LIB
+#endif
 /*
 ** Defines for presence of Jasper and GSL (Gnu Scientific Library).
 ** Define these if you have these libs.  Default is not to define them.
@@ -442,6 +447,8 @@ unsigned char *bmp_rowptr_from_top(WILLUSBITMAP *bmp,int row);
 void bmp_crop(WILLUSBITMAP *bmp,int x0,int y0_from_top,int width,int height);
 void bmp_crop_ex(WILLUSBITMAP *dst,WILLUSBITMAP *src,int x0,int y0_from_top,int width,int height);
 void bmp_rotate_fast(WILLUSBITMAP *dst,double degrees,int expand);
+void bmp_rotate_fast_ex(WILLUSBITMAP *dst,WILLUSBITMAP *src,double degrees,int expand);
+void bmp_swap(WILLUSBITMAP *bmp1,WILLUSBITMAP *bmp2);
 int  bmp_rotate_right_angle(WILLUSBITMAP *bmp,int degrees);
 int  bmp_rotate_90(WILLUSBITMAP *bmp);
 int  bmp_rotate_270(WILLUSBITMAP *bmp);
@@ -474,16 +481,10 @@ void bmp_integer_resample(WILLUSBITMAP *dest,WILLUSBITMAP *src,int n);
 void bmp_draw_filled_rect(WILLUSBITMAP *bmp,int col1,int row1,int col2,int row2,
                           int r,int g,int b);
 /*
-** As of Sept. 2013, the floating-point bmp_resample() is only faster than
-** the fixed-point version on 64-bit compiles.  For 32-bit Intel (and ARM),
-** the fixed-point version is considerably faster.
-** (__x86_64 is automatically pre-defined for 64-bit gcc compiles on Intel CPUs.)
+** bmp_resample() is fixed point on every platform now, so there is
+** no longer a faster variant to pick.
 */
-#ifdef __x86_64
 #define bmp_resample_optimum_performance bmp_resample
-#else
-#define bmp_resample_optimum_performance bmp_resample_fixed_point
-#endif
 int  bmp_resample(WILLUSBITMAP *dest,WILLUSBITMAP *src,double x1,double y1,
                   double x2,double y2,int newwidth,int newheight);
 int  bmp_resample_fixed_point(WILLUSBITMAP *dest,WILLUSBITMAP *src,double fx1,double fy1,
@@ -493,6 +494,7 @@ void bmp_invert(WILLUSBITMAP *bmp);
 void bmp_overlay(WILLUSBITMAP *dest,WILLUSBITMAP *src,int x0,int y0_from_top,
                  int *dbgc,int *dfgc,int *sbgc,int *sfgc);
 void bmp_contrast_adjust(WILLUSBITMAP *dest,WILLUSBITMAP *src,double contrast);
+void bmp_contrast_lut(unsigned char *newval,double contrast);
 void bmp_gamma_correct(WILLUSBITMAP *dest,WILLUSBITMAP *src,double gamma);
 void bmp_color_xform(WILLUSBITMAP *dest,WILLUSBITMAP *src,unsigned char *newval);
 int  bmp_is_grayscale(WILLUSBITMAP *bmp);
@@ -874,6 +876,27 @@ int     wzprintf(WZFILE *wz,char *fmt,...);
 int     wzcompressed(WZFILE *wz);
 WZFILE *wzuncompressed(FILE *out);
 
+/* bmpscan.c */
+int  bmpscan_count_below(unsigned char *p,int n,int thresh);
+void bmpscan_accumulate_below(int *count,unsigned char *p,int n,int thresh);
+int  bmpscan_first_below(unsigned char *p,int n,int thresh);
+int  bmpscan_last_below(unsigned char *p,int n,int thresh);
+char *bmpscan_kernel_name(void);
+
+/* wpool.c */
+/*
+** Pool of worker threads for splitting a loop over indices 0..n-1.
+*/
+typedef struct
+    {
+    int nthreads;
+    void *sys;      /* Threads and locks (private to wpool.c) */
+    } WPOOL;
+void wpool_init(WPOOL *pool);
+int  wpool_start(WPOOL *pool,int nthreads);
+void wpool_run(WPOOL *pool,void (*func)(void *data,int i),void *data,int n);
+void wpool_end(WPOOL *pool);
+
 /* dtcompress.c */
 /* From Dirk Thierbach, 31-Dec-2013, avoids custom mod to Z-lib */
 typedef void *compress_handle;
@@ -1530,16 +1553,114 @@ void wtextchars_sort_horizontally_by_position(WTEXTCHARS *wtc);
 void wtextchar_array_sort_horizontally_by_position(WTEXTCHAR *x,int n);
 
 
+/*
+** WMUPDFDOC is an open MuPDF document "session".  The MuPDF context, document
+** and resource store stay alive from wmupdfdoc_open() until wmupdfdoc_close(),
+** so that all page renders, info fields, and outline reads of the same source
+** file share a single open (and xref parse) of the file.
+** (ctx and doc are really fz_context * and fz_document *.  They are declared
+**  as void * so that willus.h doesn't depend on the MuPDF headers.)
+**
+** The session also caches the display lists of the most recently used pages
+** so that rendering a page (at any dpi) and extracting its text replay the
+** same list instead of interpreting the page contents again.
+*/
+#define WMUPDFDOC_MAXLISTS 4
+typedef struct
+    {
+    int pageno;        /* 1 = first page, 0 = empty slot */
+    void *list;        /* fz_display_list * */
+    double bounds[4];  /* Page bounds in points:  x0,y0,x1,y1 */
+    int inuse;         /* Number of callers using the list--can't be dropped if > 0 */
+    int lastused;
+    } WMUPDFDOCLIST;
+
+/*
+** Document metadata read in one pass by wmupdfdoc_harvest().  Once valid,
+** wmupdfdoc_info_field(), wpdfoutline_read_from_pdfdoc() and
+** bmpmupdf_pdfdoc_width_and_height() are answered from this record.
+*/
+typedef struct
+    {
+    int valid;
+    char author[256];
+    char title[256];
+    char cdate[128];
+    WPDFOUTLINE *outline; /* Handed to the first wpdfoutline_read_from_pdfdoc() call */
+    double *pagesize;     /* Width, height (points) of each page, -1 if unknown */
+    } WMUPDFMETA;
+
+typedef struct
+    {
+    char filename[MAXFILENAMELEN];
+    void *ctx;
+    void *doc;
+    int np;    /* Page count */
+    WMUPDFMETA meta;
+    WMUPDFDOCLIST dlist[WMUPDFDOC_MAXLISTS];
+    int dlist_count;
+    int dlist_hits;
+    int dlist_misses;
+    void *renderq;  /* WMUPDFRENDERQ * if pages are being rendered ahead */
+    } WMUPDFDOC;
+
+/*
+** Render-ahead queue (bmpmupdf.c):  worker threads, each with its own clone
+** of a document session, render pages that the caller will need soon.
+** bmpmupdf_pdfdoc_to_bmp() on the session picks up a queued page if it was
+** requested at the same dpi and bpp.
+*/
+typedef struct
+    {
+    int pageno;     /* 0 = free slot */
+    double dpi;
+    int bpp;
+    int state;      /* 1 = queued, 2 = rendering, 3 = done */
+    int seq;        /* Order in which pages were requested */
+    int status;     /* Return value of bmpmupdf_pdfdoc_to_bmp() */
+    WILLUSBITMAP bmp;
+    } WMUPDFRENDERPAGE;
+
+typedef struct
+    {
+    WMUPDFDOC *mdoc;
+    int nthreads;
+    int depth;      /* Max pages queued or rendered ahead */
+    WMUPDFRENDERPAGE *page;
+    int seq;
+    int quit;
+    int hits;       /* Pages handed back already rendered */
+    int misses;     /* Pages the caller had to render itself */
+    void *sys;      /* Threads and locks (private to bmpmupdf.c) */
+    } WMUPDFRENDERQ;
+
 /* bmpmupdf.c */
 /* Mupdf / bitmap functions */
 #ifdef HAVE_MUPDF_LIB
 int bmpmupdf_pdffile_to_bmp(WILLUSBITMAP *bmp,char *filename,int pageno,double dpi,int bpp);
+int bmpmupdf_pdfdoc_to_bmp(WILLUSBITMAP *bmp,WMUPDFDOC *mdoc,int pageno,double dpi,int bpp);
 int bmpmupdf_pdffile_width_and_height(char *filename,int pageno,double *width_in,double *height_in);
+int bmpmupdf_pdfdoc_width_and_height(WMUPDFDOC *mdoc,int pageno,double *width_in,
+                                     double *height_in);
+void bmpmupdf_renderq_init(WMUPDFRENDERQ *q);
+int  bmpmupdf_renderq_start(WMUPDFRENDERQ *q,WMUPDFDOC *mdoc,int nthreads,int depth);
+void bmpmupdf_renderq_request(WMUPDFRENDERQ *q,int pageno,double dpi,int bpp);
+void bmpmupdf_renderq_end(WMUPDFRENDERQ *q);
 #endif /* HAVE_MUPDF_LIB */
 
 /* wmupdf.c */
 /* Mupdf support functions */
 #ifdef HAVE_MUPDF_LIB
+#define WMUPDF_STORE_MAX_MB 2048
+void wmupdfdoc_set_store_size(int megabytes);
+void wmupdfdoc_init(WMUPDFDOC *mdoc);
+int  wmupdfdoc_open(WMUPDFDOC *mdoc,char *filename,char *password);
+int  wmupdfdoc_clone(WMUPDFDOC *dst,WMUPDFDOC *src,char *password);
+int  wmupdfdoc_harvest(WMUPDFDOC *mdoc);
+void wmupdfdoc_close(WMUPDFDOC *mdoc);
+void *wmupdfdoc_display_list_get(WMUPDFDOC *mdoc,int pageno,double *bounds);
+void wmupdfdoc_display_list_release(WMUPDFDOC *mdoc,void *list);
+int  wmupdfdoc_info_field(WMUPDFDOC *mdoc,char *label,char *buf,int maxlen);
 int  wmupdf_numpages(char *filename);
 int  wmupdf_info_field(char *infile,char *label,char *buf,int maxlen);
 int  wmupdf_remake_pdf(char *infile,char *outfile,WPDFPAGEINFO *pageinfo,int use_forms,
@@ -1548,7 +1669,9 @@ int  wmupdf_remake_pdf(char *infile,char *outfile,WPDFPAGEINFO *pageinfo,int use
 int  wtextchars_fill_from_page(WTEXTCHARS *wtc,char *filename,int pageno,char *password);
 int  wtextchars_fill_from_page_ex(WTEXTCHARS *wtc,char *filename,int pageno,char *password,
                                  int boundingbox);
+int  wtextchars_fill_from_pdfdoc(WTEXTCHARS *wtc,WMUPDFDOC *mdoc,int pageno,int boundingbox);
 WPDFOUTLINE *wpdfoutline_read_from_pdf_file(char *filename);
+WPDFOUTLINE *wpdfoutline_read_from_pdfdoc(WMUPDFDOC *mdoc);
 #endif /* HAVE_MUPDF_LIB */
 
 /* wmupdfinfo.c */
@@ -29,11 +29,16 @@
 
 #ifdef HAVE_MUPDF_LIB
 #include <mupdf/pdf.h>
+#ifdef HAVE_PTHREAD_LIB
+#include <pthread.h>
+#endif
 void pdf_install_load_system_font_funcs(fz_context *ctx);
 
 static void info_update(fz_context *ctx,pdf_document *xref,char *producer,char *author,char *title);
 static void dict_put_string(fz_context *ctx,pdf_document *doc,pdf_obj *dict,char *key,char *string);
 static void wmupdf_page_bbox(fz_context *ctx,pdf_obj *srcpage,double *bbox_array);
+static void wmupdf_page_size(fz_context *ctx,pdf_document *xref,int pageno,double *size);
+static pdf_obj *wmupdf_inherited_item(fz_context *ctx,pdf_obj *node,char *key);
 static int wmupdf_pdfdoc_newpages(pdf_document *xref,fz_context *ctx,WPDFPAGEINFO *pageinfo,
                                   int use_forms,WPDFOUTLINE *wpdfoutline,FILE *out);
 static void set_clip_array(double *xclip,double *yclip,double rot_deg,double width,double height);
@@ -58,6 +63,14 @@ static void matrix_unity(double m[][3],double val);
 static void matrix_set_all(double m[][3],double val);
 static void matrix_translate(double m[][3],double x,double y);
 static void matrix_mul(double dst[][3],double src[][3]);
+static int wmupdfdoc_open_document(WMUPDFDOC *mdoc,fz_context *ctx,char *filename,char *password);
+static size_t wmupdf_store_size=FZ_STORE_DEFAULT;
+#ifdef HAVE_PTHREAD_LIB
+static fz_locks_context *wmupdf_locks(void);
+static void wmupdf_locks_init(void);
+static void wmupdf_lock(void *user,int lock);
+static void wmupdf_unlock(void *user,int lock);
+#endif
 static void matrix_rotate(double m[][3],double deg);
 static void matrix_xymul(double m[][3],double *x,double *y);
 
@@ -74,6 +87,515 @@ static pdf_obj *anchor_reference(fz_context *ctx,pdf_document *doc,int pageno);
 static pdf_obj *pdf_new_string_utf8(fz_context *ctx,pdf_document *doc,char *string);
 
 
+/*
+** Size limit of the resource store (decoded fonts, images, glyphs) of
+** sessions opened after this call.  Threads working on a session (see
+** wmupdfdoc_clone()) share its store.  <= 0 = MuPDF default.  Limits over
+** WMUPDF_STORE_MAX_MB are capped so the byte count fits a 32-bit size_t.
+*/
+void wmupdfdoc_set_store_size(int megabytes)
+
+    {
+    if (megabytes<=0)
+        wmupdf_store_size = FZ_STORE_DEFAULT;
+    else
+        wmupdf_store_size = (size_t)(megabytes > WMUPDF_STORE_MAX_MB ? WMUPDF_STORE_MAX_MB
+                                                                     : megabytes) << 20;
+    }
+
+
+void wmupdfdoc_init(WMUPDFDOC *mdoc)
+
+    {
+    int i;
+
+    mdoc->filename[0]='\0';
+    mdoc->ctx=NULL;
+    mdoc->doc=NULL;
+    mdoc->np=0;
+    mdoc->meta.valid=0;
+    mdoc->meta.author[0]=mdoc->meta.title[0]=mdoc->meta.cdate[0]='\0';
+    mdoc->meta.outline=NULL;
+    mdoc->meta.pagesize=NULL;
+    for (i=0;i<WMUPDFDOC_MAXLISTS;i++)
+        {
+        mdoc->dlist[i].pageno=0;
+        mdoc->dlist[i].list=NULL;
+        mdoc->dlist[i].inuse=0;
+        mdoc->dlist[i].lastused=0;
+        }
+    mdoc->dlist_count=0;
+    mdoc->dlist_hits=0;
+    mdoc->dlist_misses=0;
+    mdoc->renderq=NULL;
+    }
+
+
+/*
+** Open a MuPDF document session on filename.  The session stays open until
+** wmupdfdoc_close() is called.  mdoc must have been initialized with
+** wmupdfdoc_init().
+**
+** Returns 0 on success, -1 if the context can't be created, -2 if the
+** file can't be opened, -3 if the password doesn't authenticate.
+*/
+int wmupdfdoc_open(WMUPDFDOC *mdoc,char *filename,char *password)
+
+    {
+    fz_context *ctx;
+
+    wmupdfdoc_close(mdoc);
+#ifdef HAVE_PTHREAD_LIB
+    /* Locks allow the session to be cloned (see wmupdfdoc_clone()) */
+    ctx = fz_new_context(NULL,wmupdf_locks(),wmupdf_store_size);
+#else
+    ctx = fz_new_context(NULL,NULL,wmupdf_store_size);
+#endif
+    if (!ctx)
+        return(-1);
+    fz_try(ctx)
+        {
+        fz_register_document_handlers(ctx);
+        fz_set_aa_level(ctx,8);
+        /* Sumatra version of MuPDF v1.4 -- use locally installed fonts */
+        pdf_install_load_system_font_funcs(ctx);
+        }
+    fz_catch(ctx)
+        {
+        fz_drop_context(ctx);
+        return(-1);
+        }
+    return(wmupdfdoc_open_document(mdoc,ctx,filename,password));
+    }
+
+
+/*
+** Open a second session on the same file as src for use by another thread.
+** The new session's context is cloned from src's, so it shares the resource
+** store (fonts, images, glyphs), but it has its own fz_document.  The source
+** session must have been opened with locking (HAVE_PTHREAD_LIB).
+**
+** Returns 0 on success, same error codes as wmupdfdoc_open().
+*/
+int wmupdfdoc_clone(WMUPDFDOC *dst,WMUPDFDOC *src,char *password)
+
+    {
+    fz_context *ctx;
+
+    wmupdfdoc_init(dst);
+    if (src->ctx==NULL)
+        return(-1);
+    ctx = fz_clone_context((fz_context *)src->ctx);
+    if (!ctx)
+        return(-1);
+    return(wmupdfdoc_open_document(dst,ctx,src->filename,password));
+    }
+
+
+/*
+** Open filename on context ctx and attach both to mdoc.  ctx is dropped on failure.
+*/
+static int wmupdfdoc_open_document(WMUPDFDOC *mdoc,fz_context *ctx,char *filename,char *password)
+
+    {
+    fz_document *doc;
+    int status;
+
+    doc=NULL;
+    status=0;
+    fz_var(doc);
+    fz_var(status);
+    fz_try(ctx)
+        {
+        status=-2;
+        doc=fz_open_document(ctx,filename);
+        status=-3;
+        if (fz_needs_password(ctx,doc)
+              && !fz_authenticate_password(ctx,doc,password==NULL ? "" : password))
+            fz_throw(ctx,FZ_ERROR_GENERIC,"cannot authenticate password");
+        status=-2;
+        mdoc->np=fz_count_pages(ctx,doc);
+        status=0;
+        }
+    fz_catch(ctx)
+        {
+        if (doc!=NULL)
+            fz_drop_document(ctx,doc);
+        fz_drop_context(ctx);
+        return(status);
+        }
+    strncpy(mdoc->filename,filename,MAXFILENAMELEN-1);
+    mdoc->filename[MAXFILENAMELEN-1]='\0';
+    mdoc->ctx=(void *)ctx;
+    mdoc->doc=(void *)doc;
+    return(0);
+    }
+
+
+/*
+** Read the info dictionary fields, outline, and page sizes of the session's
+** document in one pass (see WMUPDFMETA).  Page sizes come from the page tree
+** (no page contents are loaded).  Returns 0 on success.
+*/
+int wmupdfdoc_harvest(WMUPDFDOC *mdoc)
+
+    {
+    fz_context *ctx;
+    pdf_document *xref;
+    WMUPDFMETA *meta;
+    int i;
+    static char *funcname="wmupdfdoc_harvest";
+
+    ctx=(fz_context *)mdoc->ctx;
+    if (ctx==NULL)
+        return(-1);
+    meta=&mdoc->meta;
+    if (meta->valid)
+        return(0);
+    meta->outline=wpdfoutline_read_from_pdfdoc(mdoc);
+    wmupdfdoc_info_field(mdoc,"Author",meta->author,255);
+    wmupdfdoc_info_field(mdoc,"Title",meta->title,255);
+    wmupdfdoc_info_field(mdoc,"CreationDate",meta->cdate,127);
+    xref=pdf_specifics(ctx,(fz_document *)mdoc->doc);
+    if (xref!=NULL && mdoc->np>0)
+        {
+        willus_mem_alloc_warn((void **)&meta->pagesize,2*mdoc->np*sizeof(double),funcname,10);
+        for (i=0;i<mdoc->np;i++)
+            wmupdf_page_size(ctx,xref,i,&meta->pagesize[2*i]);
+        }
+    meta->valid=1;
+    return(0);
+    }
+
+
+/*
+** Width and height (points) of page index pageno (0=first), as MuPDF would
+** bound it:  MediaBox clipped to CropBox and rotated by Rotate (all possibly
+** inherited).  size[0]=size[1]=-1 if it can't be determined.
+*/
+static void wmupdf_page_size(fz_context *ctx,pdf_document *xref,int pageno,double *size)
+
+    {
+    size[0]=size[1]=-1.;
+    fz_try(ctx)
+        {
+        static char *boxname[] = {"MediaBox","CropBox"};
+        pdf_obj *page,*obj;
+        double bbox[4];
+        int i,rot;
+
+        page=pdf_lookup_page_obj(ctx,xref,pageno);
+        bbox[0]=bbox[1]=-1e10;
+        bbox[2]=bbox[3]=1e10;
+        for (i=0;i<2;i++)
+            {
+            pdf_obj *box;
+
+            box=wmupdf_inherited_item(ctx,page,boxname[i]);
+            if (box!=NULL && pdf_is_array(ctx,box) && pdf_array_len(ctx,box)==4)
+                {
+                double x[4];
+                int j;
+
+                for (j=0;j<4;j++)
+                    x[j]=pdf_to_real(ctx,pdf_array_get(ctx,box,j));
+                /* Boxes can be specified with any two opposite corners */
+                for (j=0;j<2;j++)
+                    if (x[j]>x[j+2])
+                        {
+                        double t;
+                        t=x[j];
+                        x[j]=x[j+2];
+                        x[j+2]=t;
+                        }
+                for (j=0;j<4;j++)
+                    if ((j<2 && x[j]>bbox[j]) || (j>=2 && x[j]<bbox[j]))
+                        bbox[j]=x[j];
+                }
+            }
+        if (bbox[0] < -9e9)
+            bbox[0] = 0.;
+        if (bbox[1] < -9e9)
+            bbox[1] = 0.;
+        if (bbox[2] > 9e9)
+            bbox[2] = 612.;
+        if (bbox[3] > 9e9)
+            bbox[3] = 792.;
+        obj=wmupdf_inherited_item(ctx,page,"Rotate");
+        rot = (obj!=NULL) ? pdf_to_int(ctx,obj) : 0;
+        /* Snapped to 0, 90, 180, or 270 the same way pdf_load_page() does it */
+        rot = ((rot%360)+360)%360;
+        rot = 90*((rot+45)/90);
+        if (rot>=360)
+            rot=0;
+        if (bbox[2]>bbox[0] && bbox[3]>bbox[1])
+            {
+            size[0] = (rot==90 || rot==270) ? bbox[3]-bbox[1] : bbox[2]-bbox[0];
+            size[1] = (rot==90 || rot==270) ? bbox[2]-bbox[0] : bbox[3]-bbox[1];
+            }
+        }
+    fz_catch(ctx)
+        {
+        size[0]=size[1]=-1.;
+        }
+    }
+
+
+/*
+** Look up a page attribute, following the Parent chain of the page tree
+** for inheritable attributes (MediaBox, CropBox, Rotate, Resources).
+*/
+static pdf_obj *wmupdf_inherited_item(fz_context *ctx,pdf_obj *node,char *key)
+
+    {
+    int depth;
+
+    /* Depth limit guards against circular Parent references */
+    for (depth=0;node!=NULL && depth<64;depth++)
+        {
+        pdf_obj *obj;
+
+        obj=pdf_dict_gets(ctx,node,key);
+        if (obj!=NULL)
+            return(obj);
+        node=pdf_dict_gets(ctx,node,"Parent");
+        }
+    return(NULL);
+    }
+
+
+void wmupdfdoc_close(WMUPDFDOC *mdoc)
+
+    {
+    fz_context *ctx;
+    int i;
+    static char *funcname="wmupdfdoc_close";
+
+    ctx=(fz_context *)mdoc->ctx;
+    if (ctx==NULL)
+        return;
+    if (mdoc->meta.outline!=NULL)
+        {
+        wpdfoutline_free(mdoc->meta.outline);
+        willus_mem_free((double **)&mdoc->meta.outline,funcname);
+        }
+    willus_mem_free((double **)&mdoc->meta.pagesize,funcname);
+    for (i=0;i<WMUPDFDOC_MAXLISTS;i++)
+        if (mdoc->dlist[i].list!=NULL)
+            fz_drop_display_list(ctx,(fz_display_list *)mdoc->dlist[i].list);
+    if (mdoc->doc!=NULL)
+        fz_drop_document(ctx,(fz_document *)mdoc->doc);
+    fz_flush_warnings(ctx);
+    fz_drop_context(ctx);
+    wmupdfdoc_init(mdoc);
+    }
+
+
+#ifdef HAVE_PTHREAD_LIB
+static pthread_mutex_t wmupdf_mutex[FZ_LOCK_MAX];
+static pthread_once_t wmupdf_mutex_once=PTHREAD_ONCE_INIT;
+static fz_locks_context wmupdf_locks_ctx;
+
+/*
+** MuPDF lock callbacks.  All sessions share the same set of mutexes.
+*/
+static fz_locks_context *wmupdf_locks(void)
+
+    {
+    pthread_once(&wmupdf_mutex_once,wmupdf_locks_init);
+    return(&wmupdf_locks_ctx);
+    }
+
+
+static void wmupdf_locks_init(void)
+
+    {
+    int i;
+
+    for (i=0;i<FZ_LOCK_MAX;i++)
+        pthread_mutex_init(&wmupdf_mutex[i],NULL);
+    wmupdf_locks_ctx.user=NULL;
+    wmupdf_locks_ctx.lock=wmupdf_lock;
+    wmupdf_locks_ctx.unlock=wmupdf_unlock;
+    }
+
+
+static void wmupdf_lock(void *user,int lock)
+
+    {
+    pthread_mutex_lock(&wmupdf_mutex[lock]);
+    }
+
+
+static void wmupdf_unlock(void *user,int lock)
+
+    {
+    pthread_mutex_unlock(&wmupdf_mutex[lock]);
+    }
+#endif /* HAVE_PTHREAD_LIB */
+
+
+/*
+** Get the display list for page pageno (1=first page) of the session.  The page
+** contents are only interpreted if the list isn't already cached.  The page
+** bounds (points) are put into bounds[0..3] (x0,y0,x1,y1) if bounds!=NULL.
+** Every successful call must be matched by a call to
+** wmupdfdoc_display_list_release().  Returns NULL on error.
+**
+** The returned value is an fz_display_list *.
+*/
+void *wmupdfdoc_display_list_get(WMUPDFDOC *mdoc,int pageno,double *bounds)
+
+    {
+    fz_context *ctx;
+    fz_page *page;
+    fz_display_list *list;
+    fz_device *dev;
+    fz_rect rect;
+    WMUPDFDOCLIST *dl;
+    int i;
+
+    ctx=(fz_context *)mdoc->ctx;
+    if (ctx==NULL || pageno<1 || pageno>mdoc->np)
+        return(NULL);
+    for (i=0;i<WMUPDFDOC_MAXLISTS;i++)
+        if (mdoc->dlist[i].pageno==pageno)
+            break;
+    if (i<WMUPDFDOC_MAXLISTS)
+        {
+        dl=&mdoc->dlist[i];
+        mdoc->dlist_hits++;
+        dl->inuse++;
+        dl->lastused=++mdoc->dlist_count;
+        if (bounds!=NULL)
+            memcpy(bounds,dl->bounds,4*sizeof(double));
+        return(dl->list);
+        }
+    mdoc->dlist_misses++;
+    page=NULL;
+    list=NULL;
+    dev=NULL;
+    fz_var(page);
+    fz_var(list);
+    fz_var(dev);
+    fz_try(ctx)
+        {
+        page=fz_load_page(ctx,(fz_document *)mdoc->doc,pageno-1);
+        fz_bound_page(ctx,page,&rect);
+        list=fz_new_display_list(ctx);
+        dev=fz_new_list_device(ctx,list);
+        fz_run_page(ctx,page,dev,&fz_identity,NULL);
+        }
+    fz_always(ctx)
+        {
+        fz_drop_device(ctx,dev);
+        fz_drop_page(ctx,page);
+        }
+    fz_catch(ctx)
+        {
+        fz_drop_display_list(ctx,list);
+        return(NULL);
+        }
+    /* Replace least recently used slot that isn't in use */
+    for (dl=NULL,i=0;i<WMUPDFDOC_MAXLISTS;i++)
+        if (mdoc->dlist[i].inuse==0 && (dl==NULL || mdoc->dlist[i].lastused<dl->lastused))
+            dl=&mdoc->dlist[i];
+    if (dl==NULL)
+        {
+        /* All slots in use--caller gets an uncached list */
+        if (bounds!=NULL)
+            {
+            bounds[0]=rect.x0;
+            bounds[1]=rect.y0;
+            bounds[2]=rect.x1;
+            bounds[3]=rect.y1;
+            }
+        return((void *)list);
+        }
+    if (dl->list!=NULL)
+        fz_drop_display_list(ctx,(fz_display_list *)dl->list);
+    dl->pageno=pageno;
+    dl->list=(void *)list;
+    dl->bounds[0]=rect.x0;
+    dl->bounds[1]=rect.y0;
+    dl->bounds[2]=rect.x1;
+    dl->bounds[3]=rect.y1;
+    dl->inuse=1;
+    dl->lastused=++mdoc->dlist_count;
+    if (bounds!=NULL)
+        memcpy(bounds,dl->bounds,4*sizeof(double));
+    return((void *)list);
+    }
+
+
+void wmupdfdoc_display_list_release(WMUPDFDOC *mdoc,void *list)
+
+    {
+    int i;
+
+    if (list==NULL || mdoc->ctx==NULL)
+        return;
+    for (i=0;i<WMUPDFDOC_MAXLISTS;i++)
+        if (mdoc->dlist[i].list==list)
+            {
+            if (mdoc->dlist[i].inuse>0)
+                mdoc->dlist[i].inuse--;
+            return;
+            }
+    /* Not cached */
+    fz_drop_display_list((fz_context *)mdoc->ctx,(fz_display_list *)list);
+    }
+
+
+/*
+** Same as wmupdf_info_field(), but uses an open document session.
+*/
+int wmupdfdoc_info_field(WMUPDFDOC *mdoc,char *label,char *buf,int maxlen)
+
+    {
+    fz_context *ctx;
+    pdf_document *xref;
+    pdf_obj *info,*obj;
+
+    buf[0]='\0';
+    ctx=(fz_context *)mdoc->ctx;
+    if (ctx==NULL)
+        return(-1);
+    if (mdoc->meta.valid)
+        {
+        char *s;
+
+        s=!strcmp(label,"Author") ? mdoc->meta.author
+                : (!strcmp(label,"Title") ? mdoc->meta.title
+                : (!strcmp(label,"CreationDate") ? mdoc->meta.cdate : NULL));
+        if (s!=NULL)
+            {
+            strncpy(buf,s,maxlen-1);
+            buf[maxlen-1]='\0';
+            return(0);
+            }
+        }
+    xref=pdf_specifics(ctx,(fz_document *)mdoc->doc);
+    if (xref==NULL)
+        return(-2);
+    fz_try(ctx)
+        {
+        if (pdf_trailer(ctx,xref)!=NULL
+            && (info=pdf_dict_gets(ctx,pdf_trailer(ctx,xref),"Info"))!=NULL
+            && (obj=pdf_dict_gets(ctx,info,label))!=NULL
+            && pdf_is_string(ctx,obj))
+            {
+            strncpy(buf,pdf_to_str_buf(ctx,obj),maxlen-1);
+            buf[maxlen-1]='\0';
+            }
+        }
+    fz_catch(ctx)
+        {
+        }
+    return(0);
+    }
+
+
 int wmupdf_numpages(char *filename)
 
     {
@@ -1382,104 +1904,72 @@ int wtextchars_fill_from_page_ex(WTEXTCHARS *wtc,char *filename,int pageno,char
                                  int boundingbox)
 
     {
-    fz_document *doc=NULL;
-    fz_display_list *list=NULL;
+    WMUPDFDOC _mdoc,*mdoc;
+    int status;
+
+    mdoc=&_mdoc;
+    wmupdfdoc_init(mdoc);
+    status=wmupdfdoc_open(mdoc,filename,password);
+    if (status<0)
+        return(status);
+    status=wtextchars_fill_from_pdfdoc(wtc,mdoc,pageno,boundingbox);
+    wmupdfdoc_close(mdoc);
+    return(status);
+    }
+
+
+/*
+** Same as wtextchars_fill_from_page_ex(), but uses an open document session.
+** The page display list is shared with bmpmupdf_pdfdoc_to_bmp().
+*/
+int wtextchars_fill_from_pdfdoc(WTEXTCHARS *wtc,WMUPDFDOC *mdoc,int pageno,int boundingbox)
+
+    {
     fz_context *ctx;
-    fz_text_sheet *textsheet=NULL;
-    fz_page *page;
-    fz_text_page *text=NULL;
-    fz_device *dev=NULL;
-    fz_rect bounds;
+    fz_display_list *list;
+    fz_text_sheet *textsheet;
+    fz_text_page *text;
+    fz_device *dev;
+    double bounds[4];
+    int status;
 
-    fz_var(doc);
-    ctx=fz_new_context(NULL,NULL,FZ_STORE_DEFAULT);
+    ctx=(fz_context *)mdoc->ctx;
     if (ctx==NULL)
         return(-1);
+    list=(fz_display_list *)wmupdfdoc_display_list_get(mdoc,pageno,bounds);
+    if (list==NULL)
+        return(-4);
+    wtc->width=fabs(bounds[2]-bounds[0]);
+    wtc->height=fabs(bounds[3]-bounds[1]);
+    textsheet=NULL;
+    text=NULL;
+    dev=NULL;
+    status=0;
+    fz_var(textsheet);
+    fz_var(text);
+    fz_var(dev);
     fz_try(ctx)
         {
-        fz_register_document_handlers(ctx);
-        fz_set_aa_level(ctx,8);
-        /* Sumatra version of MuPDF v1.4 -- use locally installed fonts */
-        pdf_install_load_system_font_funcs(ctx);
-        doc=fz_open_document(ctx,filename);
-        if (doc==NULL)
-            {
-            fz_drop_context(ctx);
-            return(-2);
-            }
-        if (fz_needs_password(ctx,doc) && !fz_authenticate_password(ctx,doc,password))
-            {
-            fz_drop_document(ctx,doc);
-            fz_drop_context(ctx);
-            return(-3);
-            }
-        page=fz_load_page(ctx,doc,pageno-1);
-        if (page==NULL)
-            {
-            fz_drop_page(ctx,page);
-            fz_drop_document(ctx,doc);
-            fz_drop_context(ctx);
-            return(-3);
-            }
-        fz_try(ctx)
-            {
-            list=fz_new_display_list(ctx);
-            dev=fz_new_list_device(ctx,list);
-            fz_run_page(ctx,page,dev,&fz_identity,NULL);
-            }
-        fz_always(ctx)
-            {
-            fz_drop_device(ctx,dev);
-            dev=NULL;
-            }
-        fz_catch(ctx)
-            {
-            fz_drop_display_list(ctx,list);
-            fz_drop_page(ctx,page);
-            fz_drop_document(ctx,doc);
-            fz_drop_context(ctx);
-            return(-4);
-            }
-        fz_var(text);
-        fz_bound_page(ctx,page,&bounds);
-        wtc->width=fabs(bounds.x1-bounds.x0);
-        wtc->height=fabs(bounds.y1-bounds.y0);
         textsheet=fz_new_text_sheet(ctx);
-        fz_try(ctx)
-            {
-            text=fz_new_text_page(ctx);
-            dev=fz_new_text_device(ctx,textsheet,text);
-            if (list)
-                fz_run_display_list(ctx,list,dev,&fz_identity,&fz_infinite_rect,NULL);
-            else
-                fz_run_page(ctx,page,dev,&fz_identity,NULL);
-            fz_drop_device(ctx,dev);
-            dev=NULL;
-            wtextchars_add_fz_chars(wtc,ctx,text,boundingbox);
-            }
-        fz_always(ctx)
-            {
-            fz_drop_device(ctx,dev);
-            dev=NULL;
-            fz_drop_text_page(ctx,text);
-            fz_drop_text_sheet(ctx,textsheet);
-            fz_drop_display_list(ctx,list);
-            fz_drop_page(ctx,page);
-            fz_drop_document(ctx,doc);
-            }
-        fz_catch(ctx)
-            {
-            fz_drop_context(ctx);
-            return(-5);
-            }
+        text=fz_new_text_page(ctx);
+        dev=fz_new_text_device(ctx,textsheet,text);
+        fz_run_display_list(ctx,list,dev,&fz_identity,&fz_infinite_rect,NULL);
+        fz_drop_device(ctx,dev);
+        dev=NULL;
+        wtextchars_add_fz_chars(wtc,ctx,text,boundingbox);
+        }
+    fz_always(ctx)
+        {
+        fz_drop_device(ctx,dev);
+        fz_drop_text_page(ctx,text);
+        fz_drop_text_sheet(ctx,textsheet);
         }
     fz_catch(ctx)
         {
-        fz_drop_context(ctx);
-        return(-20);
+        status=-5;
         }
-    fz_drop_context(ctx);
-    return(0);
+    wmupdfdoc_display_list_release(mdoc,list);
+    return(status);
     }
 
 
@@ -1636,6 +2126,46 @@ WPDFOUTLINE *wpdfoutline_read_from_pdf_file(char *filename)
     }
 
 
+/*
+** Same as wpdfoutline_read_from_pdf_file(), but uses an open document session.
+** The returned outline belongs to the caller, who frees it with
+** wpdfoutline_free().  If the session has been harvested (wmupdfdoc_harvest()),
+** the first call is handed the harvested outline (the session no longer owns
+** it) and any later call loads a new copy.
+*/
+WPDFOUTLINE *wpdfoutline_read_from_pdfdoc(WMUPDFDOC *mdoc)
+
+    {
+    fz_context *ctx;
+    fz_outline *fzoutline;
+    WPDFOUTLINE *wpdfoutline;
+
+    ctx=(fz_context *)mdoc->ctx;
+    if (ctx==NULL)
+        return(NULL);
+    /* Harvested outline?  Caller takes it over. */
+    if (mdoc->meta.valid && mdoc->meta.outline!=NULL)
+        {
+        wpdfoutline=mdoc->meta.outline;
+        mdoc->meta.outline=NULL;
+        return(wpdfoutline);
+        }
+    wpdfoutline=NULL;
+    fz_try(ctx)
+        {
+        fzoutline=fz_load_outline(ctx,(fz_document *)mdoc->doc);
+        wpdfoutline=wpdfoutline_convert_from_fitz_outline(fzoutline);
+        if (fzoutline!=NULL)
+            fz_drop_outline(ctx,fzoutline);
+        }
+    fz_catch(ctx)
+        {
+        return(NULL);
+        }
+    return(wpdfoutline);
+    }
+
+
 /*
 ** Convert fz_outline structure to WPDFOUTLINE structure
 */
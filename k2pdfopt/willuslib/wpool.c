@@ -0,0 +1,239 @@
+/*
+** WPOOL.C      For WILLUSLIB, a small pool of worker threads which run
+**              a function over the indices 0..n-1 of a job and return
+**              once every index is done.  The calling thread works on
+**              the job too.  Without pthreads (or with no threads) the
+**              job is simply run serially on the caller.
+**
+** Part of willus.com general purpose C code library.
+**
+** Copyright (C) 2015  http://willus.com
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Affero General Public License as
+** published by the Free Software Foundation, either version 3 of the
+** License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Affero General Public License for more details.
+**
+** You should have received a copy of the GNU Affero General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+*/
+#include <stdio.h>
+#include "willus.h"
+
+#ifdef HAVE_PTHREAD_LIB
+#include <pthread.h>
+
+typedef struct
+    {
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;  /* Signaled when a job is posted or on quit */
+    pthread_cond_t done;    /* Signaled when the last index of a job finishes */
+    pthread_t *thread;
+    int nthreads;
+    void (*func)(void *data,int i);
+    void *data;
+    int n;
+    int next;       /* Next index to hand out */
+    int ndone;      /* Indices finished */
+    int chunk;      /* Indices handed out per lock */
+    int jobid;      /* Bumped for each job so idle threads see new work */
+    int quit;
+    } WPOOLSYS;
+
+static void *wpool_thread(void *data);
+static void wpool_work(WPOOLSYS *sys);
+#endif
+
+
+void wpool_init(WPOOL *pool)
+
+    {
+    pool->nthreads=0;
+    pool->sys=NULL;
+    }
+
+
+/*
+** Start nthreads worker threads.  Returns 0 if started, < 0 if not (in which
+** case wpool_run() runs its jobs serially).
+*/
+int wpool_start(WPOOL *pool,int nthreads)
+
+    {
+#ifdef HAVE_PTHREAD_LIB
+    WPOOLSYS *sys;
+    int i;
+    static char *funcname="wpool_start";
+
+    wpool_init(pool);
+    if (nthreads<1)
+        return(-1);
+    willus_mem_alloc_warn((void **)&sys,sizeof(WPOOLSYS),funcname,10);
+    willus_mem_alloc_warn((void **)&sys->thread,nthreads*sizeof(pthread_t),funcname,10);
+    pthread_mutex_init(&sys->mutex,NULL);
+    pthread_cond_init(&sys->queued,NULL);
+    pthread_cond_init(&sys->done,NULL);
+    sys->nthreads=0;
+    sys->func=NULL;
+    sys->data=NULL;
+    sys->n=sys->next=sys->ndone=0;
+    sys->chunk=1;
+    sys->jobid=0;
+    sys->quit=0;
+    pool->sys=(void *)sys;
+    for (i=0;i<nthreads;i++)
+        {
+        if (pthread_create(&sys->thread[sys->nthreads],NULL,wpool_thread,(void *)sys)!=0)
+            break;
+        sys->nthreads++;
+        }
+    pool->nthreads=sys->nthreads;
+    if (pool->nthreads==0)
+        {
+        wpool_end(pool);
+        return(-2);
+        }
+    return(0);
+#else
+    wpool_init(pool);
+    return(-1);
+#endif
+    }
+
+
+/*
+** Call func(data,i) for i=0..n-1, spread over the pool threads and the
+** caller, and return when all n calls have finished.  The order of the
+** calls is not defined, so func() should only write to slot i of its output.
+*/
+void wpool_run(WPOOL *pool,void (*func)(void *data,int i),void *data,int n)
+
+    {
+    int i;
+#ifdef HAVE_PTHREAD_LIB
+    WPOOLSYS *sys;
+
+    sys=(WPOOLSYS *)pool->sys;
+    if (sys!=NULL && n>1)
+        {
+        pthread_mutex_lock(&sys->mutex);
+        sys->func=func;
+        sys->data=data;
+        sys->n=n;
+        sys->next=0;
+        sys->ndone=0;
+        /* A few chunks per thread keeps the lock traffic low */
+        sys->chunk=n/(4*(sys->nthreads+1));
+        if (sys->chunk<1)
+            sys->chunk=1;
+        sys->jobid++;
+        pthread_cond_broadcast(&sys->queued);
+        pthread_mutex_unlock(&sys->mutex);
+        wpool_work(sys);
+        pthread_mutex_lock(&sys->mutex);
+        while (sys->ndone<sys->n)
+            pthread_cond_wait(&sys->done,&sys->mutex);
+        sys->func=NULL;
+        sys->n=0;
+        pthread_mutex_unlock(&sys->mutex);
+        return;
+        }
+#endif
+    for (i=0;i<n;i++)
+        func(data,i);
+    }
+
+
+/*
+** Stop the pool threads.
+*/
+void wpool_end(WPOOL *pool)
+
+    {
+#ifdef HAVE_PTHREAD_LIB
+    WPOOLSYS *sys;
+    int i;
+    static char *funcname="wpool_end";
+
+    sys=(WPOOLSYS *)pool->sys;
+    if (sys==NULL)
+        return;
+    pthread_mutex_lock(&sys->mutex);
+    sys->quit=1;
+    pthread_cond_broadcast(&sys->queued);
+    pthread_mutex_unlock(&sys->mutex);
+    for (i=0;i<sys->nthreads;i++)
+        pthread_join(sys->thread[i],NULL);
+    pthread_cond_destroy(&sys->done);
+    pthread_cond_destroy(&sys->queued);
+    pthread_mutex_destroy(&sys->mutex);
+    willus_mem_free((double **)&sys->thread,funcname);
+    willus_mem_free((double **)&sys,funcname);
+#endif
+    wpool_init(pool);
+    }
+
+
+#ifdef HAVE_PTHREAD_LIB
+static void *wpool_thread(void *data)
+
+    {
+    WPOOLSYS *sys;
+    int jobid;
+
+    sys=(WPOOLSYS *)data;
+    pthread_mutex_lock(&sys->mutex);
+    jobid=sys->jobid;
+    while (1)
+        {
+        while (!sys->quit && sys->jobid==jobid)
+            pthread_cond_wait(&sys->queued,&sys->mutex);
+        if (sys->quit)
+            break;
+        jobid=sys->jobid;
+        pthread_mutex_unlock(&sys->mutex);
+        wpool_work(sys);
+        pthread_mutex_lock(&sys->mutex);
+        }
+    pthread_mutex_unlock(&sys->mutex);
+    return(NULL);
+    }
+
+
+/*
+** Take chunks of the current job until none are left.
+*/
+static void wpool_work(WPOOLSYS *sys)
+
+    {
+    void (*func)(void *data,int i);
+    void *data;
+    int i,i0,i1;
+
+    pthread_mutex_lock(&sys->mutex);
+    func=sys->func;
+    data=sys->data;
+    while (func!=NULL && sys->next<sys->n)
+        {
+        i0=sys->next;
+        i1=i0+sys->chunk;
+        if (i1>sys->n)
+            i1=sys->n;
+        sys->next=i1;
+        pthread_mutex_unlock(&sys->mutex);
+        for (i=i0;i<i1;i++)
+            func(data,i);
+        pthread_mutex_lock(&sys->mutex);
+        sys->ndone+=i1-i0;
+        if (sys->ndone>=sys->n)
+            pthread_cond_broadcast(&sys->done);
+        }
+    pthread_mutex_unlock(&sys->mutex);
+    }
+#endif